@@ -0,0 +1,95 @@
+#include <string.h>
+#include "crc32c.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_HARDWARE
+#endif
+
+#define CRC32C_POLY 0x82F63B78 // Castagnoli polynomial, bit-reversed
+
+static uint32_t crc_table[8][256]; // Slicing-by-8 tables for CPUs without the instruction
+static int crc_ready;              // 1 once the tables are built, 2 if the instruction is used instead
+
+static void crc_init(void) {
+    // Build the tables, or note that the CPU computes the checksum itself
+#ifdef CRC32C_HARDWARE
+    if (__builtin_cpu_supports("sse4.2")) {
+        __atomic_store_n(&crc_ready, 2, __ATOMIC_RELEASE);
+        return;
+    }
+#endif
+    for (int i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc_table[0][i] = crc;
+    }
+    for (int i = 0; i < 256; i++) {
+        for (int k = 1; k < 8; k++) {
+            crc_table[k][i] = (crc_table[k - 1][i] >> 8) ^ crc_table[0][crc_table[k - 1][i] & 0xFF];
+        }
+    }
+    __atomic_store_n(&crc_ready, 1, __ATOMIC_RELEASE); // Threads racing here build the same tables
+}
+
+#ifdef CRC32C_HARDWARE
+__attribute__((target("sse4.2"))) static uint32_t crc_hardware(uint32_t crc, const unsigned char *data, long length) {
+    // Eight bytes per instruction, then the tail a byte at a time
+    uint64_t wide = crc;
+    for (; length >= 8; data += 8, length -= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        wide = _mm_crc32_u64(wide, word);
+    }
+    crc = (uint32_t)wide;
+    for (; length > 0; data++, length--) {
+        crc = _mm_crc32_u8(crc, *data);
+    }
+    return crc;
+}
+#endif
+
+static uint32_t crc_software(uint32_t crc, const unsigned char *data, long length) {
+    // Eight bytes per step through the sliced tables (little-endian word order)
+    for (; length >= 8; data += 8, length -= 8) {
+        uint32_t low, high;
+        memcpy(&low, data, sizeof(low));
+        memcpy(&high, data + 4, sizeof(high));
+        low ^= crc;
+        crc = crc_table[7][low & 0xFF] ^ crc_table[6][(low >> 8) & 0xFF] ^ crc_table[5][(low >> 16) & 0xFF] ^
+              crc_table[4][low >> 24] ^ crc_table[3][high & 0xFF] ^ crc_table[2][(high >> 8) & 0xFF] ^
+              crc_table[1][(high >> 16) & 0xFF] ^ crc_table[0][high >> 24];
+    }
+    for (; length > 0; data++, length--) {
+        crc = (crc >> 8) ^ crc_table[0][(crc ^ *data) & 0xFF];
+    }
+    return crc;
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, long length) {
+    // Checksum a block, picking the instruction or the tables on first use
+    int ready = __atomic_load_n(&crc_ready, __ATOMIC_ACQUIRE);
+    if (ready == 0) {
+        crc_init();
+        ready = crc_ready;
+    }
+#ifdef CRC32C_HARDWARE
+    if (ready == 2) {
+        return ~crc_hardware(~crc, data, length);
+    }
+#endif
+    return ~crc_software(~crc, data, length);
+}
+
+uint32_t crc32c_zeros(uint32_t crc, long length) {
+    // Checksum a run of zero bytes that is not in memory, such as a hole
+    static const unsigned char zeros[4096];
+    while (length > 0) {
+        long part = length < (long)sizeof(zeros) ? length : (long)sizeof(zeros);
+        crc = crc32c(crc, zeros, part);
+        length -= part;
+    }
+    return crc;
+}
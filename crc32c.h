@@ -0,0 +1,11 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stdint.h>
+
+// CRC32C (Castagnoli) of a block, continuing from crc; start a new checksum
+// with 0. Uses the SSE4.2 crc32 instruction when the CPU has it, tables otherwise.
+uint32_t crc32c(uint32_t crc, const void *data, long length);
+uint32_t crc32c_zeros(uint32_t crc, long length);
+
+#endif
@@ -0,0 +1,979 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "dirindex.h"
+
+#define DIR_INITIAL_SLOTS 256
+#define DIR_INITIAL_DIRS 16
+#define DIR_INITIAL_PATHS 16
+#define DIR_INITIAL_LONGS 64
+
+// Where the 13 UCS-2 units of a long-name entry sit, two bytes each
+static const unsigned char dir_long_places[13] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+
+// Upper case of each Latin-1 unit, filled in by dir_fold_init; units above 0xFF fold to themselves
+static uint16_t dir_fold_table[256];
+
+static uint64_t dir_hash(int dir, const unsigned char *bytes, int length) {
+    // FNV-1a over the directory cluster followed by the key bytes
+    uint64_t hash = 1469598103934665603ULL;
+    for (int i = 0; i < 4; i++) {
+        hash = (hash ^ ((dir >> (8 * i)) & 0xFF)) * 1099511628211ULL;
+    }
+    for (int i = 0; i < length; i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static void dir_fold_init(void) {
+    // Fill the case-folding table: ASCII and Latin-1 lower-case letters map to upper case
+    for (int c = 0; c < 256; c++) {
+        dir_fold_table[c] = (c >= 'a' && c <= 'z') || (c >= 0xE0 && c <= 0xFE && c != 0xF7) ? c - 0x20 : c;
+    }
+}
+
+static inline uint16_t dir_fold(uint16_t unit) {
+    // Case-folded form of a UCS-2 unit
+    return unit < 256 ? dir_fold_table[unit] : unit;
+}
+
+static uint64_t dir_long_hash(int dir, const uint16_t *units, int count) {
+    // dir_hash of the case-folded units, low byte first
+    unsigned char folded[2 * DIR_LONG_PIECES * 13];
+    for (int i = 0; i < count; i++) {
+        uint16_t unit = dir_fold(units[i]);
+        folded[2 * i] = unit & 0xFF;
+        folded[2 * i + 1] = unit >> 8;
+    }
+    return dir_hash(dir, folded, 2 * count);
+}
+
+static int dir_utf8_units(const char *name, uint16_t *units) {
+    // Decode a UTF-8 name into UCS-2 units, taking stray bytes as Latin-1; -1 if it is longer than DIR_LONG_MAX
+    const unsigned char *p = (const unsigned char *)name;
+    int count = 0;
+
+    while (*p != '\0') {
+        uint32_t unit = *p++;
+        if (unit >= 0xC0 && unit < 0xE0 && (p[0] & 0xC0) == 0x80) {
+            unit = (unit & 0x1F) << 6 | (p[0] & 0x3F);
+            p += 1;
+        } else if (unit >= 0xE0 && unit < 0xF0 && (p[0] & 0xC0) == 0x80 && (p[1] & 0xC0) == 0x80) {
+            unit = (unit & 0x0F) << 12 | (p[0] & 0x3F) << 6 | (p[1] & 0x3F);
+            p += 2;
+        } else if (unit >= 0xF0 && unit < 0xF8 && (p[0] & 0xC0) == 0x80 && (p[1] & 0xC0) == 0x80 && (p[2] & 0xC0) == 0x80) {
+            unit = '_'; // Outside UCS-2
+            p += 3;
+        }
+        if (count == DIR_LONG_MAX) {
+            return -1;
+        }
+        units[count++] = unit;
+    }
+    return count;
+}
+
+static int dir_units_utf8(const uint16_t *units, int count, char *name) {
+    // Encode UCS-2 units as UTF-8 into a buffer of DIR_NAME_MAX bytes and return its length
+    int length = 0;
+
+    for (int i = 0; i < count; i++) {
+        uint16_t unit = units[i];
+        if (unit < 0x80) {
+            name[length++] = unit;
+        } else if (unit < 0x800) {
+            name[length++] = 0xC0 | unit >> 6;
+            name[length++] = 0x80 | (unit & 0x3F);
+        } else {
+            name[length++] = 0xE0 | unit >> 12;
+            name[length++] = 0x80 | ((unit >> 6) & 0x3F);
+            name[length++] = 0x80 | (unit & 0x3F);
+        }
+    }
+    name[length] = '\0';
+    return length;
+}
+
+static int dir_grow_slots(dir_index *index) {
+    // Double the entry table and re-insert everything
+    int old_size = index->slot_mask + 1;
+    dir_slot *old = index->slots;
+    int size = 2 * old_size;
+    dir_slot *slots = malloc(size * sizeof(dir_slot));
+
+    if (slots == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < size; i++) {
+        slots[i].offset = -1;
+    }
+    for (int i = 0; i < old_size; i++) {
+        if (old[i].offset < 0) {
+            continue;
+        }
+        uint64_t h = dir_hash(old[i].dir, old[i].name, 11) & (size - 1);
+        while (slots[h].offset >= 0) {
+            h = (h + 1) & (size - 1);
+        }
+        slots[h] = old[i];
+    }
+    free(old);
+    index->slots = slots;
+    index->slot_mask = size - 1;
+    return 0;
+}
+
+static void dir_insert(dir_index *index, int dir, long offset) {
+    // Add an entry, or move it if the directory already has one by that name
+    const unsigned char *name = (const unsigned char *)index->image + offset;
+    uint64_t h;
+
+    if (2 * (index->slot_used + 1) > index->slot_mask + 1 && dir_grow_slots(index) < 0) {
+        return;
+    }
+    h = dir_hash(dir, name, 11) & index->slot_mask;
+    while (index->slots[h].offset >= 0) {
+        if (index->slots[h].dir == dir && memcmp(index->slots[h].name, name, 11) == 0) {
+            index->slots[h].offset = offset; // Name was deleted and written again
+            return;
+        }
+        h = (h + 1) & index->slot_mask;
+    }
+    index->slots[h].dir = dir;
+    memcpy(index->slots[h].name, name, 11);
+    index->slots[h].offset = offset;
+    index->slot_used++;
+}
+
+static void dir_long_insert(dir_index *index, int dir, uint64_t hash, long offset) {
+    // Add a long name, or move it if the directory already has one that folds the same
+    uint64_t h;
+
+    if (2 * (index->long_used + 1) > index->long_mask + 1) { // Double the table and re-insert everything
+        int old_size = index->long_mask + 1;
+        dir_long_slot *old = index->longs;
+        dir_long_slot *longs = malloc(2 * old_size * sizeof(dir_long_slot));
+        if (longs == NULL) {
+            return;
+        }
+        for (int i = 0; i < 2 * old_size; i++) {
+            longs[i].offset = -1;
+        }
+        for (int i = 0; i < old_size; i++) {
+            if (old[i].offset >= 0) {
+                h = old[i].hash & (2 * old_size - 1);
+                while (longs[h].offset >= 0) {
+                    h = (h + 1) & (2 * old_size - 1);
+                }
+                longs[h] = old[i];
+            }
+        }
+        free(old);
+        index->longs = longs;
+        index->long_mask = 2 * old_size - 1;
+    }
+    h = hash & index->long_mask;
+    while (index->longs[h].offset >= 0) {
+        if (index->longs[h].dir == dir && index->longs[h].hash == hash) {
+            index->longs[h].offset = offset;
+            return;
+        }
+        h = (h + 1) & index->long_mask;
+    }
+    index->longs[h].dir = dir;
+    index->longs[h].hash = hash;
+    index->longs[h].offset = offset;
+    index->long_used++;
+}
+
+static int dir_long_units(dir_long_name *state, const unsigned char *entry) {
+    // Length of the long name gathered for a short entry, 0 if there is none or it belongs to another name; starts over
+    int count = 0;
+
+    if (state->pieces > 0 && state->next == 0 && state->checksum == dir_short_checksum(entry)) {
+        while (count < state->pieces * 13 && state->units[count] != 0x0000) {
+            count++;
+        }
+    }
+    state->pieces = 0;
+    return count;
+}
+
+static int dir_indexable(const unsigned char *entry) {
+    // Deleted entries, long-name pieces, volume labels and "."/".." are not looked up by name
+    return entry[0] != 0xE5 && entry[0] != '.' && entry[11] != 0x0F && (entry[11] & 0x08) == 0;
+}
+
+static dir_info *dir_find_info(dir_index *index, int dir) {
+    // Return the record of a loaded directory, or the empty place for it
+    uint64_t h = ((uint64_t)dir * 0x9E3779B97F4A7C15ULL) >> 32;
+
+    h &= index->dir_mask;
+    while (index->dirs[h].cluster != -1 && index->dirs[h].cluster != dir) {
+        h = (h + 1) & index->dir_mask;
+    }
+    return &index->dirs[h];
+}
+
+static int dir_grow_dirs(dir_index *index) {
+    // Double the directory table and re-insert everything
+    int old_size = index->dir_mask + 1;
+    dir_info *old = index->dirs;
+    int size = 2 * old_size;
+
+    index->dirs = malloc(size * sizeof(dir_info));
+    if (index->dirs == NULL) {
+        index->dirs = old;
+        return -1;
+    }
+    index->dir_mask = size - 1;
+    for (int i = 0; i < size; i++) {
+        index->dirs[i].cluster = -1;
+    }
+    for (int i = 0; i < old_size; i++) {
+        if (old[i].cluster != -1) {
+            *dir_find_info(index, old[i].cluster) = old[i];
+        }
+    }
+    free(old);
+    return 0;
+}
+
+static dir_info *dir_load(dir_index *index, int dir) {
+    // Index every entry of a directory the first time it is used
+    dir_info *info = dir_find_info(index, dir);
+
+    if (info->cluster == dir) {
+        return info;
+    }
+    if (2 * (index->dir_used + 1) > index->dir_mask + 1) {
+        if (dir_grow_dirs(index) < 0) {
+            return NULL;
+        }
+        info = dir_find_info(index, dir);
+    }
+
+    info->ranges = dir_ranges(index->fat, dir, &info->range_count);
+    if (info->ranges == NULL) {
+        return NULL;
+    }
+    info->cluster = dir;
+    info->free_from = 0;
+    index->dir_used++;
+
+    // Long names are hashed straight from their UCS-2 units; nothing is converted to UTF-8 here
+    dir_long_name long_name;
+    long_name.pieces = 0;
+    for (int r = 0; r < info->range_count; r++) {
+        for (int i = 0; i < info->ranges[r].length; i += DIR_ENTRY_SIZE) {
+            long offset = info->ranges[r].offset + i;
+            const unsigned char *entry = (const unsigned char *)index->image + offset;
+            if (entry[0] == 0x00) {
+                return info; // No entries after the end marker
+            }
+            if (entry[11] == 0x0F) {
+                dir_long_feed(&long_name, entry);
+                continue;
+            }
+            int count = dir_long_units(&long_name, entry);
+            if (dir_indexable(entry)) {
+                dir_insert(index, dir, offset);
+                if (count > 0) {
+                    dir_long_insert(index, dir, dir_long_hash(dir, long_name.units, count), offset);
+                }
+            }
+        }
+    }
+    return info;
+}
+
+dir_range *dir_ranges(const fat_table *fat, int dir, int *range_count) {
+    // List the byte ranges of the image that hold a directory's entries, in order
+    dir_range *ranges;
+    fat_extent *extents;
+    int count;
+
+    if (dir == DIR_ROOT && fat->geo.width != 32) { // Fixed root area before the data clusters
+        ranges = malloc(sizeof(dir_range));
+        if (ranges == NULL) {
+            return NULL;
+        }
+        ranges[0].offset = fat->geo.root_offset;
+        ranges[0].length = fat->geo.data_offset - fat->geo.root_offset;
+        *range_count = 1;
+        return ranges;
+    }
+
+    extents = fat_chain(fat, dir == DIR_ROOT ? fat->geo.root_cluster : dir, &count);
+    if (extents == NULL) {
+        return NULL;
+    }
+    ranges = malloc((count > 0 ? count : 1) * sizeof(dir_range));
+    if (ranges != NULL) {
+        for (int i = 0; i < count; i++) {
+            ranges[i].offset = fat_cluster_offset(fat, extents[i].start);
+            ranges[i].length = (long)extents[i].length * fat->geo.cluster_size;
+            if (fat_need(fat, ranges[i].offset, ranges[i].length) < 0) { // Cannot read the directory
+                free(ranges);
+                ranges = NULL;
+                break;
+            }
+        }
+        *range_count = count;
+    }
+    free(extents);
+    return ranges;
+}
+
+int dir_index_init(dir_index *index, char *image, fat_table *fat) {
+    // Start with empty tables; directories are indexed when first used
+    index->image = image;
+    index->fat = fat;
+    index->slots = malloc(DIR_INITIAL_SLOTS * sizeof(dir_slot));
+    index->dirs = malloc(DIR_INITIAL_DIRS * sizeof(dir_info));
+    index->paths = calloc(DIR_INITIAL_PATHS, sizeof(dir_path));
+    index->longs = malloc(DIR_INITIAL_LONGS * sizeof(dir_long_slot));
+    if (index->slots == NULL || index->dirs == NULL || index->paths == NULL || index->longs == NULL) {
+        free(index->slots);
+        free(index->dirs);
+        free(index->paths);
+        free(index->longs);
+        return -1;
+    }
+    dir_fold_init();
+    for (int i = 0; i < DIR_INITIAL_SLOTS; i++) {
+        index->slots[i].offset = -1;
+    }
+    for (int i = 0; i < DIR_INITIAL_LONGS; i++) {
+        index->longs[i].offset = -1;
+    }
+    for (int i = 0; i < DIR_INITIAL_DIRS; i++) {
+        index->dirs[i].cluster = -1;
+    }
+    index->slot_mask = DIR_INITIAL_SLOTS - 1;
+    index->dir_mask = DIR_INITIAL_DIRS - 1;
+    index->path_mask = DIR_INITIAL_PATHS - 1;
+    index->long_mask = DIR_INITIAL_LONGS - 1;
+    index->slot_used = index->dir_used = index->path_used = index->long_used = 0;
+    return 0;
+}
+
+void dir_index_release(dir_index *index) {
+    // Free all tables
+    for (int i = 0; i <= index->dir_mask; i++) {
+        if (index->dirs[i].cluster != -1) {
+            free(index->dirs[i].ranges);
+        }
+    }
+    for (int i = 0; i <= index->path_mask; i++) {
+        free(index->paths[i].path);
+    }
+    free(index->slots);
+    free(index->dirs);
+    free(index->paths);
+    free(index->longs);
+}
+
+void dir_pack_name(const char *name, unsigned char packed[11]) {
+    // Turn "readme.txt" into the on-disk form "README  TXT"
+    const char *dot = strrchr(name, '.');
+    int base_length = dot != NULL && dot != name ? dot - name : (int)strlen(name);
+
+    memset(packed, ' ', 11);
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        memcpy(packed, name, strlen(name));
+        return;
+    }
+    for (int i = 0; i < base_length && i < 8; i++) {
+        packed[i] = toupper((unsigned char)name[i]);
+    }
+    if (dot != NULL && dot != name) {
+        for (int i = 0; dot[1 + i] != '\0' && i < 3; i++) {
+            packed[8 + i] = toupper((unsigned char)dot[1 + i]);
+        }
+    }
+}
+
+int dir_unpack_name(const unsigned char packed[11], char name[13]) {
+    // Turn the on-disk form "README  TXT" back into "README.TXT" and return its length
+    int length = 0;
+    int extension = 3;
+
+    while (length < 8 && packed[length] != ' ') {
+        name[length] = packed[length];
+        length++;
+    }
+    while (extension > 0 && packed[8 + extension - 1] == ' ') {
+        extension--;
+    }
+    if (extension > 0) {
+        name[length++] = '.';
+        memcpy(name + length, packed + 8, extension);
+        length += extension;
+    }
+    name[length] = '\0';
+    return length;
+}
+
+long dir_lookup(dir_index *index, int dir, const unsigned char packed[11]) {
+    // Return the offset of a name's entry in a directory, or -1
+    uint64_t h;
+
+    if (dir_load(index, dir) == NULL) {
+        return -1;
+    }
+    h = dir_hash(dir, packed, 11) & index->slot_mask;
+    while (index->slots[h].offset >= 0) {
+        dir_slot *slot = &index->slots[h];
+        if (slot->dir == dir && memcmp(slot->name, packed, 11) == 0) {
+            // The slot may have been reused since it was indexed
+            if (memcmp(index->image + slot->offset, packed, 11) == 0) {
+                return slot->offset;
+            }
+            return -1;
+        }
+        h = (h + 1) & index->slot_mask;
+    }
+    return -1;
+}
+
+static int dir_short_char(unsigned char c) {
+    // True if a character may appear in an 8.3 name (lower case counts, as it is stored upper case)
+    return c < 0x80 && (isalnum(c) || strchr("$%'-_@~`!(){}^#&", c) != NULL);
+}
+
+int dir_short_name(const char *name) {
+    // True if a name fits an 8.3 entry on its own, apart from case: up to 8 characters, a dot and up to 3 more
+    const char *dot = strrchr(name, '.');
+    int base_length = dot != NULL ? dot - name : (int)strlen(name);
+    int extension_length = dot != NULL ? (int)strlen(dot + 1) : 0;
+
+    if (base_length < 1 || base_length > 8 || extension_length > 3 || (dot != NULL && extension_length == 0)) {
+        return 0;
+    }
+    for (const char *p = name; *p != '\0'; p++) {
+        if (p != dot && !dir_short_char(*p)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+unsigned char dir_short_checksum(const unsigned char packed[11]) {
+    // Checksum of an 8.3 name that its long-name entries carry
+    unsigned char sum = 0;
+    for (int i = 0; i < 11; i++) {
+        sum = ((sum & 1) << 7) + (sum >> 1) + packed[i];
+    }
+    return sum;
+}
+
+void dir_long_feed(dir_long_name *state, const unsigned char *entry) {
+    // Take in one long-name entry; one that does not continue the sequence drops what was gathered
+    int order = entry[0] & 0x1F;
+
+    if (entry[0] == 0xE5 || order == 0 || order > DIR_LONG_PIECES) {
+        state->pieces = 0;
+        return;
+    }
+    if (entry[0] & 0x40) { // Last piece of the name, stored first
+        state->pieces = order;
+        state->checksum = entry[13];
+    } else if (state->pieces == 0 || order != state->next || entry[13] != state->checksum) {
+        state->pieces = 0;
+        return;
+    }
+    for (int i = 0; i < 13; i++) {
+        state->units[(order - 1) * 13 + i] = entry[dir_long_places[i]] | entry[dir_long_places[i] + 1] << 8;
+    }
+    state->next = order - 1;
+}
+
+int dir_long_take(dir_long_name *state, const unsigned char *entry, char *name) {
+    // Put the long name gathered for a short entry into name as UTF-8 and return its length, 0 if it has none
+    int count = dir_long_units(state, entry);
+    return count > 0 ? dir_units_utf8(state->units, count, name) : 0;
+}
+
+int dir_long_entries(dir_index *index, int dir, long offset, long offsets[DIR_LONG_PIECES]) {
+    // Find the long-name entries in front of a short entry, piece 1 first; returns how many there are, 0 if it has none
+    dir_info *info = dir_load(index, dir);
+    unsigned char checksum = dir_short_checksum((const unsigned char *)index->image + offset);
+    int r = 0;
+
+    while (info != NULL && r < info->range_count &&
+           (offset < info->ranges[r].offset || offset >= info->ranges[r].offset + info->ranges[r].length)) {
+        r++;
+    }
+    if (info == NULL || r == info->range_count) {
+        return 0;
+    }
+    for (int order = 1; order <= DIR_LONG_PIECES; order++) {
+        if (offset == info->ranges[r].offset) { // Step back into the previous cluster of the directory
+            if (r == 0) {
+                return 0;
+            }
+            r--;
+            offset = info->ranges[r].offset + info->ranges[r].length;
+        }
+        offset -= DIR_ENTRY_SIZE;
+        const unsigned char *entry = (const unsigned char *)index->image + offset;
+        if (entry[11] != 0x0F || entry[0] == 0xE5 || (entry[0] & 0x1F) != order || entry[13] != checksum) {
+            return 0;
+        }
+        offsets[order - 1] = offset;
+        if (entry[0] & 0x40) {
+            return order;
+        }
+    }
+    return 0;
+}
+
+static int dir_entry_units(dir_index *index, int dir, long offset, uint16_t *units) {
+    // Read back the long name stored in front of a short entry; returns its length, 0 if it has none
+    long offsets[DIR_LONG_PIECES];
+    int pieces = dir_long_entries(index, dir, offset, offsets);
+    int count = 0;
+
+    for (int k = 0; k < pieces; k++) {
+        const unsigned char *entry = (const unsigned char *)index->image + offsets[k];
+        for (int i = 0; i < 13; i++) {
+            units[k * 13 + i] = entry[dir_long_places[i]] | entry[dir_long_places[i] + 1] << 8;
+        }
+    }
+    while (count < pieces * 13 && units[count] != 0x0000) {
+        count++;
+    }
+    return count;
+}
+
+int dir_entry_name(dir_index *index, int dir, long offset, char *name) {
+    // Put an entry's long name, or its 8.3 name if it has none, into a buffer of DIR_NAME_MAX bytes; returns the length
+    uint16_t units[DIR_LONG_PIECES * 13];
+    int count = dir_entry_units(index, dir, offset, units);
+    if (count > 0) {
+        return dir_units_utf8(units, count, name);
+    }
+    return dir_unpack_name((const unsigned char *)index->image + offset, name);
+}
+
+int dir_name_compare(const char *a, const char *b) {
+    // Order two names ignoring case the way lookups do; 0 if they name the same entry
+    uint16_t a_units[DIR_LONG_MAX], b_units[DIR_LONG_MAX];
+    int a_count = dir_utf8_units(a, a_units);
+    int b_count = dir_utf8_units(b, b_units);
+
+    if (a_count < 0 || b_count < 0) {
+        return strcmp(a, b);
+    }
+    for (int i = 0; i < a_count && i < b_count; i++) {
+        if (dir_fold(a_units[i]) != dir_fold(b_units[i])) {
+            return dir_fold(a_units[i]) < dir_fold(b_units[i]) ? -1 : 1;
+        }
+    }
+    return a_count - b_count;
+}
+
+long dir_lookup_name(dir_index *index, int dir, const char *name) {
+    // Return the offset of the entry a name refers to in a directory, by long name or by 8.3 name, or -1
+    uint16_t units[DIR_LONG_MAX], stored[DIR_LONG_PIECES * 13];
+    int count = dir_utf8_units(name, units);
+    unsigned char packed[11];
+
+    if (dir_load(index, dir) == NULL) {
+        return -1;
+    }
+    if (count > 0 && index->long_used > 0) {
+        uint64_t hash = dir_long_hash(dir, units, count);
+        uint64_t h = hash & index->long_mask;
+        while (index->longs[h].offset >= 0) {
+            dir_long_slot *slot = &index->longs[h];
+            // The entry may have been deleted or renamed since it was indexed, and hashes can collide
+            if (slot->dir == dir && slot->hash == hash && (unsigned char)index->image[slot->offset] != 0xE5 &&
+                dir_entry_units(index, dir, slot->offset, stored) == count) {
+                int i = 0;
+                while (i < count && dir_fold(stored[i]) == dir_fold(units[i])) {
+                    i++;
+                }
+                if (i == count) {
+                    return slot->offset;
+                }
+            }
+            h = (h + 1) & index->long_mask;
+        }
+    }
+    if (!dir_short_name(name)) {
+        return -1;
+    }
+    dir_pack_name(name, packed);
+    return dir_lookup(index, dir, packed);
+}
+
+static dir_path *dir_find_path(dir_index *index, const char *path) {
+    // Return the cache slot holding path, or the empty slot where it belongs
+    uint64_t h = dir_hash(0, (const unsigned char *)path, strlen(path)) & index->path_mask;
+
+    while (index->paths[h].path != NULL && strcmp(index->paths[h].path, path) != 0) {
+        h = (h + 1) & index->path_mask;
+    }
+    return &index->paths[h];
+}
+
+static void dir_remember_path(dir_index *index, const char *path, int cluster) {
+    // Add a resolved directory path to the cache
+    if (2 * (index->path_used + 1) > index->path_mask + 1) {
+        int old_size = index->path_mask + 1;
+        dir_path *old = index->paths;
+        dir_path *paths = calloc(2 * old_size, sizeof(dir_path));
+        if (paths == NULL) {
+            return;
+        }
+        index->paths = paths;
+        index->path_mask = 2 * old_size - 1;
+        for (int i = 0; i < old_size; i++) {
+            if (old[i].path != NULL) {
+                *dir_find_path(index, old[i].path) = old[i];
+            }
+        }
+        free(old);
+    }
+    dir_path *slot = dir_find_path(index, path);
+    if (slot->path == NULL) {
+        slot->path = strdup(path);
+        if (slot->path == NULL) {
+            return;
+        }
+        slot->cluster = cluster;
+        index->path_used++;
+    }
+}
+
+int dir_find_directory(dir_index *index, const char *path) {
+    // Return the first cluster of the directory at path, DIR_ROOT for the root, or -1
+    char copy[4096];
+    int dir = DIR_ROOT;
+
+    while (path != NULL && *path == '/') {
+        path++;
+    }
+    if (path == NULL || *path == '\0') {
+        return DIR_ROOT;
+    }
+
+    dir_path *cached = dir_find_path(index, path);
+    if (cached->path != NULL) {
+        return cached->cluster;
+    }
+
+    if (strlen(path) >= sizeof(copy)) {
+        return -1;
+    }
+    strcpy(copy, path);
+    for (char *token = strtok(copy, "/"); token != NULL; token = strtok(NULL, "/")) {
+        long offset = dir_lookup_name(index, dir, token);
+        if (offset < 0 || (index->image[offset + 11] & 0x10) == 0) {
+            return -1; // Missing, or not a directory
+        }
+        dir = dir_entry_cluster(index->fat, index->image, offset);
+    }
+    dir_remember_path(index, path, dir);
+    return dir;
+}
+
+long dir_resolve(dir_index *index, const char *path) {
+    // Return the entry offset of the file or directory at path, or -1
+    const char *slash = strrchr(path, '/');
+    int dir = DIR_ROOT;
+
+    if (slash != NULL) {
+        char parent[4096];
+        if (slash - path >= (long)sizeof(parent)) {
+            return -1;
+        }
+        memcpy(parent, path, slash - path);
+        parent[slash - path] = '\0';
+        dir = dir_find_directory(index, parent);
+        if (dir < 0) {
+            return -1;
+        }
+        path = slash + 1;
+    }
+    return dir_lookup_name(index, dir, path);
+}
+
+static int dir_grow(dir_index *index, int dir, dir_info *info) {
+    // Add a zeroed cluster to the end of a cluster-chained directory
+    int length;
+    int cluster;
+
+    if ((dir == DIR_ROOT && index->fat->geo.width != 32) || info->range_count == 0) {
+        return -1; // The FAT12/16 root directory has a fixed size
+    }
+    cluster = fat_alloc_run(index->fat, 1, &length);
+    if (cluster < 0) {
+        return -1;
+    }
+    long offset = fat_cluster_offset(index->fat, cluster);
+    dir_range *ranges = realloc(info->ranges, (info->range_count + 1) * sizeof(dir_range));
+    if (ranges == NULL || fat_need(index->fat, offset, index->fat->geo.cluster_size) < 0) {
+        info->ranges = ranges != NULL ? ranges : info->ranges;
+        fat_set(index->fat, cluster, FAT_FREE);
+        return -1;
+    }
+    dir_range *tail = &ranges[info->range_count - 1];
+    int last = fat_offset_cluster(index->fat, tail->offset + tail->length - 1); // Last cluster of the chain
+    fat_set(index->fat, last, cluster);
+    fat_set(index->fat, cluster, FAT_EOC);
+    memset(index->image + offset, 0, index->fat->geo.cluster_size);
+    fat_touch(index->fat, offset, index->fat->geo.cluster_size);
+
+    info->ranges = ranges;
+    info->ranges[info->range_count].offset = offset;
+    info->ranges[info->range_count].length = index->fat->geo.cluster_size;
+    info->range_count++;
+    return 0;
+}
+
+static int dir_free_run(dir_index *index, int dir, int count, long *offsets) {
+    // Find count unused entries in a row, growing the directory if it has no such run; their offsets go in offsets
+    dir_info *info = dir_load(index, dir);
+    int slot = 0, run = 0, found = 0;
+
+    if (info == NULL) {
+        return -1;
+    }
+    for (int r = 0;; r++) {
+        if (r == info->range_count && dir_grow(index, dir, info) < 0) {
+            return -1;
+        }
+        int slots = info->ranges[r].length / DIR_ENTRY_SIZE;
+        for (int i = info->free_from > slot ? info->free_from - slot : 0; i < slots; i++) {
+            long offset = info->ranges[r].offset + (long)i * DIR_ENTRY_SIZE;
+            unsigned char first = index->image[offset];
+            if (first != 0x00 && first != 0xE5) {
+                run = 0;
+                continue;
+            }
+            if (!found) {
+                info->free_from = slot + i;
+                found = 1;
+            }
+            offsets[run++] = offset;
+            if (run == count) {
+                return 0;
+            }
+        }
+        slot += slots;
+        if (!found) {
+            info->free_from = slot;
+        }
+    }
+}
+
+long dir_free_slot(dir_index *index, int dir) {
+    // Return the offset of an unused entry, growing a cluster-chained directory if it is full
+    long offset;
+    return dir_free_run(index, dir, 1, &offset) < 0 ? -1 : offset;
+}
+
+static int dir_alias_char(uint16_t unit) {
+    // What a long-name unit becomes in the 8.3 alias: 0 if it is left out, -1 if no FAT name may contain it
+    if (unit < 0x20 || (unit < 0x80 && strchr("\"*/:<>?\\|", unit) != NULL)) {
+        return -1;
+    }
+    if (unit == ' ' || unit == '.') {
+        return 0;
+    }
+    if (unit >= 0x80 || strchr("+,;=[]", unit) != NULL) {
+        return '_';
+    }
+    return dir_fold(unit);
+}
+
+static int dir_short_alias(dir_index *index, int dir, const uint16_t *units, int count, unsigned char packed[11]) {
+    // Make up an unused 8.3 name for a long one the way Windows does: "Long File Name.text" becomes "LONGFI~1.TEX"
+    unsigned char base[8], hashed[8];
+    int base_length = 0, extension_length = 0;
+    int dot = count;
+
+    for (int i = count - 1; i > 0; i--) { // A leading dot does not start an extension
+        if (units[i] == '.') {
+            dot = i;
+            break;
+        }
+    }
+    memset(packed, ' ', 11);
+    for (int i = 0; i < count; i++) {
+        int c = dir_alias_char(units[i]);
+        if (c < 0) {
+            return -1;
+        }
+        if (c > 0 && i < dot && base_length < 8) {
+            base[base_length++] = c;
+        } else if (c > 0 && i > dot && extension_length < 3) {
+            packed[8 + extension_length++] = c;
+        }
+    }
+    if (base_length == 0) {
+        base[base_length++] = '_';
+    }
+    // After ~4, two characters and a hash of the long name take the place of the rest, so a directory full of
+    // similar names does not try every number in turn
+    int hashed_length = base_length < 2 ? base_length : 2;
+    snprintf((char *)hashed, sizeof(hashed), "%.*s%04X", hashed_length, (const char *)base,
+             (unsigned)(dir_long_hash(0, units, count) & 0xFFFF));
+    hashed_length += 4;
+    for (int n = 1; n < 1000000; n++) {
+        char tail[8];
+        int tail_length = snprintf(tail, sizeof(tail), "~%d", n <= 4 ? n : n - 4);
+        const unsigned char *prefix = n <= 4 ? base : hashed;
+        int prefix_length = n <= 4 ? base_length : hashed_length;
+        int keep = prefix_length < 8 - tail_length ? prefix_length : 8 - tail_length;
+        memset(packed, ' ', 8);
+        memcpy(packed, prefix, keep);
+        memcpy(packed + keep, tail, tail_length);
+        if (dir_lookup(index, dir, packed) < 0) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int dir_storable_name(const char *name) {
+    // True if a name can be stored in a directory, as an 8.3 name or as a long one
+    uint16_t units[DIR_LONG_MAX];
+    int count = dir_utf8_units(name, units);
+
+    if (dir_short_name(name)) {
+        return 1;
+    }
+    if (count <= 0 || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        return 0;
+    }
+    for (int i = 0; i < count; i++) {
+        if (dir_alias_char(units[i]) < 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+long dir_new_entry(dir_index *index, int dir, const char *name, unsigned char packed[11]) {
+    // Reserve entries for a new name: one for an 8.3 name, or a long name's pieces, written here, and its alias;
+    // returns the offset of the short entry, whose name is left in packed, or -1
+    uint16_t units[DIR_LONG_MAX];
+    long offsets[DIR_LONG_PIECES + 1];
+    int count, pieces;
+
+    if (dir_short_name(name)) {
+        dir_pack_name(name, packed);
+        return dir_free_slot(index, dir);
+    }
+    count = dir_utf8_units(name, units);
+    if (count <= 0 || dir_short_alias(index, dir, units, count, packed) < 0) {
+        return -1;
+    }
+    pieces = (count + 12) / 13;
+    if (dir_free_run(index, dir, pieces + 1, offsets) < 0) {
+        return -1;
+    }
+    unsigned char checksum = dir_short_checksum(packed);
+    for (int n = 1; n <= pieces; n++) { // Piece n sits n entries in front of the short entry
+        unsigned char *entry = (unsigned char *)index->image + offsets[pieces - n];
+        memset(entry, 0, DIR_ENTRY_SIZE);
+        entry[0] = n | (n == pieces ? 0x40 : 0);
+        entry[11] = 0x0F;
+        entry[13] = checksum;
+        for (int i = 0; i < 13; i++) { // The name ends with 0x0000, then 0xFFFF fills the piece
+            int at = (n - 1) * 13 + i;
+            uint16_t unit = at < count ? units[at] : at == count ? 0x0000 : 0xFFFF;
+            entry[dir_long_places[i]] = unit & 0xFF;
+            entry[dir_long_places[i] + 1] = unit >> 8;
+        }
+        fat_touch(index->fat, offsets[pieces - n], DIR_ENTRY_SIZE);
+    }
+    return offsets[pieces];
+}
+
+int dir_name_slots(const char *name) {
+    // Directory entries dir_new_entry takes for a name: 1 for an 8.3 name, or the long name's pieces and the alias
+    uint16_t units[DIR_LONG_MAX];
+    int count;
+
+    if (dir_short_name(name)) {
+        return 1;
+    }
+    count = dir_utf8_units(name, units);
+    return count > 0 ? (count + 12) / 13 + 1 : 0;
+}
+
+static void dir_forget(dir_index *index, int dir) {
+    // Drop a loaded directory whose cluster was freed, so a directory created there later is read afresh
+    int size = index->dir_mask + 1;
+    dir_info *old = index->dirs;
+    dir_info *dirs = malloc(size * sizeof(dir_info));
+
+    if (dirs == NULL) { // Keep the record but make it useless: no ranges, so no free slots handed out
+        dir_find_info(index, dir)->range_count = 0;
+        return;
+    }
+    index->dirs = dirs;
+    for (int i = 0; i < size; i++) {
+        dirs[i].cluster = -1;
+    }
+    index->dir_used = 0;
+    for (int i = 0; i < size; i++) {
+        if (old[i].cluster == -1) {
+            continue;
+        }
+        if (old[i].cluster == dir) {
+            free(old[i].ranges);
+            continue;
+        }
+        *dir_find_info(index, old[i].cluster) = old[i];
+        index->dir_used++;
+    }
+    free(old);
+}
+
+void dir_index_remove(dir_index *index, int dir, long offset) {
+    // Note that the entry at offset was just deleted: its slot can be reused, and a directory it named is gone
+    dir_info *info = dir_find_info(index, dir);
+    const unsigned char *entry = (const unsigned char *)index->image + offset;
+    int slot = 0;
+
+    for (int r = 0; info->cluster == dir && r < info->range_count; r++) {
+        if (offset >= info->ranges[r].offset && offset < info->ranges[r].offset + info->ranges[r].length) {
+            slot += (offset - info->ranges[r].offset) / DIR_ENTRY_SIZE;
+            info->free_from = slot < info->free_from ? slot : info->free_from;
+            break;
+        }
+        slot += info->ranges[r].length / DIR_ENTRY_SIZE;
+    }
+    if ((entry[11] & 0x10) != 0 && entry[11] != 0x0F) {
+        int cluster = dir_entry_cluster(index->fat, index->image, offset);
+        if (dir_find_info(index, cluster)->cluster == cluster) {
+            dir_forget(index, cluster);
+        }
+        for (int i = 0; i <= index->path_mask; i++) { // Cached paths may run through it
+            free(index->paths[i].path);
+            index->paths[i].path = NULL;
+        }
+        index->path_used = 0;
+    }
+}
+
+void dir_index_add(dir_index *index, int dir, long offset) {
+    // Index an entry that was just written, under its long name too if it has one
+    uint16_t units[DIR_LONG_PIECES * 13];
+
+    if (dir_load(index, dir) != NULL && dir_indexable((const unsigned char *)index->image + offset)) {
+        dir_insert(index, dir, offset);
+        int count = dir_entry_units(index, dir, offset, units);
+        if (count > 0) {
+            dir_long_insert(index, dir, dir_long_hash(dir, units, count), offset);
+        }
+    }
+}
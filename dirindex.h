@@ -0,0 +1,106 @@
+#ifndef DIRINDEX_H
+#define DIRINDEX_H
+
+#include "fat12.h"
+
+#define DIR_ROOT 0            // Directory "cluster" of the root directory, as in ".." entries
+#define DIR_ENTRY_SIZE 32
+#define DIR_LONG_MAX 255      // Longest long name, in UCS-2 units
+#define DIR_NAME_MAX 766      // Room for a long name in UTF-8 with its terminator
+#define DIR_LONG_PIECES 20    // Entries a long name of DIR_LONG_MAX units takes, 13 units each
+
+// One indexed directory entry, keyed by its directory and packed 8.3 name
+typedef struct {
+    int dir;                  // First cluster of the directory holding the entry
+    unsigned char name[11];   // Name exactly as stored on disk ("README  TXT")
+    long offset;              // Byte offset of the 32-byte entry in the image, -1 if unused
+} dir_slot;
+
+// Long name of an indexed entry, keyed by its directory and case-folded name
+typedef struct {
+    int dir;
+    uint64_t hash;            // dir_hash of the folded UCS-2 units
+    long offset;              // Byte offset of the short entry the name belongs to, -1 if unused
+} dir_long_slot;
+
+// Long name being gathered from the 0x0F entries in front of a short entry
+typedef struct {
+    uint16_t units[DIR_LONG_PIECES * 13];
+    int pieces;               // Entries the first one announced, 0 if nothing is pending
+    int next;                 // Sequence number still missing, 0 once all pieces are in
+    unsigned char checksum;   // Checksum of the short name the pieces belong to
+} dir_long_name;
+
+// Byte range of the image that holds part of a directory
+typedef struct {
+    long offset;
+    long length;
+} dir_range;
+
+// Directory whose entries have been loaded into the index
+typedef struct {
+    int cluster;              // -1 if unused
+    dir_range *ranges;        // Where its entries live, in order
+    int range_count;
+    int free_from;            // No free slot before this slot number
+} dir_info;
+
+// Path string remembered with the directory cluster it names
+typedef struct {
+    char *path;
+    int cluster;
+} dir_path;
+
+// Hash index over directory entries, built one directory at a time on first use
+typedef struct {
+    char *image;
+    fat_table *fat;
+    dir_slot *slots;
+    int slot_mask, slot_used;
+    dir_long_slot *longs;
+    int long_mask, long_used;
+    dir_info *dirs;
+    int dir_mask, dir_used;
+    dir_path *paths;
+    int path_mask, path_used;
+} dir_index;
+
+dir_range *dir_ranges(const fat_table *fat, int dir, int *range_count);
+int dir_index_init(dir_index *index, char *image, fat_table *fat);
+void dir_index_release(dir_index *index);
+void dir_pack_name(const char *name, unsigned char packed[11]);
+int dir_unpack_name(const unsigned char packed[11], char name[13]);
+long dir_lookup(dir_index *index, int dir, const unsigned char packed[11]);
+int dir_short_name(const char *name);
+unsigned char dir_short_checksum(const unsigned char packed[11]);
+void dir_long_feed(dir_long_name *state, const unsigned char *entry);
+int dir_long_take(dir_long_name *state, const unsigned char *entry, char *name);
+int dir_long_entries(dir_index *index, int dir, long offset, long offsets[DIR_LONG_PIECES]);
+int dir_entry_name(dir_index *index, int dir, long offset, char *name);
+int dir_name_compare(const char *a, const char *b);
+long dir_lookup_name(dir_index *index, int dir, const char *name);
+int dir_find_directory(dir_index *index, const char *path);
+long dir_resolve(dir_index *index, const char *path);
+long dir_free_slot(dir_index *index, int dir);
+int dir_storable_name(const char *name);
+long dir_new_entry(dir_index *index, int dir, const char *name, unsigned char packed[11]);
+int dir_name_slots(const char *name);
+void dir_index_add(dir_index *index, int dir, long offset);
+void dir_index_remove(dir_index *index, int dir, long offset);
+
+static inline int dir_entry_cluster(const fat_table *fat, const char *image, long offset) {
+    // First cluster of the file or directory described by an entry
+    int cluster = (image[offset + 26] & 0xFF) | ((image[offset + 27] & 0xFF) << 8);
+    if (fat->geo.width == 32) { // High half lives in bytes 20-21
+        cluster |= ((image[offset + 20] & 0xFF) << 16) | ((image[offset + 21] & 0x0F) << 24);
+    }
+    return cluster;
+}
+
+static inline long dir_entry_size(const char *image, long offset) {
+    // File size field of an entry
+    return (image[offset + 28] & 0xFF) | ((image[offset + 29] & 0xFF) << 8) |
+           ((image[offset + 30] & 0xFF) << 16) | ((long)(image[offset + 31] & 0xFF) << 24);
+}
+
+#endif
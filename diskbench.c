@@ -0,0 +1,469 @@
+#define _GNU_SOURCE // copy_file_range
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "fat12.h"
+#include "dirindex.h"
+
+// File found while walking the image
+typedef struct {
+    char *path;
+    int cluster;
+    long size;
+} bench_file;
+
+// Image under test, mapped once for the in-process phases
+typedef struct {
+    const char *path;
+    char *image;
+    long image_size;
+    fat_table fat;
+    bench_file *files;
+    int file_count;
+    int directory_count;
+    long bytes;
+    int largest; // Index of the largest file, -1 if there are no files
+} bench_image;
+
+static int json_output;
+static int rows_written;
+static int runs = 5;
+static const char *tool_directory = ".";
+static char temp_directory[] = "/tmp/diskbenchXXXXXX";
+
+static long bench_now(void) {
+    // Monotonic clock in nanoseconds
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+static int bench_by_time(const void *a, const void *b) {
+    // Order samples from fastest to slowest
+    long x = *(const long *)a, y = *(const long *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void bench_report(bench_image *bench, const char *phase, long *samples, long ops, long bytes, int ok) {
+    // Print one result row with the fastest and median run
+    qsort(samples, runs, sizeof(long), bench_by_time);
+    if (json_output) {
+        printf("%s{\"image\":\"%s\",\"fat\":%d,\"clusters\":%d,\"files\":%d,\"directories\":%d,\"phase\":\"%s\","
+               "\"runs\":%d,\"ops\":%ld,\"bytes\":%ld,\"min_ns\":%ld,\"median_ns\":%ld,\"status\":\"%s\"}",
+               rows_written > 0 ? ",\n" : "[\n", bench->path, bench->fat.geo.width, bench->fat.count - 2,
+               bench->file_count, bench->directory_count, phase, runs, ops, bytes, samples[0], samples[runs / 2],
+               ok ? "ok" : "failed");
+    } else {
+        if (rows_written == 0) {
+            printf("image,fat,clusters,files,directories,phase,runs,ops,bytes,min_ns,median_ns,status\n");
+        }
+        printf("%s,%d,%d,%d,%d,%s,%d,%ld,%ld,%ld,%ld,%s\n", bench->path, bench->fat.geo.width, bench->fat.count - 2,
+               bench->file_count, bench->directory_count, phase, runs, ops, bytes, samples[0], samples[runs / 2],
+               ok ? "ok" : "failed");
+    }
+    fflush(stdout);
+    rows_written++;
+}
+
+static void bench_free_files(bench_image *bench) {
+    // Drop the file list collected by bench_walk
+    for (int i = 0; i < bench->file_count; i++) {
+        free(bench->files[i].path);
+    }
+    free(bench->files);
+    bench->files = NULL;
+    bench->file_count = 0;
+    bench->directory_count = 0;
+}
+
+static int bench_walk(bench_image *bench) {
+    // Collect every file path in the image with an explicit directory stack
+    char *image = bench->image;
+    fat_table *fat = &bench->fat;
+    int *stack_clusters = malloc(fat->count * sizeof(int));
+    char **stack_paths = malloc(fat->count * sizeof(char *));
+    int stack_used = 0, file_size = 0;
+    uint64_t *visited = calloc(fat->count / 64 + 1, sizeof(uint64_t));
+
+    bench_free_files(bench);
+    bench->bytes = 0;
+    bench->largest = -1;
+    if (stack_clusters == NULL || stack_paths == NULL || visited == NULL) {
+        free(stack_clusters);
+        free(stack_paths);
+        free(visited);
+        return -1;
+    }
+    stack_clusters[stack_used] = DIR_ROOT;
+    stack_paths[stack_used++] = strdup("");
+
+    while (stack_used > 0) {
+        int dir = stack_clusters[--stack_used];
+        char *dir_path = stack_paths[stack_used];
+        int range_count;
+        dir_range *ranges = dir_ranges(fat, dir, &range_count);
+        dir_long_name long_name;
+
+        long_name.pieces = 0;
+        for (int r = 0; ranges != NULL && r < range_count; r++) {
+            for (long offset = ranges[r].offset; offset < ranges[r].offset + ranges[r].length; offset += DIR_ENTRY_SIZE) {
+                char name[DIR_NAME_MAX];
+                char *path;
+                int cluster;
+
+                if (image[offset] == 0x00) {
+                    r = range_count;
+                    break;
+                }
+                if (image[offset + 11] == 0x0F) {
+                    dir_long_feed(&long_name, (unsigned char *)image + offset);
+                    continue;
+                }
+                // Files with long names are looked up by them, as users name them
+                int has_long = dir_long_take(&long_name, (unsigned char *)image + offset, name) > 0;
+                if ((unsigned char)image[offset] == 0xE5 || image[offset] == '.' || (image[offset + 11] & 0x08) != 0) {
+                    continue;
+                }
+                if (!has_long) {
+                    dir_unpack_name((unsigned char *)image + offset, name);
+                }
+                path = malloc(strlen(dir_path) + strlen(name) + 2);
+                if (path == NULL) {
+                    continue;
+                }
+                sprintf(path, "%s%s%s", dir_path, dir_path[0] != '\0' ? "/" : "", name);
+                cluster = dir_entry_cluster(fat, image, offset);
+
+                if ((image[offset + 11] & 0x10) != 0) {
+                    bench->directory_count++;
+                    if (cluster >= 2 && cluster < fat->count && !(visited[cluster / 64] >> (cluster % 64) & 1)) {
+                        visited[cluster / 64] |= 1ULL << (cluster % 64);
+                        stack_clusters[stack_used] = cluster;
+                        stack_paths[stack_used++] = path;
+                        continue;
+                    }
+                    free(path);
+                    continue;
+                }
+                if (bench->file_count == file_size) {
+                    file_size = file_size > 0 ? 2 * file_size : 256;
+                    bench->files = realloc(bench->files, file_size * sizeof(bench_file));
+                    if (bench->files == NULL) {
+                        printf("Error: out of memory\n");
+                        exit(1);
+                    }
+                }
+                bench->files[bench->file_count].path = path;
+                bench->files[bench->file_count].cluster = cluster;
+                bench->files[bench->file_count].size = dir_entry_size(image, offset);
+                bench->bytes += bench->files[bench->file_count].size;
+                if (bench->largest < 0 || bench->files[bench->file_count].size > bench->files[bench->largest].size) {
+                    bench->largest = bench->file_count;
+                }
+                bench->file_count++;
+            }
+        }
+        free(ranges);
+        free(dir_path);
+    }
+    free(stack_clusters);
+    free(stack_paths);
+    free(visited);
+    return 0;
+}
+
+static int bench_lookup(bench_image *bench) {
+    // Build a fresh directory index and resolve every file path through it
+    dir_index index;
+    int ok = 1;
+
+    if (dir_index_init(&index, bench->image, &bench->fat) < 0) {
+        return -1;
+    }
+    for (int i = 0; i < bench->file_count; i++) {
+        if (dir_resolve(&index, bench->files[i].path) < 0) {
+            ok = 0;
+        }
+    }
+    dir_index_release(&index);
+    return ok ? 0 : -1;
+}
+
+static int bench_copy(bench_image *bench, char *buffer) {
+    // Read every file by following its cluster chain, one memcpy per run of clusters
+    for (int i = 0; i < bench->file_count; i++) {
+        long left = bench->files[i].size;
+        int extent_count;
+        fat_extent *extents;
+
+        if (left == 0) {
+            continue;
+        }
+        extents = fat_chain(&bench->fat, bench->files[i].cluster, &extent_count);
+        if (extents == NULL) {
+            return -1;
+        }
+        for (int e = 0; e < extent_count && left > 0; e++) {
+            long length = (long)extents[e].length * bench->fat.geo.cluster_size;
+            if (length > left) {
+                length = left;
+            }
+            memcpy(buffer + (bench->files[i].size - left), bench->image + fat_cluster_offset(&bench->fat, extents[e].start), length);
+            left -= length;
+        }
+        free(extents);
+    }
+    return 0;
+}
+
+static int bench_copy_file(const char *from, const char *to) {
+    // Copy an image so a tool that writes can start from the same state every run
+    int in = open(from, O_RDONLY);
+    int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    struct stat status;
+    long done = 0;
+    int result = 0;
+
+    if (in < 0 || out < 0 || fstat(in, &status) < 0) {
+        result = -1;
+    }
+    while (result == 0 && done < status.st_size) {
+        ssize_t copied = copy_file_range(in, NULL, out, NULL, status.st_size - done, 0);
+        if (copied <= 0) {
+            result = -1;
+            break;
+        }
+        done += copied;
+    }
+    if (in >= 0) {
+        close(in);
+    }
+    if (out >= 0) {
+        close(out);
+    }
+    return result;
+}
+
+static int bench_run_tool(char *const arguments[]) {
+    // Run a tool with its output discarded and return its exit status
+    pid_t child = fork();
+    int status;
+
+    if (child < 0) {
+        return -1;
+    }
+    if (child == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        execv(arguments[0], arguments);
+        _exit(127);
+    }
+    if (waitpid(child, &status, 0) < 0 || !WIFEXITED(status)) {
+        return -1;
+    }
+    return WEXITSTATUS(status);
+}
+
+static void bench_tool(bench_image *bench, const char *tool, const char *option, const char *argument, int on_copy) {
+    // Time a whole tool invocation against the image, or against a fresh copy of it if the tool writes
+    char program[4096], copy[4096];
+    char *arguments[6];
+    int count = 0, ok = 1;
+    long *samples = malloc(runs * sizeof(long));
+
+    if (samples == NULL) {
+        return;
+    }
+    snprintf(program, sizeof(program), "%s/%s", tool_directory, tool);
+    snprintf(copy, sizeof(copy), "%s/image.img", temp_directory);
+    arguments[count++] = program;
+    if (option != NULL) {
+        arguments[count++] = (char *)option;
+    }
+    arguments[count++] = on_copy ? copy : (char *)bench->path;
+    if (argument != NULL) {
+        arguments[count++] = (char *)argument;
+    }
+    arguments[count] = NULL;
+
+    for (int run = 0; run < runs; run++) {
+        long start;
+        if (on_copy && bench_copy_file(bench->path, copy) < 0) {
+            ok = 0;
+        }
+        start = bench_now();
+        if (bench_run_tool(arguments) != 0) {
+            ok = 0;
+        }
+        samples[run] = bench_now() - start;
+    }
+    if (on_copy) {
+        unlink(copy);
+    }
+    bench_report(bench, tool, samples, 1, argument != NULL && bench->largest >= 0 ? bench->files[bench->largest].size : 0, ok);
+    free(samples);
+}
+
+static int bench_one(const char *path) {
+    // Time every phase and every tool against one image
+    bench_image bench;
+    int file_descriptor;
+    struct stat file_status;
+    long *samples = malloc(runs * sizeof(long));
+    char *buffer;
+    int ok;
+
+    memset(&bench, 0, sizeof(bench));
+    bench.path = path;
+    file_descriptor = open(path, O_RDONLY);
+    if (samples == NULL || file_descriptor < 0 || fstat(file_descriptor, &file_status) < 0) {
+        printf("Error: cannot open %s\n", path);
+        free(samples);
+        return -1;
+    }
+    bench.image_size = file_status.st_size;
+    bench.image = mmap(NULL, bench.image_size, PROT_READ, MAP_SHARED, file_descriptor, 0);
+    if (bench.image == MAP_FAILED || fat_load(&bench.fat, bench.image, bench.image_size) < 0 || bench_walk(&bench) < 0) {
+        printf("Error: cannot read %s\n", path);
+        exit(1);
+    }
+
+    // Map and unmap the image
+    ok = 1;
+    for (int run = 0; run < runs; run++) {
+        long start = bench_now();
+        int fd = open(path, O_RDONLY);
+        char *image = mmap(NULL, bench.image_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (image == MAP_FAILED) {
+            ok = 0;
+        } else {
+            munmap(image, bench.image_size);
+        }
+        close(fd);
+        samples[run] = bench_now() - start;
+    }
+    bench_report(&bench, "mmap", samples, 1, bench.image_size, ok);
+
+    // Decode the FAT and build the free bitmap
+    ok = 1;
+    for (int run = 0; run < runs; run++) {
+        fat_table fat;
+        long start = bench_now();
+        if (fat_load(&fat, bench.image, bench.image_size) < 0) {
+            ok = 0;
+        }
+        fat_release(&fat);
+        samples[run] = bench_now() - start;
+    }
+    bench_report(&bench, "fat_scan", samples, bench.fat.count, (long)bench.fat.geo.sectors_per_fat * bench.fat.geo.bytes_per_sector, ok);
+
+    // Walk every directory
+    ok = 1;
+    for (int run = 0; run < runs; run++) {
+        long start = bench_now();
+        if (bench_walk(&bench) < 0) {
+            ok = 0;
+        }
+        samples[run] = bench_now() - start;
+    }
+    bench_report(&bench, "dir_walk", samples, bench.directory_count + 1, 0, ok);
+
+    // Resolve every file by path
+    ok = 1;
+    for (int run = 0; run < runs; run++) {
+        long start = bench_now();
+        if (bench_lookup(&bench) < 0) {
+            ok = 0;
+        }
+        samples[run] = bench_now() - start;
+    }
+    bench_report(&bench, "dir_lookup", samples, bench.file_count, 0, ok);
+
+    // Read every file's data out of the mapping
+    ok = 1;
+    buffer = malloc(bench.largest >= 0 && bench.files[bench.largest].size > 0 ? bench.files[bench.largest].size : 1);
+    for (int run = 0; run < runs; run++) {
+        long start = bench_now();
+        if (buffer == NULL || bench_copy(&bench, buffer) < 0) {
+            ok = 0;
+        }
+        samples[run] = bench_now() - start;
+    }
+    free(buffer);
+    bench_report(&bench, "data_copy", samples, bench.file_count, bench.bytes, ok);
+
+    // Whole tools, the largest file for diskget and diskput
+    bench_tool(&bench, "diskinfo", NULL, NULL, 0);
+    bench_tool(&bench, "disklist", NULL, NULL, 0);
+    if (bench.largest >= 0) {
+        char host_file[4096];
+        FILE *output;
+
+        bench_tool(&bench, "diskget", "--stdout", bench.files[bench.largest].path, 0);
+        snprintf(host_file, sizeof(host_file), "%s/BENCH.DAT", temp_directory);
+        output = fopen(host_file, "w");
+        if (output != NULL) {
+            buffer = malloc(bench.files[bench.largest].size + 1);
+            if (buffer != NULL) {
+                bench_copy(&(bench_image){.image = bench.image, .fat = bench.fat, .files = &bench.files[bench.largest], .file_count = 1}, buffer);
+                fwrite(buffer, 1, bench.files[bench.largest].size, output);
+                free(buffer);
+            }
+            fclose(output);
+            bench_tool(&bench, "diskput", NULL, host_file, 1);
+            unlink(host_file);
+        }
+    }
+
+    bench_free_files(&bench);
+    fat_release(&bench.fat);
+    munmap(bench.image, bench.image_size);
+    close(file_descriptor);
+    free(samples);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    // Main function to benchmark the tools against a set of images
+    int opt;
+    int result = 0;
+
+    while ((opt = getopt(argc, argv, "jr:t:")) != -1) {
+        if (opt == 'j') {
+            json_output = 1;
+        } else if (opt == 'r') {
+            runs = atoi(optarg);
+        } else if (opt == 't') {
+            tool_directory = optarg;
+        } else {
+            runs = 0;
+        }
+    }
+    if (optind >= argc || runs < 1) {
+        printf("Usage: diskbench [-j] [-r runs] [-t tool directory] <image>...\n");
+        printf("Prints CSV (JSON with -j): fastest and median time of each phase and each tool per image\n");
+        return 1;
+    }
+    if (mkdtemp(temp_directory) == NULL) {
+        perror("Error creating temporary directory");
+        return 1;
+    }
+
+    for (int i = optind; i < argc; i++) {
+        result |= bench_one(argv[i]) < 0;
+    }
+    if (json_output) {
+        printf(rows_written > 0 ? "\n]\n" : "[]\n");
+    }
+    rmdir(temp_directory);
+    return result;
+}
@@ -0,0 +1,534 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "fat12.h"
+#include "dirindex.h"
+#include "diskops.h"
+#include "diskimage.h"
+
+// How a chain walk ended
+#define CHAIN_OK 0        // Reached an end-of-chain marker
+#define CHAIN_BAD_START 1 // The entry's start cluster is out of range, free or bad
+#define CHAIN_BROKEN 2    // A link points at a free, bad or out-of-range cluster
+#define CHAIN_CROSSED 3   // Ran into a cluster another chain owns
+#define CHAIN_CYCLE 4     // Came back to one of its own clusters
+#define CHAIN_DOT 5       // Not a chain problem: a "." or ".." entry names the wrong cluster
+
+#define ROOT_OWNER 0xFFFFFFFF // Owner id of the FAT32 root directory's clusters
+
+// Directory waiting to be checked by a worker
+typedef struct {
+    char *path;       // "" for the root
+    int cluster;      // First cluster, DIR_ROOT for the fixed FAT12/16 root
+    int parent;       // First cluster of the parent directory, 0 for the root
+    int *clusters;    // Clusters holding its entries, NULL for the fixed root
+    int cluster_count;
+} check_dir;
+
+// Problem found during the pass, repaired afterwards if asked
+typedef struct {
+    char *path;
+    long entry;       // Directory entry, -1 for the FAT32 root directory
+    int is_directory;
+    int end;          // How the walk ended (CHAIN_*)
+    int start;        // Start cluster from the entry (the right value for CHAIN_DOT)
+    int length;       // Clusters walked before the problem
+    int last;         // Last of those clusters
+    int at;           // Cluster where the walk went wrong
+    long size;        // Size field of a file
+    int dot;          // 1 for ".", 2 for ".." (CHAIN_DOT)
+} check_problem;
+
+// Shared by the workers; the image and FAT are only read until the pass is over
+typedef struct {
+    char *image;
+    fat_table *fat;
+    uint64_t *owned;      // One bit per cluster claimed by a chain, set atomically
+    uint32_t *owner;      // Entry that claimed each cluster, to tell a loop from a cross-link
+    check_dir *queue;
+    int queue_used, queue_size;
+    int active;           // Workers busy with a directory
+    check_problem *problems;
+    int problem_count, problem_size;
+    long files, directories, used;
+    int failed;           // Out of memory somewhere
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+} check_state;
+
+static int check_walk(check_state *state, int start, uint32_t id, check_problem *result, int **clusters) {
+    // Claim a chain cluster by cluster; fills in how it ended and, if asked, the clusters it holds
+    fat_table *fat = state->fat;
+    int capacity = 0;
+    int cluster = start;
+
+    result->length = 0;
+    result->last = 0;
+    result->at = start;
+    if (clusters != NULL) {
+        *clusters = NULL;
+    }
+    if (start < 2 || start >= fat->count || fat_get(fat, start) == FAT_FREE || fat_get(fat, start) == FAT_BAD) {
+        result->end = CHAIN_BAD_START;
+        return 0;
+    }
+    for (;;) {
+        uint64_t bit = 1ULL << (cluster % 64);
+        if (__atomic_fetch_or(&state->owned[cluster / 64], bit, __ATOMIC_RELAXED) & bit) {
+            result->end = __atomic_load_n(&state->owner[cluster], __ATOMIC_RELAXED) == id ? CHAIN_CYCLE : CHAIN_CROSSED;
+            result->at = cluster;
+            return 0;
+        }
+        __atomic_store_n(&state->owner[cluster], id, __ATOMIC_RELAXED);
+        if (clusters != NULL) {
+            if (result->length == capacity) {
+                capacity = capacity > 0 ? 2 * capacity : 16;
+                int *grown = realloc(*clusters, capacity * sizeof(int));
+                if (grown == NULL) {
+                    return -1;
+                }
+                *clusters = grown;
+            }
+            (*clusters)[result->length] = cluster;
+        }
+        result->length++;
+        result->last = cluster;
+
+        int next = fat_get(fat, cluster);
+        if (next >= FAT_EOC_MIN) {
+            result->end = CHAIN_OK;
+            return 0;
+        }
+        if (next < 2 || next >= fat->count) { // Free, bad or outside the volume
+            result->end = CHAIN_BROKEN;
+            result->at = next;
+            return 0;
+        }
+        cluster = next;
+    }
+}
+
+static void check_report(check_state *state, const check_problem *problem) {
+    // Keep a problem for the report and the repair
+    pthread_mutex_lock(&state->lock);
+    if (state->problem_count == state->problem_size) {
+        int size = state->problem_size > 0 ? 2 * state->problem_size : 64;
+        check_problem *grown = realloc(state->problems, size * sizeof(check_problem));
+        if (grown == NULL) {
+            state->failed = 1;
+            free(problem->path);
+            pthread_mutex_unlock(&state->lock);
+            return;
+        }
+        state->problems = grown;
+        state->problem_size = size;
+    }
+    state->problems[state->problem_count++] = *problem;
+    pthread_mutex_unlock(&state->lock);
+}
+
+static char *check_path(const char *parent, const char *entry) {
+    // Path of an entry: the parent's path, "/" and its name
+    char name[13];
+    size_t parent_length = strlen(parent);
+    int name_length = dir_unpack_name((const unsigned char *)entry, name);
+    char *path = malloc(parent_length + name_length + 2);
+
+    if (path != NULL) {
+        memcpy(path, parent, parent_length);
+        if (parent_length > 0) {
+            path[parent_length++] = '/';
+        }
+        memcpy(path + parent_length, name, name_length);
+        path[parent_length + name_length] = '\0';
+    }
+    return path;
+}
+
+static void check_push(check_state *state, const check_dir *dir) {
+    // Queue a subdirectory for whichever worker is free
+    pthread_mutex_lock(&state->lock);
+    if (state->queue_used == state->queue_size) {
+        int size = state->queue_size > 0 ? 2 * state->queue_size : 64;
+        check_dir *grown = realloc(state->queue, size * sizeof(check_dir));
+        if (grown == NULL) {
+            state->failed = 1;
+            free(dir->path);
+            free(dir->clusters);
+            pthread_mutex_unlock(&state->lock);
+            return;
+        }
+        state->queue = grown;
+        state->queue_size = size;
+    }
+    state->queue[state->queue_used++] = *dir;
+    pthread_cond_signal(&state->ready);
+    pthread_mutex_unlock(&state->lock);
+}
+
+static void check_directory(check_state *state, const check_dir *dir) {
+    // Check every entry of one directory, walking file chains here and queueing subdirectories
+    fat_table *fat = state->fat;
+    char *image = state->image;
+    int range_count = dir->clusters != NULL ? dir->cluster_count : 1;
+    long range_length = dir->clusters != NULL ? fat->geo.cluster_size : (long)fat->geo.root_entries * DIR_ENTRY_SIZE;
+    int slot = 0;
+
+    for (int r = 0; r < range_count; r++) {
+        long range = dir->clusters != NULL ? fat_cluster_offset(fat, dir->clusters[r]) : fat->geo.root_offset;
+
+        if (fat_need(fat, range, range_length) < 0) {
+            state->failed = 1;
+            return;
+        }
+
+        for (long offset = range; offset < range + range_length; offset += DIR_ENTRY_SIZE, slot++) {
+            char *entry = image + offset;
+            check_problem problem;
+
+            if (entry[0] == 0x00) { // No entries after the end marker
+                return;
+            }
+            if ((unsigned char)entry[0] == 0xE5 || entry[11] == 0x0F || (entry[11] & 0x08) != 0) {
+                continue; // Deleted, long-name pieces and the volume label
+            }
+            memset(&problem, 0, sizeof(problem));
+            problem.entry = offset;
+            problem.start = dir_entry_cluster(fat, image, offset);
+            if (entry[0] == '.') { // "." names the directory itself, ".." its parent
+                int wanted = slot == 0 ? dir->cluster : dir->parent;
+                if (dir->path[0] != '\0' && slot < 2 && problem.start != wanted) {
+                    problem.path = strdup(dir->path);
+                    problem.end = CHAIN_DOT;
+                    problem.at = problem.start;
+                    problem.start = wanted;
+                    problem.dot = slot + 1;
+                    check_report(state, &problem);
+                }
+                continue;
+            }
+
+            problem.is_directory = (entry[11] & 0x10) != 0;
+            problem.size = problem.is_directory ? 0 : dir_entry_size(image, offset);
+            if (!problem.is_directory) {
+                __atomic_fetch_add(&state->files, 1, __ATOMIC_RELAXED);
+                if (problem.start == 0 && problem.size == 0) {
+                    continue; // Empty file without a chain
+                }
+                if (problem.start == 0) {
+                    problem.end = CHAIN_BAD_START;
+                } else if (check_walk(state, problem.start, offset / DIR_ENTRY_SIZE + 1, &problem, NULL) < 0) {
+                    state->failed = 1;
+                    return;
+                }
+                __atomic_fetch_add(&state->used, problem.length, __ATOMIC_RELAXED);
+                if (problem.end != CHAIN_OK || problem.length != fat_clusters_for(fat, problem.size)) {
+                    problem.path = check_path(dir->path, entry);
+                    check_report(state, &problem);
+                }
+                continue;
+            }
+
+            check_dir sub;
+            __atomic_fetch_add(&state->directories, 1, __ATOMIC_RELAXED);
+            if (check_walk(state, problem.start, offset / DIR_ENTRY_SIZE + 1, &problem, &sub.clusters) < 0) {
+                free(sub.clusters);
+                state->failed = 1;
+                return;
+            }
+            __atomic_fetch_add(&state->used, problem.length, __ATOMIC_RELAXED);
+            sub.path = check_path(dir->path, entry);
+            if (problem.end != CHAIN_OK) {
+                problem.path = strdup(sub.path);
+                check_report(state, &problem);
+            }
+            if (problem.length == 0) { // Nothing of it can be read safely
+                free(sub.path);
+                free(sub.clusters);
+                continue;
+            }
+            sub.cluster = problem.start;
+            sub.parent = dir->path[0] != '\0' ? dir->cluster : 0; // ".." of a top-level directory is 0, even on FAT32
+            sub.cluster_count = problem.length;
+            check_push(state, &sub);
+        }
+    }
+}
+
+static void *check_worker(void *argument) {
+    // Take directories off the queue until the whole tree has been checked
+    check_state *state = argument;
+
+    for (;;) {
+        check_dir dir;
+
+        pthread_mutex_lock(&state->lock);
+        while (state->queue_used == 0 && state->active > 0) {
+            pthread_cond_wait(&state->ready, &state->lock);
+        }
+        if (state->queue_used == 0) { // Nothing queued and nobody left to queue more
+            pthread_cond_broadcast(&state->ready);
+            pthread_mutex_unlock(&state->lock);
+            return NULL;
+        }
+        dir = state->queue[--state->queue_used];
+        state->active++;
+        pthread_mutex_unlock(&state->lock);
+
+        check_directory(state, &dir);
+        free(dir.path);
+        free(dir.clusters);
+
+        pthread_mutex_lock(&state->lock);
+        state->active--;
+        if (state->active == 0 && state->queue_used == 0) {
+            pthread_cond_broadcast(&state->ready);
+        }
+        pthread_mutex_unlock(&state->lock);
+    }
+}
+
+static int check_by_path(const void *a, const void *b) {
+    // Order problems by path, then by entry
+    const check_problem *x = a, *y = b;
+    int order = strcmp(x->path, y->path);
+    return order != 0 ? order : (x->entry > y->entry) - (x->entry < y->entry);
+}
+
+static void check_describe(const check_problem *problem, long cluster_size) {
+    // Print one problem
+    const char *path = problem->path[0] != '\0' ? problem->path : "/";
+
+    if (problem->end == CHAIN_DOT) {
+        printf("%s: \"%s\" entry names cluster %d instead of %d\n", path, problem->dot == 2 ? ".." : ".", problem->at,
+               problem->start);
+    } else if (problem->end == CHAIN_BAD_START) {
+        printf("%s: starts at invalid cluster %d\n", path, problem->start);
+    } else if (problem->end == CHAIN_BROKEN) {
+        printf("%s: chain breaks after %d clusters, cluster %d links to %d\n", path, problem->length, problem->last, problem->at);
+    } else if (problem->end == CHAIN_CROSSED) {
+        printf("%s: cross-linked with another chain at cluster %d, after %d clusters\n", path, problem->at, problem->length);
+    } else if (problem->end == CHAIN_CYCLE) {
+        printf("%s: chain loops back to cluster %d after %d clusters\n", path, problem->at, problem->length);
+    } else {
+        printf("%s: size %ld needs %ld clusters but the chain has %d\n", path, problem->size,
+               (problem->size + cluster_size - 1) / cluster_size, problem->length);
+    }
+}
+
+static int check_repair(char *image, fat_table *fat, const check_problem *problem) {
+    // Fix one problem: cut the chain where it went wrong and make the size agree with it; 0 if it cannot be fixed
+    long cluster_size = fat->geo.cluster_size;
+
+    if (problem->end == CHAIN_DOT) {
+        disk_set_location(image, fat, problem->entry, problem->start, 0);
+        return 1;
+    }
+    if (problem->entry < 0 && problem->length == 0) {
+        return 0; // The FAT32 root directory has nothing left to keep
+    }
+    if (problem->length == 0) { // Nothing usable: drop the file, or the directory entry
+        if (problem->is_directory) {
+            image[problem->entry] = (char)0xE5;
+            fat_touch(fat, problem->entry, 1);
+        } else {
+            disk_set_location(image, fat, problem->entry, 0, 0);
+        }
+        return 1;
+    }
+    if (problem->end != CHAIN_OK) {
+        fat_set(fat, problem->last, FAT_EOC);
+    }
+    if (!problem->is_directory) {
+        long size = problem->size < problem->length * cluster_size ? problem->size : problem->length * cluster_size;
+        int keep = fat_clusters_for(fat, size);
+        int cluster = problem->start;
+
+        for (int k = 0; k < problem->length; k++) { // Free clusters past the end of the file
+            int next = fat_get(fat, cluster);
+            if (k == keep - 1) {
+                fat_set(fat, cluster, FAT_EOC);
+            } else if (k >= keep) {
+                fat_set(fat, cluster, FAT_FREE);
+            }
+            cluster = next;
+        }
+        if (size != problem->size || keep == 0) {
+            disk_set_location(image, fat, problem->entry, keep > 0 ? problem->start : 0, size);
+        }
+    }
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    // Main function to check a disk image in one pass and optionally repair it
+    disk_image image;
+    int repair = 0;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+    check_state state;
+    fat_table fat;
+    int problems = 0, repaired = 0;
+    long lost = 0, lost_chains = 0, bad = 0;
+
+    while ((opt = getopt(argc, argv, "rt:")) != -1) {
+        if (opt == 'r') {
+            repair = 1;
+        } else if (opt == 't') {
+            threads = atoi(optarg);
+        } else {
+            threads = 0;
+        }
+    }
+    if (optind != argc - 1 || threads < 1) {
+        printf("Usage: diskcheck [-r] [-t threads] <disk image>\n");
+        return 1;
+    }
+
+    if (disk_image_open(&image, argv[optind], repair ? IMAGE_WRITE : 0) < 0) { // Open the disk image
+        printf("Error: cannot open %s\n", argv[optind]);
+        return 1;
+    }
+    char *mapped_image = image.data;
+    if (fat_load(&fat, mapped_image, image.size) < 0) {
+        printf("Error: failed to read FAT\n");
+        exit(1);
+    }
+    disk_image_attach(&image, &fat);
+
+    memset(&state, 0, sizeof(state));
+    state.image = mapped_image;
+    state.fat = &fat;
+    state.owned = calloc(fat.count / 64 + 1, sizeof(uint64_t));
+    state.owner = calloc(fat.count, sizeof(uint32_t));
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_cond_init(&state.ready, NULL);
+    if (state.owned == NULL || state.owner == NULL) {
+        printf("Error: out of memory\n");
+        exit(1);
+    }
+
+    // Every FAT copy must match the first, which is the one the tools read
+    long fat_bytes = fat.geo.sectors_per_fat * fat.geo.bytes_per_sector;
+    for (int copy = 1; copy < fat.geo.fat_copies; copy++) {
+        unsigned char *other = fat.fat + copy * fat_bytes;
+        int sectors = 0;
+        for (long s = 0; s < fat_bytes; s += fat.geo.bytes_per_sector) {
+            sectors += memcmp(fat.fat + s, other + s, fat.geo.bytes_per_sector) != 0;
+        }
+        if (sectors > 0) {
+            printf("FAT copy %d differs from the first in %d sectors\n", copy + 1, sectors);
+            problems++;
+            if (repair) {
+                memcpy(other, fat.fat, fat_bytes);
+                fat_touch(&fat, fat.geo.fat_offset + copy * fat_bytes, fat_bytes);
+                repaired++;
+            }
+        }
+    }
+
+    // The root directory: a fixed area, or on FAT32 a chain like any other
+    check_dir root = {strdup(""), DIR_ROOT, 0, NULL, 0};
+    if (fat.geo.width == 32) {
+        check_problem problem;
+        memset(&problem, 0, sizeof(problem));
+        problem.entry = -1;
+        problem.is_directory = 1;
+        problem.start = fat.geo.root_cluster;
+        if (check_walk(&state, fat.geo.root_cluster, ROOT_OWNER, &problem, &root.clusters) < 0) {
+            printf("Error: out of memory\n");
+            exit(1);
+        }
+        state.used += problem.length;
+        root.cluster = fat.geo.root_cluster;
+        root.cluster_count = problem.length;
+        if (problem.end != CHAIN_OK) {
+            problem.path = strdup("");
+            check_report(&state, &problem);
+        }
+    }
+    if (root.path == NULL) {
+        printf("Error: out of memory\n");
+        exit(1);
+    }
+    check_push(&state, &root);
+
+    // Subtrees are checked in parallel, claiming clusters in the shared ownership bitmap
+    pthread_t *workers = malloc(threads * sizeof(pthread_t));
+    int started = 0;
+    while (workers != NULL && started < threads && pthread_create(&workers[started], NULL, check_worker, &state) == 0) {
+        started++;
+    }
+    if (started == 0) {
+        check_worker(&state);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    if (state.failed) {
+        printf("Error: out of memory\n");
+        exit(1);
+    }
+
+    qsort(state.problems, state.problem_count, sizeof(check_problem), check_by_path);
+    for (int i = 0; i < state.problem_count; i++) {
+        check_describe(&state.problems[i], fat.geo.cluster_size);
+        problems++;
+        if (repair && check_repair(mapped_image, &fat, &state.problems[i])) {
+            repaired++;
+        }
+    }
+
+    // One linear pass over the FAT: clusters marked used that no chain claimed are lost
+    for (int cluster = 2; cluster < fat.count; cluster++) {
+        int value = fat_get(&fat, cluster);
+        if (value == FAT_BAD) {
+            bad++;
+        } else if (value != FAT_FREE && !(state.owned[cluster / 64] >> (cluster % 64) & 1)) {
+            int next = value;
+            lost++;
+            // Count lost chains by their last cluster
+            lost_chains += next >= FAT_EOC_MIN || next < 2 || next >= fat.count || (state.owned[next / 64] >> (next % 64) & 1);
+            if (repair) {
+                fat_set(&fat, cluster, FAT_FREE);
+            }
+        }
+    }
+    if (lost > 0) {
+        printf("%ld lost clusters in %ld chains\n", lost, lost_chains);
+        problems++;
+        repaired += repair;
+    }
+
+    printf("%s: FAT%d, %ld files, %ld directories, %ld clusters in use, %ld bad\n", argv[optind], fat.geo.width,
+           state.files, state.directories, state.used, bad);
+    if (problems == 0) {
+        printf("No problems found\n");
+    } else if (repair) {
+        printf("%d problems found, %d repaired\n", problems, repaired);
+        if (fat_commit(&fat) < 0) {
+            perror("Error syncing disk image");
+        }
+    } else {
+        printf("%d problems found; run with -r to repair\n", problems);
+    }
+
+    for (int i = 0; i < state.problem_count; i++) {
+        free(state.problems[i].path);
+    }
+    free(state.problems);
+    free(state.queue);
+    free(state.owned);
+    free(state.owner);
+    fat_release(&fat);
+    disk_image_close(&image);
+    return problems > 0;
+}
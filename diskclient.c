@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "diskclient.h"
+#include "diskops.h"
+
+static int client_socket = -2; // -2 until the first connection attempt, -1 if there is no server
+
+const char *disk_socket_path(char *buffer, size_t size) {
+    // Socket of the image server: $FATTOOLS_SOCKET, or a per-user default; NULL if disabled
+    const char *path = getenv("FATTOOLS_SOCKET");
+
+    if (path != NULL) {
+        return path[0] != '\0' ? path : NULL; // An empty value turns client mode off
+    }
+    snprintf(buffer, size, "/tmp/fattools-%u.sock", (unsigned)getuid());
+    return buffer;
+}
+
+int disk_send_fd(int socket, const void *data, size_t length, int fd) {
+    // Send a message, with a descriptor attached if fd is not -1
+    struct iovec io = {(void *)data, length};
+    struct msghdr message;
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof(int))];
+    } control;
+
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &io;
+    message.msg_iovlen = 1;
+    if (fd >= 0) {
+        memset(&control, 0, sizeof(control));
+        message.msg_control = control.space;
+        message.msg_controllen = sizeof(control.space);
+        struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(header), &fd, sizeof(int));
+    }
+    while (io.iov_len > 0) {
+        ssize_t sent = sendmsg(socket, &message, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return -1;
+        }
+        io.iov_base = (char *)io.iov_base + sent;
+        io.iov_len -= sent;
+        message.msg_control = NULL; // The descriptor went with the first part
+        message.msg_controllen = 0;
+    }
+    return 0;
+}
+
+int disk_recv_fd(int socket, void *data, size_t length, int *fd) {
+    // Receive exactly length bytes and the descriptor sent with them (-1 if none); -1 at end of stream
+    struct iovec io = {data, length};
+    struct msghdr message;
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof(int))];
+    } control;
+    ssize_t received;
+
+    *fd = -1;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &io;
+    message.msg_iovlen = 1;
+    message.msg_control = control.space;
+    message.msg_controllen = sizeof(control.space);
+    do {
+        received = recvmsg(socket, &message, MSG_CMSG_CLOEXEC);
+    } while (received < 0 && errno == EINTR);
+    if (received <= 0) {
+        return -1;
+    }
+    for (struct cmsghdr *header = CMSG_FIRSTHDR(&message); header != NULL; header = CMSG_NXTHDR(&message, header)) {
+        if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS) {
+            memcpy(fd, CMSG_DATA(header), sizeof(int));
+        }
+    }
+    if ((size_t)received < length && disk_read_full(socket, (char *)data + received, length - received) < 0) {
+        if (*fd >= 0) {
+            close(*fd);
+            *fd = -1;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+int disk_read_full(int fd, void *data, size_t length) {
+    // Read exactly length bytes; -1 on error or early end of stream
+    while (length > 0) {
+        ssize_t got = read(fd, data, length);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return -1;
+        }
+        data = (char *)data + got;
+        length -= got;
+    }
+    return 0;
+}
+
+int disk_client_connect(void) {
+    // Connect to the image server once per process; -1 if none is running
+    char buffer[108];
+    const char *path;
+    struct sockaddr_un address;
+
+    if (client_socket != -2) {
+        return client_socket;
+    }
+    client_socket = -1;
+    path = disk_socket_path(buffer, sizeof(buffer));
+    if (path == NULL || strlen(path) >= sizeof(address.sun_path)) {
+        return -1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        close(fd);
+        return -1;
+    }
+    client_socket = fd;
+    return fd;
+}
+
+static int client_reply(void) {
+    // Wait for the server's reply to the current request
+    diskd_reply reply;
+    if (disk_read_full(client_socket, &reply, sizeof(reply)) < 0 || reply.magic != DISKD_MAGIC) {
+        return DISK_IO_ERROR;
+    }
+    return reply.status;
+}
+
+int disk_client_request(int op, int mode, const char *image, const char *name, const char *dir, int fd) {
+    // Send one request, with fd attached, and return the server's result code
+    char image_path[PATH_MAX];
+    char message[sizeof(diskd_request) + 3 * DISKD_PATH_MAX];
+    diskd_request request;
+    size_t image_length, name_length, dir_length;
+
+    if (realpath(image, image_path) == NULL) { // The server keys images by their full path
+        return DISK_BAD_IMAGE;
+    }
+    name = name != NULL ? name : "";
+    dir = dir != NULL ? dir : "";
+    image_length = strlen(image_path);
+    name_length = strlen(name);
+    dir_length = strlen(dir);
+    if (client_socket < 0 || image_length > DISKD_PATH_MAX || name_length > DISKD_PATH_MAX || dir_length > DISKD_PATH_MAX) {
+        return DISK_BAD_REQUEST;
+    }
+
+    memset(&request, 0, sizeof(request));
+    request.magic = DISKD_MAGIC;
+    request.op = op;
+    request.mode = mode;
+    request.image_length = image_length;
+    request.name_length = name_length;
+    request.dir_length = dir_length;
+    memcpy(message, &request, sizeof(request));
+    memcpy(message + sizeof(request), image_path, image_length);
+    memcpy(message + sizeof(request) + image_length, name, name_length);
+    memcpy(message + sizeof(request) + image_length + name_length, dir, dir_length);
+    if (disk_send_fd(client_socket, message, sizeof(request) + image_length + name_length + dir_length, fd) < 0) {
+        return DISK_IO_ERROR;
+    }
+    return client_reply();
+}
+
+int disk_client_finish(int fd) {
+    // Hand the output of a found DISKD_GET file to the server and wait for the copy
+    char go = 1;
+    if (disk_send_fd(client_socket, &go, 1, fd) < 0) {
+        return DISK_IO_ERROR;
+    }
+    return client_reply();
+}
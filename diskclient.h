@@ -0,0 +1,46 @@
+#ifndef DISKCLIENT_H
+#define DISKCLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Protocol spoken over the image server's Unix socket. Each request is a header
+// followed by the image path, the name and the directory path (lengths in the
+// header, no terminators). A descriptor travels with the header: the output for
+// DISKD_INFO and DISKD_LIST, the input for DISKD_PUT. DISKD_GET first replies
+// whether the file exists, then takes the output descriptor in a one-byte message
+// and replies again when the copy is done. Replies carry a diskops.h result code.
+#define DISKD_MAGIC 0x44544146 // "FATD"
+#define DISKD_INFO 1
+#define DISKD_LIST 2
+#define DISKD_GET 3
+#define DISKD_PUT 4
+
+#define DISKD_PATH_MAX 4096
+
+typedef struct {
+    uint32_t magic;
+    uint16_t op;
+    uint16_t mode;         // Listing format for DISKD_LIST
+    uint16_t image_length;
+    uint16_t name_length;  // File path for DISKD_GET, entry name for DISKD_PUT
+    uint16_t dir_length;   // Target directory for DISKD_PUT, 0 for the root
+    uint16_t reserved;
+} diskd_request;
+
+typedef struct {
+    uint32_t magic;
+    int32_t status;
+} diskd_reply;
+
+const char *disk_socket_path(char *buffer, size_t size);
+int disk_send_fd(int socket, const void *data, size_t length, int fd);
+int disk_recv_fd(int socket, void *data, size_t length, int *fd);
+int disk_read_full(int fd, void *data, size_t length);
+
+// Client side, used by the tools when a server is running
+int disk_client_connect(void);
+int disk_client_request(int op, int mode, const char *image, const char *name, const char *dir, int fd);
+int disk_client_finish(int fd);
+
+#endif
@@ -0,0 +1,374 @@
+#define _GNU_SOURCE // accept4
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "fat12.h"
+#include "dirindex.h"
+#include "diskops.h"
+#include "diskimage.h"
+#include "diskclient.h"
+
+#define QUEUE_SIZE 256 // Accepted connections waiting for a worker
+
+// Image kept mapped, decoded and indexed between requests
+typedef struct {
+    char *path;
+    int fd;                    // -1 while not loaded
+    char *image;
+    disk_image file;           // Backend holding the image, whichever $FATTOOLS_IO picked
+    struct stat status;        // File as it was after the last load or write
+    fat_table fat;
+    dir_index index;
+    pthread_rwlock_t lock;     // Readers share, a writer has the image to itself
+    pthread_mutex_t index_lock; // The index fills in lazily, so lookups under a read lock take turns
+} served_image;
+
+static served_image **images;
+static int image_count;
+static pthread_mutex_t images_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int queue[QUEUE_SIZE];
+static int queue_head, queue_used;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;
+
+static void serve_unload(served_image *served) {
+    // Drop the mapping and the decoded state
+    if (served->fd < 0) {
+        return;
+    }
+    dir_index_release(&served->index);
+    fat_release(&served->fat);
+    disk_image_close(&served->file);
+    served->fd = -1;
+}
+
+static int serve_load(served_image *served, int write) {
+    // Open the image, read-only unless a put needs it writable, and decode its FAT; the caller holds the write lock, and
+    // locks the file around each request
+    if (disk_image_open(&served->file, served->path, IMAGE_UNLOCKED | (write ? IMAGE_WRITE : 0)) < 0) {
+        return -1;
+    }
+    if (fstat(served->file.fd, &served->status) < 0) {
+        disk_image_close(&served->file);
+        return -1;
+    }
+    served->image = served->file.data;
+    if (fat_load(&served->fat, served->image, served->file.size) < 0) {
+        disk_image_close(&served->file);
+        return -1;
+    }
+    disk_image_attach(&served->file, &served->fat);
+    if (dir_index_init(&served->index, served->image, &served->fat) < 0) {
+        fat_release(&served->fat);
+        disk_image_close(&served->file);
+        return -1;
+    }
+    served->fd = served->file.fd;
+    return 0;
+}
+
+static int serve_stale(served_image *served) {
+    // True if the image is not loaded or the file changed behind our back, or another process committed to it
+    struct stat now;
+    if (served->fd < 0) {
+        return 1;
+    }
+    if (stat(served->path, &now) < 0) {
+        return 1;
+    }
+    return now.st_dev != served->status.st_dev || now.st_ino != served->status.st_ino ||
+           now.st_size != served->status.st_size || now.st_mtim.tv_sec != served->status.st_mtim.tv_sec ||
+           now.st_mtim.tv_nsec != served->status.st_mtim.tv_nsec || disk_image_changed(&served->file);
+}
+
+static int serve_usable(served_image *served, int write) {
+    // True if the loaded image is current and, for a put, open for writing
+    return !serve_stale(served) && (!write || (served->file.flags & IMAGE_WRITE) != 0);
+}
+
+static served_image *serve_find(const char *path) {
+    // Find the entry for an image path, creating it on first use
+    served_image *served = NULL;
+
+    pthread_mutex_lock(&images_lock);
+    for (int i = 0; i < image_count; i++) {
+        if (strcmp(images[i]->path, path) == 0) {
+            served = images[i];
+            break;
+        }
+    }
+    if (served == NULL) {
+        served_image **grown = realloc(images, (image_count + 1) * sizeof(served_image *));
+        served = calloc(1, sizeof(served_image));
+        if (grown != NULL) {
+            images = grown;
+        }
+        if (grown == NULL || served == NULL || (served->path = strdup(path)) == NULL) {
+            free(served);
+            pthread_mutex_unlock(&images_lock);
+            return NULL;
+        }
+        served->fd = -1;
+        pthread_rwlock_init(&served->lock, NULL);
+        pthread_mutex_init(&served->index_lock, NULL);
+        images[image_count++] = served;
+    }
+    pthread_mutex_unlock(&images_lock);
+    return served;
+}
+
+static served_image *serve_acquire(const char *path, int write) {
+    // Lock an image for reading or writing, among our threads and against other processes, (re)loading it first if
+    // needed; NULL if it cannot be read
+    served_image *served = serve_find(path);
+    int flags = write ? IMAGE_WRITE : 0;
+
+    if (served == NULL) {
+        return NULL;
+    }
+    for (;;) {
+        if (write) {
+            pthread_rwlock_wrlock(&served->lock);
+        } else {
+            pthread_rwlock_rdlock(&served->lock);
+        }
+        if (serve_usable(served, write)) {
+            if (disk_image_lock(&served->file, flags) < 0) {
+                pthread_rwlock_unlock(&served->lock);
+                return NULL;
+            }
+            if (!serve_stale(served)) { // Nothing was committed while we waited for the file lock
+                return served;
+            }
+            disk_image_unlock(&served->file, flags);
+        }
+        if (!write) { // Reloading needs the write lock
+            pthread_rwlock_unlock(&served->lock);
+            pthread_rwlock_wrlock(&served->lock);
+        }
+        if (!serve_usable(served, write)) {
+            serve_unload(served);
+            if (serve_load(served, write) < 0) {
+                pthread_rwlock_unlock(&served->lock);
+                return NULL;
+            }
+        }
+        pthread_rwlock_unlock(&served->lock);
+    }
+}
+
+static void serve_release(served_image *served, int write) {
+    // Undo serve_acquire
+    disk_image_unlock(&served->file, write ? IMAGE_WRITE : 0);
+    pthread_rwlock_unlock(&served->lock);
+}
+
+static int serve_reply(int client, int status) {
+    // Send a result code back to the client
+    diskd_reply reply = {DISKD_MAGIC, status};
+    return disk_send_fd(client, &reply, sizeof(reply), -1);
+}
+
+static int serve_request(int client, const diskd_request *request, const char *image, const char *name, const char *dir, int fd) {
+    // Carry out one request; returns -1 if the connection broke
+    served_image *served = serve_acquire(image, request->op == DISKD_PUT);
+    int status;
+
+    if (served == NULL) {
+        return serve_reply(client, DISK_BAD_IMAGE);
+    }
+    if (request->op == DISKD_INFO) {
+        status = fd < 0 ? DISK_BAD_REQUEST : disk_info(served->image, served->file.size, &served->fat, fd);
+    } else if (request->op == DISKD_LIST) {
+        status = fd < 0 || request->mode > DISK_LIST_CRC ? DISK_BAD_REQUEST : disk_list(served->image, &served->fat, request->mode, fd);
+    } else if (request->op == DISKD_GET) {
+        char go;
+        int out_fd;
+
+        pthread_mutex_lock(&served->index_lock);
+        long entry = dir_resolve(&served->index, name);
+        pthread_mutex_unlock(&served->index_lock);
+        if (entry < 0 || (served->image[entry + 11] & 0x10) != 0) {
+            status = DISK_NOT_FOUND;
+        } else if (serve_reply(client, DISK_OK) < 0 || disk_recv_fd(client, &go, 1, &out_fd) < 0) {
+            serve_release(served, 0);
+            return -1;
+        } else {
+            status = out_fd < 0 ? DISK_BAD_REQUEST : disk_get(served->file.copy_fd, served->image, &served->fat, entry, out_fd, NULL);
+            if (out_fd >= 0) {
+                close(out_fd);
+            }
+        }
+    } else if (request->op == DISKD_PUT) {
+        int target = dir_find_directory(&served->index, dir[0] != '\0' ? dir : NULL);
+        if (fd < 0 || name[0] == '\0') {
+            status = DISK_BAD_REQUEST;
+        } else if (target < 0) {
+            status = DISK_DIR_NOT_FOUND;
+        } else {
+            status = disk_put(served->image, &served->fat, &served->index, fd, name, target, NULL, NULL);
+            if (fat_commit(&served->fat) < 0) {
+                status = status == DISK_OK ? DISK_IO_ERROR : status;
+            } else {
+                disk_image_drop_pages(&served->file); // Otherwise every page ever written stays private to us
+            }
+            fstat(served->fd, &served->status); // Our own write is not a reason to reload
+        }
+    } else {
+        status = DISK_BAD_REQUEST;
+    }
+    serve_release(served, request->op == DISKD_PUT);
+    return serve_reply(client, status);
+}
+
+static void serve_connection(int client) {
+    // Answer requests on one connection until the client hangs up
+    diskd_request request;
+    char strings[3 * DISKD_PATH_MAX + 3];
+    int fd;
+
+    while (disk_recv_fd(client, &request, sizeof(request), &fd) == 0) {
+        char *image = strings;
+        char *name, *dir;
+        int broken;
+
+        if (request.magic != DISKD_MAGIC || request.image_length == 0 || request.image_length > DISKD_PATH_MAX ||
+            request.name_length > DISKD_PATH_MAX || request.dir_length > DISKD_PATH_MAX) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            break;
+        }
+        name = image + request.image_length + 1;
+        dir = name + request.name_length + 1;
+        if (disk_read_full(client, image, request.image_length) < 0 || disk_read_full(client, name, request.name_length) < 0 ||
+            disk_read_full(client, dir, request.dir_length) < 0) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            break;
+        }
+        image[request.image_length] = '\0';
+        name[request.name_length] = '\0';
+        dir[request.dir_length] = '\0';
+
+        broken = serve_request(client, &request, image, name, dir, fd) < 0;
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (broken) {
+            break;
+        }
+    }
+    close(client);
+}
+
+static void *serve_worker(void *unused) {
+    // Take accepted connections off the queue and serve them
+    (void)unused;
+    for (;;) {
+        int client;
+
+        pthread_mutex_lock(&queue_lock);
+        while (queue_used == 0) {
+            pthread_cond_wait(&queue_ready, &queue_lock);
+        }
+        client = queue[queue_head];
+        queue_head = (queue_head + 1) % QUEUE_SIZE;
+        queue_used--;
+        pthread_cond_broadcast(&queue_ready);
+        pthread_mutex_unlock(&queue_lock);
+
+        serve_connection(client);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    // Main function to serve info, list, get and put requests for images kept in memory
+    char buffer[108];
+    const char *socket_path = NULL;
+    int threads = 4;
+    int opt;
+    struct sockaddr_un address;
+
+    while ((opt = getopt(argc, argv, "s:t:")) != -1) {
+        if (opt == 's') {
+            socket_path = optarg;
+        } else if (opt == 't') {
+            threads = atoi(optarg);
+        } else {
+            threads = 0;
+        }
+    }
+    if (socket_path == NULL) {
+        socket_path = disk_socket_path(buffer, sizeof(buffer));
+    }
+    if (optind != argc || threads < 1 || socket_path == NULL || strlen(socket_path) >= sizeof(address.sun_path)) {
+        printf("Usage: diskd [-s socket] [-t threads]\n");
+        printf("Default socket: $FATTOOLS_SOCKET, or /tmp/fattools-<uid>.sock\n");
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socket_path);
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener < 0) {
+        perror("Error creating socket");
+        return 1;
+    }
+    if (connect(listener, (struct sockaddr *)&address, sizeof(address)) == 0) {
+        printf("Error: a server is already listening on %s\n", socket_path);
+        return 1;
+    }
+    close(listener);
+    listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unlink(socket_path); // Left over from a server that did not shut down cleanly
+    mode_t old_mask = umask(077);
+    if (listener < 0 || bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(listener, 64) < 0) {
+        perror("Error listening on socket");
+        return 1;
+    }
+    umask(old_mask);
+
+    for (int i = 0; i < threads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, serve_worker, NULL) != 0) {
+            perror("Error starting worker");
+            return 1;
+        }
+        pthread_detach(thread);
+    }
+
+    for (;;) {
+        int client = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (client < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                perror("Error accepting connection");
+            }
+            continue;
+        }
+        pthread_mutex_lock(&queue_lock);
+        while (queue_used == QUEUE_SIZE) {
+            pthread_cond_wait(&queue_ready, &queue_lock);
+        }
+        queue[(queue_head + queue_used) % QUEUE_SIZE] = client;
+        queue_used++;
+        pthread_cond_broadcast(&queue_ready);
+        pthread_mutex_unlock(&queue_lock);
+    }
+}
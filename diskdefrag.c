@@ -0,0 +1,411 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "fat12.h"
+#include "dirindex.h"
+#include "diskops.h"
+#include "diskimage.h"
+
+#define MOVE_BYTES (1024 * 1024) // Largest block moved in one step
+
+// One cluster chain to relocate: a file, a subdirectory or the FAT32 root directory
+typedef struct {
+    int start;        // First cluster before the move
+    int length;       // Clusters in the chain
+    int first;        // Index of its first cluster in the placement order
+    int owner;        // Cluster holding its directory entry, DIR_ROOT for the fixed root, -1 for the FAT32 root itself
+    long within;      // Entry offset inside the owner cluster (absolute for the fixed root)
+    int parent;       // Chain of the directory holding it, -1 in the root directory
+    int is_directory;
+} defrag_chain;
+
+// Relocation worked out before anything is moved
+typedef struct {
+    defrag_chain *chains;
+    int chain_count, chain_size;
+    int files, directories;
+    int *order;       // Clusters in their new order, chain after chain
+    int order_count;
+    int *target;      // New position of each cluster in a chain
+    int *holder;      // Chain cluster whose data is at each position while moving, 0 if none
+    int *location;    // Current position of each chain cluster's data while moving
+    uint64_t *owned;  // Clusters that belong to a chain
+} defrag_plan;
+
+// Totals for the fragmentation report
+typedef struct {
+    long extents_before, extents_after;
+    int fragmented_before, fragmented_after;
+    long misplaced;   // Clusters whose position changes
+    long moves;       // Block moves needed
+    long copied;      // Clusters copied, counting those pushed aside
+} defrag_totals;
+
+static int defrag_walk(fat_table *fat, defrag_plan *plan, int start) {
+    // Claim the clusters of a chain; returns its length, or -1 if it is broken or shares clusters
+    int length = 0;
+    int cluster = start;
+
+    for (;;) {
+        if (cluster < 2 || cluster >= fat->count || (plan->owned[cluster / 64] >> (cluster % 64) & 1)) {
+            return -1;
+        }
+        plan->owned[cluster / 64] |= 1ULL << (cluster % 64);
+        length++;
+        int next = fat_get(fat, cluster);
+        if (next >= FAT_EOC_MIN) {
+            return length;
+        }
+        if (next == FAT_FREE || next == FAT_BAD) {
+            return -1;
+        }
+        cluster = next;
+    }
+}
+
+static int defrag_add(fat_table *fat, defrag_plan *plan, const defrag_chain *chain) {
+    // Record a chain after checking it; 0 on success
+    if (plan->chain_count == plan->chain_size) {
+        int size = plan->chain_size > 0 ? 2 * plan->chain_size : 256;
+        defrag_chain *grown = realloc(plan->chains, size * sizeof(defrag_chain));
+        if (grown == NULL) {
+            printf("Error: out of memory\n");
+            return -1;
+        }
+        plan->chains = grown;
+        plan->chain_size = size;
+    }
+    plan->chains[plan->chain_count] = *chain;
+    plan->chains[plan->chain_count].length = defrag_walk(fat, plan, chain->start);
+    if (plan->chains[plan->chain_count].length < 0) {
+        printf("Error: the cluster chain starting at %d is broken or shared with another file; repair the image first\n", chain->start);
+        return -1;
+    }
+    plan->chain_count++;
+    return 0;
+}
+
+static int defrag_collect(char *image, fat_table *fat, defrag_plan *plan) {
+    // Record every chain breadth first, each directory followed by the files in it
+    defrag_chain *queue = malloc(64 * sizeof(defrag_chain));
+    int queue_head = 0, queue_used = 0, queue_size = 64;
+    int result = 0;
+
+    if (queue == NULL) {
+        printf("Error: out of memory\n");
+        return -1;
+    }
+    queue[queue_used].start = DIR_ROOT;
+    queue[queue_used].owner = -1;
+    queue[queue_used].within = 0;
+    queue[queue_used].parent = -1;
+    queue[queue_used].is_directory = 1;
+    queue_used++;
+
+    while (queue_head < queue_used && result == 0) {
+        defrag_chain dir = queue[queue_head++];
+        int dir_chain = -1; // The fixed FAT12/16 root has no chain
+        int range_count;
+        dir_range *ranges;
+
+        if (dir.start != DIR_ROOT || fat->geo.width == 32) {
+            if (dir.start == DIR_ROOT) {
+                dir.start = fat->geo.root_cluster;
+            }
+            if (defrag_add(fat, plan, &dir) < 0) {
+                result = -1;
+                break;
+            }
+            dir_chain = plan->chain_count - 1;
+            plan->directories += dir.owner != -1;
+        }
+
+        ranges = dir_ranges(fat, dir.owner == -1 ? DIR_ROOT : dir.start, &range_count);
+        if (ranges == NULL) {
+            printf("Error: out of memory\n");
+            result = -1;
+            break;
+        }
+        for (int r = 0; r < range_count && result == 0; r++) {
+            for (long offset = ranges[r].offset; offset < ranges[r].offset + ranges[r].length; offset += DIR_ENTRY_SIZE) {
+                char *entry = image + offset;
+                defrag_chain item;
+
+                if (entry[0] == 0x00) { // No entries after the end marker
+                    r = range_count;
+                    break;
+                }
+                if ((unsigned char)entry[0] == 0xE5 || entry[0] == '.' || entry[11] == 0x0F || (entry[11] & 0x08) != 0) {
+                    continue; // Deleted, "." and "..", long-name pieces and the volume label
+                }
+                item.start = dir_entry_cluster(fat, image, offset);
+                item.is_directory = (entry[11] & 0x10) != 0;
+                item.parent = dir_chain;
+                if (dir.owner == -1 && fat->geo.width != 32) {
+                    item.owner = DIR_ROOT;
+                    item.within = offset;
+                } else {
+                    item.owner = fat_offset_cluster(fat, offset);
+                    item.within = offset - fat_cluster_offset(fat, item.owner);
+                }
+                if (!item.is_directory) {
+                    plan->files++;
+                    if (item.start != 0 && defrag_add(fat, plan, &item) < 0) { // Empty files have nothing to move
+                        result = -1;
+                        break;
+                    }
+                    continue;
+                }
+                if (queue_used == queue_size) {
+                    defrag_chain *grown = realloc(queue, 2 * queue_size * sizeof(defrag_chain));
+                    if (grown == NULL) {
+                        printf("Error: out of memory\n");
+                        result = -1;
+                        break;
+                    }
+                    queue = grown;
+                    queue_size *= 2;
+                }
+                queue[queue_used++] = item;
+            }
+        }
+        free(ranges);
+    }
+    free(queue);
+    return result;
+}
+
+static int defrag_place(fat_table *fat, defrag_plan *plan, defrag_totals *totals) {
+    // Give every chain cluster a new position, packing chains in order around bad and unowned clusters
+    int position = 2;
+
+    plan->order = malloc((size_t)fat->count * sizeof(int));
+    plan->target = calloc(fat->count, sizeof(int));
+    plan->holder = calloc(fat->count, sizeof(int));
+    plan->location = calloc(fat->count, sizeof(int));
+    if (plan->order == NULL || plan->target == NULL || plan->holder == NULL || plan->location == NULL) {
+        printf("Error: out of memory\n");
+        return -1;
+    }
+    for (int i = 0; i < plan->chain_count; i++) {
+        defrag_chain *chain = &plan->chains[i];
+        int cluster = chain->start;
+        int extents_before = 0, extents_after = 0;
+
+        chain->first = plan->order_count;
+        for (int j = 0; j < chain->length; j++) {
+            // Clusters marked used or bad that no chain owns stay where they are
+            while (fat_get(fat, position) != FAT_FREE && !(plan->owned[position / 64] >> (position % 64) & 1)) {
+                position++;
+            }
+            plan->order[plan->order_count++] = cluster;
+            plan->target[cluster] = position;
+            plan->holder[cluster] = cluster;
+            plan->location[cluster] = cluster;
+            if (j == 0 || cluster != plan->order[plan->order_count - 2] + 1) {
+                extents_before++;
+            }
+            if (j == 0 || position != plan->target[plan->order[plan->order_count - 2]] + 1) {
+                extents_after++;
+            }
+            totals->misplaced += position != cluster;
+            position++;
+            cluster = fat_get(fat, cluster);
+        }
+        totals->extents_before += extents_before;
+        totals->extents_after += extents_after;
+        totals->fragmented_before += extents_before > 1;
+        totals->fragmented_after += extents_after > 1;
+    }
+    fat->cursor = position < fat->count ? position : 2;
+    return 0;
+}
+
+static void defrag_copy(char *image, fat_table *fat, int to, int from, int length) {
+    // Move a block of clusters, overlapping or not, and remember the write
+    long size = (long)length * fat->geo.cluster_size;
+    memmove(image + fat_cluster_offset(fat, to), image + fat_cluster_offset(fat, from), size);
+    fat_touch(fat, fat_cluster_offset(fat, to), size);
+}
+
+static int defrag_move(char *image, fat_table *fat, defrag_plan *plan, defrag_totals *totals, int dry_run) {
+    // Fill the new positions in order, pushing whatever sits in the way further up, so cycles need no special case
+    int limit = MOVE_BYTES / fat->geo.cluster_size > 0 ? MOVE_BYTES / fat->geo.cluster_size : 1;
+    char *scratch = dry_run ? NULL : malloc((long)limit * fat->geo.cluster_size);
+
+    if (!dry_run && scratch == NULL) {
+        printf("Error: out of memory\n");
+        return -1;
+    }
+    for (int k = 0; k < plan->order_count;) {
+        int to = plan->target[plan->order[k]];
+        int from = plan->location[plan->order[k]];
+        int length = 1;
+        int blocked = 0; // Data in the way that must be kept
+
+        if (from == to) {
+            k++;
+            continue;
+        }
+        // Longest block whose old and new positions are both consecutive
+        while (k + length < plan->order_count && length < limit && plan->target[plan->order[k + length]] == to + length &&
+               plan->location[plan->order[k + length]] == from + length) {
+            length++;
+        }
+        for (int i = 0; i < length; i++) {
+            if (plan->holder[to + i] != 0 && (to + i < from || to + i >= from + length)) {
+                blocked = 1;
+            }
+        }
+        if (!dry_run && (fat_need(fat, fat_cluster_offset(fat, to), (long)length * fat->geo.cluster_size) < 0 ||
+                         fat_need(fat, fat_cluster_offset(fat, from), (long)length * fat->geo.cluster_size) < 0)) {
+            printf("Error: cannot read the image\n");
+            free(scratch);
+            return -1;
+        }
+
+        if (!blocked) { // The new place is free or part of the block itself: one memmove
+            if (!dry_run) {
+                defrag_copy(image, fat, to, from, length);
+            }
+            for (int i = 0; i < length; i++) {
+                plan->holder[from + i] = 0;
+            }
+        } else {
+            // Whatever sits in the way goes just past the block's new place: into the old place when the
+            // two do not overlap, otherwise into the tail the block leaves behind
+            int pushed_count = from - to < length ? from - to : length;
+            int pushed_to = from + length - pushed_count;
+            if (!dry_run) {
+                long size = (long)pushed_count * fat->geo.cluster_size;
+                memcpy(scratch, image + fat_cluster_offset(fat, to), size);
+                defrag_copy(image, fat, to, from, length);
+                memcpy(image + fat_cluster_offset(fat, pushed_to), scratch, size);
+                fat_touch(fat, fat_cluster_offset(fat, pushed_to), size);
+            }
+            for (int i = 0; i < pushed_count; i++) {
+                int pushed = plan->holder[to + i];
+                plan->holder[pushed_to + i] = pushed;
+                if (pushed != 0) {
+                    plan->location[pushed] = pushed_to + i;
+                    totals->copied++;
+                }
+            }
+        }
+        for (int i = 0; i < length; i++) {
+            plan->holder[to + i] = plan->order[k + i];
+            plan->location[plan->order[k + i]] = to + i;
+        }
+        totals->moves++;
+        totals->copied += length;
+        k += length;
+    }
+    free(scratch);
+    return 0;
+}
+
+static void defrag_relink(char *image, fat_table *fat, defrag_plan *plan) {
+    // Rewrite the FAT and every start cluster in one batch, once all data is in place
+    unsigned char root[4];
+
+    for (int k = 0; k < plan->order_count; k++) {
+        fat_set(fat, plan->order[k], FAT_FREE);
+    }
+    for (int i = 0; i < plan->chain_count; i++) {
+        defrag_chain *chain = &plan->chains[i];
+        int start = plan->target[chain->start];
+        long entry;
+
+        for (int j = 0; j < chain->length; j++) {
+            int at = plan->target[plan->order[chain->first + j]];
+            fat_set(fat, at, j == chain->length - 1 ? FAT_EOC : plan->target[plan->order[chain->first + j + 1]]);
+        }
+        if (chain->owner == -1) { // FAT32 root directory, named by the boot sector
+            for (int b = 0; b < 4; b++) {
+                root[b] = (start >> (8 * b)) & 0xFF;
+            }
+            fat_defer(fat, 44, root, 4);
+            continue;
+        }
+        entry = chain->owner == DIR_ROOT ? chain->within : fat_cluster_offset(fat, plan->target[chain->owner]) + chain->within;
+        disk_set_location(image, fat, entry, start, chain->is_directory ? 0 : dir_entry_size(image, entry));
+        if (chain->is_directory) { // "." names the directory itself, ".." its parent (0 for the root)
+            long dot = fat_cluster_offset(fat, start);
+            int parent = chain->parent < 0 || plan->chains[chain->parent].owner == -1 ? 0 : plan->target[plan->chains[chain->parent].start];
+            if (image[dot] == '.' && image[dot + 1] == ' ') {
+                disk_set_location(image, fat, dot, start, 0);
+            }
+            if (image[dot + 32] == '.' && image[dot + 33] == '.') {
+                disk_set_location(image, fat, dot + 32, parent, 0);
+            }
+        }
+    }
+}
+
+static void defrag_release(defrag_plan *plan) {
+    // Free everything the plan allocated
+    free(plan->chains);
+    free(plan->order);
+    free(plan->target);
+    free(plan->holder);
+    free(plan->location);
+    free(plan->owned);
+}
+
+int main(int argc, char *argv[]) {
+    // Main function to make every cluster chain contiguous, grouped by directory
+    disk_image image;
+    int dry_run = argc == 3 && strcmp(argv[1], "--plan") == 0;
+    defrag_plan plan;
+    defrag_totals totals;
+    fat_table fat;
+    int result = 0;
+
+    if (argc != 2 + dry_run) {
+        printf("Usage: diskdefrag [--plan] <disk image>\n");
+        return 1;
+    }
+
+    if (disk_image_open(&image, argv[1 + dry_run], dry_run ? 0 : IMAGE_WRITE) < 0) { // Open the disk image
+        printf("Error: cannot open %s\n", argv[1 + dry_run]);
+        return 1;
+    }
+    char *mapped_image = image.data;
+    if (fat_load(&fat, mapped_image, image.size) < 0) {
+        printf("Error: failed to read FAT\n");
+        exit(1);
+    }
+    disk_image_attach(&image, &fat);
+
+    memset(&plan, 0, sizeof(plan));
+    memset(&totals, 0, sizeof(totals));
+    plan.owned = calloc(fat.count / 64 + 1, sizeof(uint64_t));
+    if (plan.owned == NULL || defrag_collect(mapped_image, &fat, &plan) < 0 || defrag_place(&fat, &plan, &totals) < 0 ||
+        defrag_move(mapped_image, &fat, &plan, &totals, dry_run) < 0) {
+        result = 1;
+    } else {
+        printf("%d files, %d directories, %d clusters in use\n", plan.files, plan.directories, plan.order_count);
+        printf("Before: %ld extents, %d fragmented chains\n", totals.extents_before, totals.fragmented_before);
+        printf("After:  %ld extents, %d fragmented chains\n", totals.extents_after, totals.fragmented_after);
+        printf("%s %ld clusters out of place in %ld moves (%ld clusters copied)\n", dry_run ? "Would move" : "Moved",
+               totals.misplaced, totals.moves, totals.copied);
+        if (!dry_run && totals.misplaced > 0) {
+            defrag_relink(mapped_image, &fat, &plan);
+            if (fat_commit(&fat) < 0) {
+                perror("Error syncing disk image");
+                result = 1;
+            }
+        }
+    }
+
+    defrag_release(&plan);
+    fat_release(&fat);
+    disk_image_close(&image);
+    return result;
+}
@@ -0,0 +1,423 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "fat12.h"
+#include "dirindex.h"
+
+#define LAYOUT_FLAT 0       // Every file in the root directory, each one contiguous
+#define LAYOUT_FULLROOT 1   // Root directory filled to its last slot
+#define LAYOUT_DEEP 2       // One chain of nested directories, files spread over every level
+#define LAYOUT_FRAGMENTED 3 // Every file in the root directory, clusters scattered over the disk
+#define LAYOUT_MIXED 4      // Random tree, random sizes, a quarter of the files fragmented
+
+#define ZERO_BLOCK 65536 // Unit in which -Z leaves file data as zeros
+#define MAX_FILES 9999999 // Files are named F0000001.DAT onwards, seven digits in an 8.3 name
+
+static const char *layout_names[] = {"flat", "fullroot", "deep", "fragmented", "mixed"};
+
+static uint64_t random_state;
+static int zero_percent; // Share of file data blocks left as zeros, which stay holes in the image
+
+// Totals reported when the image is done
+typedef struct {
+    int files;
+    int directories;
+    long extents;
+    long bytes;
+} gen_totals;
+
+static uint64_t gen_random(void) {
+    // Next value of the xorshift64* generator seeded from the command line
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return random_state * 0x2545F4914F6CDD1DULL;
+}
+
+static void gen_store16(unsigned char *p, int value) {
+    // Store a little-endian 16-bit value
+    p[0] = value & 0xFF;
+    p[1] = (value >> 8) & 0xFF;
+}
+
+static void gen_store32(unsigned char *p, uint32_t value) {
+    // Store a little-endian 32-bit value
+    gen_store16(p, value & 0xFFFF);
+    gen_store16(p + 2, value >> 16);
+}
+
+static int gen_format(unsigned char *image, int width, long total_sectors, int sectors_per_cluster, uint32_t serial) {
+    // Write the boot sector, empty FATs and (on FAT32) the FSInfo sector; return -1 if the size does not suit the width
+    int bytes_per_sector = 512;
+    int reserved = width == 32 ? 32 : 1;
+    int root_entries = width == 32 ? 0 : width == 16 ? 512 : 224;
+    int root_sectors = root_entries * 32 / bytes_per_sector;
+    long sectors_per_fat = 1;
+    long clusters;
+    int actual;
+
+    // Smallest FAT that can describe every cluster left after it
+    for (;;) {
+        clusters = (total_sectors - reserved - 2 * sectors_per_fat - root_sectors) / sectors_per_cluster;
+        if (clusters < 1) {
+            return -1;
+        }
+        if (((clusters + 2) * width + 7) / 8 <= sectors_per_fat * bytes_per_sector) {
+            break;
+        }
+        sectors_per_fat++;
+    }
+    actual = clusters < 4085 ? 12 : clusters < 65525 ? 16 : 32;
+    if (actual != width) {
+        printf("Error: %ld clusters make a FAT%d volume, not FAT%d; change -s or -c\n", clusters, actual, width);
+        return -1;
+    }
+
+    image[0] = 0xEB;
+    image[1] = 0x3C;
+    image[2] = 0x90;
+    memcpy(image + 3, "DISKGEN ", 8);
+    gen_store16(image + 11, bytes_per_sector);
+    image[13] = sectors_per_cluster;
+    gen_store16(image + 14, reserved);
+    image[16] = 2; // FAT copies
+    gen_store16(image + 17, root_entries);
+    gen_store16(image + 19, total_sectors < 65536 && width != 32 ? total_sectors : 0);
+    image[21] = 0xF8; // Fixed disk
+    gen_store16(image + 22, width != 32 ? sectors_per_fat : 0);
+    gen_store16(image + 24, 63);
+    gen_store16(image + 26, 255);
+    gen_store32(image + 32, total_sectors < 65536 && width != 32 ? 0 : total_sectors);
+    if (width == 32) {
+        gen_store32(image + 36, sectors_per_fat);
+        gen_store32(image + 44, 2); // Root directory cluster
+        gen_store16(image + 48, 1); // FSInfo sector
+        gen_store16(image + 50, 6); // Backup boot sector
+        image[64] = 0x80;
+        image[66] = 0x29;
+        gen_store32(image + 67, serial);
+        memcpy(image + 71, "DISKGEN    FAT32   ", 19);
+
+        unsigned char *fsinfo = image + bytes_per_sector;
+        gen_store32(fsinfo, 0x41615252);
+        gen_store32(fsinfo + 484, 0x61417272);
+        gen_store32(fsinfo + 488, 0xFFFFFFFF); // Free count unknown until the first flush
+        gen_store32(fsinfo + 492, 3);
+        gen_store32(fsinfo + 508, 0xAA550000);
+    } else {
+        image[36] = 0x80;
+        image[38] = 0x29;
+        gen_store32(image + 39, serial);
+        memcpy(image + 43, "DISKGEN    ", 11);
+        memcpy(image + 54, width == 16 ? "FAT16   " : "FAT12   ", 8);
+    }
+    image[510] = 0x55;
+    image[511] = 0xAA;
+
+    // Reserved entries 0 and 1 (and the root directory cluster on FAT32) in both FATs
+    for (int copy = 0; copy < 2; copy++) {
+        unsigned char *fat = image + ((long)reserved + copy * sectors_per_fat) * bytes_per_sector;
+        if (width == 12) {
+            memcpy(fat, "\xF8\xFF\xFF", 3);
+        } else if (width == 16) {
+            memcpy(fat, "\xF8\xFF\xFF\xFF", 4);
+        } else {
+            memcpy(fat, "\xF8\xFF\xFF\x0F\xFF\xFF\xFF\x0F\xFF\xFF\xFF\x0F", 12);
+        }
+    }
+    return 0;
+}
+
+static int gen_zero_block(uint64_t key, long block) {
+    // True if a block of file data is left as zeros; decided from the file's key, not the shared random state
+    uint64_t mix = (key ^ (uint64_t)block * 0xD1B54A32D192ED03ULL) * 0x9E3779B97F4A7C15ULL;
+    return (long)(mix >> 33) % 100 < zero_percent;
+}
+
+static void gen_fill(char *data, long position, long length, uint64_t *state, uint64_t key) {
+    // Fill file data from a per-file generator, so contents can be checked after extraction; zero blocks are skipped, not written
+    int zero = 0;
+    for (long i = 0; i < length; i++) {
+        if (i % 8 == 0) {
+            *state ^= *state >> 12;
+            *state ^= *state << 25;
+            *state ^= *state >> 27;
+        }
+        if (i == 0 || (position + i) % ZERO_BLOCK == 0) {
+            zero = zero_percent > 0 && gen_zero_block(key, (position + i) / ZERO_BLOCK);
+        }
+        if (!zero) {
+            data[i] = (*state >> (i % 8 * 8)) & 0xFF;
+        }
+    }
+}
+
+static long gen_entry(char *image, dir_index *index, int dir, const char *name, int attribute, int cluster, long size) {
+    // Write a directory entry with a random timestamp and return its offset, or -1 if the directory is full
+    long entry = dir_free_slot(index, dir);
+    unsigned char packed[11];
+    int date, time;
+
+    if (entry < 0) {
+        return -1;
+    }
+    dir_pack_name(name, packed);
+    memset(image + entry, 0, DIR_ENTRY_SIZE);
+    memcpy(image + entry, packed, 11);
+    image[entry + 11] = attribute;
+    date = ((int)(gen_random() % 40) << 9) | ((int)(gen_random() % 12 + 1) << 5) | (int)(gen_random() % 28 + 1);
+    time = ((int)(gen_random() % 24) << 11) | ((int)(gen_random() % 60) << 5);
+    gen_store16((unsigned char *)image + entry + 14, time);
+    gen_store16((unsigned char *)image + entry + 16, date);
+    gen_store16((unsigned char *)image + entry + 22, time);
+    gen_store16((unsigned char *)image + entry + 24, date);
+    gen_store16((unsigned char *)image + entry + 20, (cluster >> 16) & 0x0FFF);
+    gen_store16((unsigned char *)image + entry + 26, cluster & 0xFFFF);
+    gen_store32((unsigned char *)image + entry + 28, size);
+    dir_index_add(index, dir, entry);
+    return entry;
+}
+
+static int gen_directory(char *image, fat_table *fat, dir_index *index, int parent, gen_totals *totals) {
+    // Create an empty subdirectory with "." and ".." and return its cluster, or -1 if there is no room
+    char name[13];
+    int length;
+    int cluster = fat_alloc_run(fat, 1, &length);
+    long offset;
+
+    if (cluster < 0) {
+        return -1;
+    }
+    fat_set(fat, cluster, FAT_EOC);
+    offset = fat_cluster_offset(fat, cluster);
+    memset(image + offset, 0, fat->geo.cluster_size);
+    memcpy(image + offset, ".          ", 11);
+    image[offset + 11] = 0x10;
+    gen_store16((unsigned char *)image + offset + 20, (cluster >> 16) & 0x0FFF);
+    gen_store16((unsigned char *)image + offset + 26, cluster & 0xFFFF);
+    memcpy(image + offset + 32, "..         ", 11);
+    image[offset + 32 + 11] = 0x10;
+    gen_store16((unsigned char *)image + offset + 32 + 20, (parent >> 16) & 0x0FFF);
+    gen_store16((unsigned char *)image + offset + 32 + 26, parent & 0xFFFF);
+
+    snprintf(name, sizeof(name), "D%07d", totals->directories + 1);
+    if (gen_entry(image, index, parent, name, 0x10, cluster, 0) < 0) {
+        fat_set(fat, cluster, FAT_FREE);
+        return -1;
+    }
+    totals->directories++;
+    totals->extents++;
+    return cluster;
+}
+
+static int gen_file(char *image, fat_table *fat, dir_index *index, int dir, long size, int fragmented, uint64_t seed, gen_totals *totals) {
+    // Create a file of size bytes with generated contents, contiguous or scattered one cluster at a time
+    int cluster_size = fat->geo.cluster_size;
+    long clusters = fat_clusters_for(fat, size);
+    uint64_t state = (seed ^ (uint64_t)(totals->files + 1) * 0x9E3779B97F4A7C15ULL) | 1;
+    uint64_t key = state;
+    char name[13];
+    int first = 0;
+    long done = 0;
+
+    if (fat_count_free(fat) < clusters + 1) { // Keep a cluster for a growing directory
+        return -1;
+    }
+    if (fragmented) {
+        int previous = 0;
+        for (long i = 0; i < clusters; i++) {
+            int cluster = fat_find_free(fat, 2 + (int)(gen_random() % (fat->count - 2)));
+            if (cluster < 0) {
+                cluster = fat_find_free(fat, 2);
+            }
+            fat_set(fat, cluster, FAT_EOC);
+            if (previous == 0) {
+                first = cluster;
+            } else {
+                fat_set(fat, previous, cluster);
+            }
+            if (cluster != previous + 1) {
+                totals->extents++;
+            }
+            gen_fill(image + fat_cluster_offset(fat, cluster), done, size - done < cluster_size ? size - done : cluster_size, &state, key);
+            done += cluster_size;
+            previous = cluster;
+        }
+    } else if (clusters > 0) {
+        int extent_count;
+        fat_extent *extents = fat_alloc(fat, clusters, &extent_count);
+        if (extents == NULL) {
+            return -1;
+        }
+        fat_link(fat, extents, extent_count);
+        for (int i = 0; i < extent_count; i++) {
+            long length = (long)extents[i].length * cluster_size;
+            gen_fill(image + fat_cluster_offset(fat, extents[i].start), done, size - done < length ? size - done : length, &state, key);
+            done += length;
+        }
+        first = extents[0].start;
+        totals->extents += extent_count;
+        free(extents);
+    }
+
+    snprintf(name, sizeof(name), "F%07u.DAT", (unsigned)(totals->files + 1) % (MAX_FILES + 1)); // -n keeps it below
+    if (gen_entry(image, index, dir, name, 0x20, first, size) < 0) {
+        for (int cluster = first; cluster >= 2 && cluster < FAT_EOC_MIN;) { // Give the clusters back
+            int next = fat_get(fat, cluster);
+            fat_set(fat, cluster, FAT_FREE);
+            cluster = next;
+        }
+        return -1;
+    }
+    totals->files++;
+    totals->bytes += size;
+    return 0;
+}
+
+static long gen_size(long max_size) {
+    // Random file size, skewed towards small files
+    return (long)(gen_random() % (max_size + 1)) >> (gen_random() % 4 * 2);
+}
+
+int main(int argc, char *argv[]) {
+    // Main function to build a synthetic image from a seed and a layout
+    int width = 12;
+    long total_sectors = 0;
+    int sectors_per_cluster = 1;
+    uint64_t seed = 1;
+    int layout = LAYOUT_FLAT;
+    int files = 100;
+    int depth = 8;
+    long max_size = 16384;
+    int opt;
+    gen_totals totals = {0, 0, 0, 0};
+    fat_table fat;
+    dir_index index;
+    int result = 0;
+
+    while ((opt = getopt(argc, argv, "w:s:c:S:l:n:d:z:Z:")) != -1) {
+        if (opt == 'w') {
+            width = atoi(optarg);
+        } else if (opt == 's') {
+            total_sectors = atol(optarg);
+        } else if (opt == 'c') {
+            sectors_per_cluster = atoi(optarg);
+        } else if (opt == 'S') {
+            seed = strtoull(optarg, NULL, 0);
+        } else if (opt == 'l') {
+            for (layout = 0; layout < 5 && strcmp(optarg, layout_names[layout]) != 0; layout++) {
+            }
+        } else if (opt == 'n') {
+            files = atoi(optarg);
+        } else if (opt == 'd') {
+            depth = atoi(optarg);
+        } else if (opt == 'z') {
+            max_size = atol(optarg);
+        } else if (opt == 'Z') {
+            zero_percent = atoi(optarg);
+        } else {
+            layout = 5;
+        }
+    }
+    if (optind != argc - 1 || layout == 5 || (width != 12 && width != 16 && width != 32) || sectors_per_cluster < 1 ||
+        sectors_per_cluster > 128 || (sectors_per_cluster & (sectors_per_cluster - 1)) != 0 || files < 0 || files > MAX_FILES || depth < 1 || max_size < 0 ||
+        zero_percent < 0 || zero_percent > 100) {
+        printf("Usage: diskgen [-w 12|16|32] [-s sectors] [-c sectors per cluster] [-S seed]\n");
+        printf("               [-l flat|fullroot|deep|fragmented|mixed] [-n files] [-d depth] [-z max file size]\n");
+        printf("               [-Z percent of file data left as zeros] <image>\n");
+        return 1;
+    }
+    if (total_sectors == 0) { // Smallest comfortable volume of each type
+        total_sectors = width == 12 ? 2880 : width == 16 ? 32768 * sectors_per_cluster : 140000L * sectors_per_cluster;
+    }
+    random_state = seed * 0x9E3779B97F4A7C15ULL | 1;
+
+    int file_descriptor = open(argv[optind], O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (file_descriptor < 0) {
+        perror("Error creating image");
+        return 1;
+    }
+    long image_size = total_sectors * 512;
+    if (ftruncate(file_descriptor, image_size) < 0) {
+        perror("Error sizing image");
+        return 1;
+    }
+    char *image = mmap(NULL, image_size, PROT_READ | PROT_WRITE, MAP_SHARED, file_descriptor, 0);
+    if (image == MAP_FAILED) {
+        printf("Error: failed to map memory\n");
+        exit(1);
+    }
+    if (gen_format((unsigned char *)image, width, total_sectors, sectors_per_cluster, (uint32_t)seed) < 0 ||
+        fat_load(&fat, image, image_size) < 0) {
+        printf("Error: cannot format a FAT%d volume of %ld sectors\n", width, total_sectors);
+        exit(1);
+    }
+    if (dir_index_init(&index, image, &fat) < 0) {
+        printf("Error: out of memory\n");
+        exit(1);
+    }
+
+    if (layout == LAYOUT_FULLROOT && width != 32) {
+        files = fat.geo.root_entries;
+    }
+    if (layout == LAYOUT_DEEP) {
+        int *levels = malloc((depth + 1) * sizeof(int));
+        if (levels == NULL) {
+            printf("Error: out of memory\n");
+            exit(1);
+        }
+        levels[0] = DIR_ROOT;
+        for (int i = 1; i <= depth && result == 0; i++) {
+            levels[i] = gen_directory(image, &fat, &index, levels[i - 1], &totals);
+            result = levels[i] < 0 ? -1 : 0;
+        }
+        for (int i = 0; i < files && result == 0; i++) {
+            result = gen_file(image, &fat, &index, levels[i % (depth + 1)], gen_size(max_size), 0, seed, &totals);
+        }
+        free(levels);
+    } else if (layout == LAYOUT_MIXED) {
+        int *dirs = malloc((files + 1) * sizeof(int));
+        int dir_count = 1;
+        if (dirs == NULL) {
+            printf("Error: out of memory\n");
+            exit(1);
+        }
+        dirs[0] = DIR_ROOT;
+        for (int i = 0; i < files && result == 0; i++) {
+            int parent = dirs[gen_random() % dir_count];
+            if (gen_random() % 8 == 0) {
+                dirs[dir_count] = gen_directory(image, &fat, &index, parent, &totals);
+                result = dirs[dir_count++] < 0 ? -1 : 0;
+            } else {
+                result = gen_file(image, &fat, &index, parent, gen_size(max_size), gen_random() % 4 == 0, seed, &totals);
+            }
+        }
+        free(dirs);
+    } else {
+        for (int i = 0; i < files && result == 0; i++) {
+            long size = layout == LAYOUT_FULLROOT ? gen_size(fat.geo.cluster_size) : gen_size(max_size);
+            result = gen_file(image, &fat, &index, DIR_ROOT, size, layout == LAYOUT_FRAGMENTED, seed, &totals);
+        }
+    }
+    if (result < 0) {
+        printf("Error: the disk or directory is full after %d files and %d directories\n", totals.files, totals.directories);
+    }
+
+    // Write the FAT back to both copies; the new image is left to the page cache like before
+    fat_flush(&fat);
+    printf("%s: FAT%d %s, seed %llu, %d clusters, %d files, %d directories, %ld extents, %ld bytes\n", argv[optind],
+           fat.geo.width, layout_names[layout], (unsigned long long)seed, fat.count - 2, totals.files,
+           totals.directories, totals.extents, totals.bytes);
+
+    dir_index_release(&index);
+    fat_release(&fat);
+    munmap(image, image_size);
+    close(file_descriptor);
+    return result < 0 ? 1 : 0;
+}
@@ -8,133 +8,543 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include "fat12.h"
+#include "dirindex.h"
+#include "manifest.h"
+#include "diskops.h"
+#include "diskimage.h"
+#include "diskclient.h"
+#include "crc32c.h"
+#include "diskstats.h"
 
-int find_file(char *image, char *file) {
-    // Check if the file we want to copy exists
-    int root_dir = 0x2600; // Start from root directory
-    char filename[12];
-    char file_ext[4];
-    int index;
-
-    while (root_dir < 0x4200) { // Check the root directory only
-        index = 0;
-        while (image[root_dir + index] != ' ' && index < 8) {
-            filename[index] = image[root_dir + index]; // Copy file name
-            index++;
-        }
-        filename[index] = '\0';
-        
-        for (index = 0; index < 3; index++) {
-            file_ext[index] = image[root_dir + 8 + index]; // Copy file extension
-        }
-        file_ext[index] = '\0';
-        
-        strcat(filename, ".");
-        strcat(filename, file_ext);
-        
-        if (image[root_dir] == '.' || image[root_dir + 11] == 0x0F || 
-            (image[root_dir + 11] & 0x08) == 0x08 || image[root_dir + 26] == 0x01 || image[root_dir + 26] == 0x0F) {
-            root_dir += 32;
+#define VERIFY_BYTES (1 << 20) // Read-back buffer of --verify
+#define EXPORT_QUEUE 64        // Files of -r resolved and waiting for a writer
+
+// File of -r whose chain has been resolved, waiting for a writer thread
+typedef struct {
+    char *path;                // Host path to create
+    fat_extent *extents;
+    int extent_count;
+    long size;
+    time_t modified;           // -1 if the entry has no time
+} export_file;
+
+// Directory created by -r, whose time is set once everything in it is written
+typedef struct {
+    char *path;
+    time_t modified;
+} export_dir;
+
+// Shared by the thread walking the tree and the writers
+typedef struct {
+    int image_fd;
+    fat_table *fat;
+    char *image;
+    int verify;
+    export_file queue[EXPORT_QUEUE];
+    int head, used;
+    int done;                  // The walk is over; writers leave once the queue is empty
+    pthread_mutex_t lock;
+    pthread_cond_t ready, space;
+    export_dir *dirs;
+    int dir_count, dir_size;
+    uint64_t *visited;         // Directory clusters already walked, against loops
+    int files, failures;
+    long bytes;
+} export_state;
+
+void output_name(char *name, char *search_file) {
+    // Local file name for an image path: its last component, in upper case if it is an 8.3 name
+    char *base_name = strrchr(name, '/') != NULL ? strrchr(name, '/') + 1 : name;
+    int idx;
+
+    if (!dir_short_name(base_name)) { // A long name is kept as typed, which is also how lookups match it
+        snprintf(search_file, DIR_NAME_MAX, "%s", base_name);
+        return;
+    }
+    for (idx = 0; base_name[idx] != '\0' && base_name[idx] != ' ' && idx < 12; idx++) {
+        search_file[idx] = toupper(base_name[idx]);
+    }
+    search_file[idx] = '\0';
+}
+
+int verify_file(const char *name, int out_fd, long size, uint32_t crc, const char *expected, FILE *report) {
+    // Read the written file back and compare its checksum with the one taken from the image, and the manifest's if any
+    uint32_t written = 0;
+    char *buffer = out_fd >= 0 ? malloc(VERIFY_BYTES) : NULL;
+
+    for (long done = 0; buffer != NULL && done < size;) {
+        ssize_t got = pread(out_fd, buffer, size - done < VERIFY_BYTES ? size - done : VERIFY_BYTES, done);
+        if (got <= 0) {
+            break;
+        }
+        written = crc32c(written, buffer, got);
+        done += got;
+    }
+    free(buffer);
+    if (out_fd >= 0 && (buffer == NULL || written != crc)) {
+        fprintf(stderr, "Error: %s does not match the image after writing\n", name);
+        return 1;
+    }
+    if (expected != NULL && strtoul(expected, NULL, 16) != crc) {
+        fprintf(stderr, "Error: %s has checksum %08x, the manifest says %s\n", name, crc, expected);
+        return 1;
+    }
+    fprintf(report, "%s %08x\n", name, crc);
+    return 0;
+}
+
+int get_settled(disk_image *image, fat_table *fat, dir_index *index) {
+    // Check the snapshot what was just copied came from: 1 if it held, 0 if a writer committed meanwhile, in which
+    // case the FAT and index have been reloaded under the shared lock and the copy is to be made again
+    int valid = disk_image_validate(image);
+
+    if (valid > 0) {
+        return 1;
+    }
+    dir_index_release(index);
+    fat_release(fat);
+    if (valid < 0 || fat_load(fat, image->data, image->size) < 0) {
+        printf("Error: failed to read FAT\n");
+        exit(1);
+    }
+    disk_image_attach(image, fat);
+    if (dir_index_init(index, image->data, fat) < 0) {
+        printf("Error: out of memory\n");
+        exit(1);
+    }
+    return 0;
+}
+
+int get_file(disk_image *file, fat_table *fat, dir_index *index, char *name, int to_stdout, int verify, const char *expected) {
+    // Look up one file, in the root or under a directory path, and copy it out; with verify, check what was written
+    char search_file[DIR_NAME_MAX];
+    char *image = file->data;
+    uint32_t crc;
+    long file_found;
+    int out_fd, result;
+
+    output_name(name, search_file);
+    for (;;) {
+        disk_stats_phase(STATS_DIRECTORY);
+        file_found = dir_resolve(index, name);
+        disk_stats_phase(STATS_COPY);
+        if (file_found < 0 || (image[file_found + 11] & 0x10) != 0) {
+            if (get_settled(file, fat, index)) {
+                printf("File not found\n");
+                return 1;
+            }
             continue;
         }
-        
-        if (strcmp(filename, file) == 0) {
-            return root_dir;
+        out_fd = to_stdout ? STDOUT_FILENO : open(search_file, (verify ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC, 0644);
+        if (out_fd < 0) {
+            perror("Error creating output file");
+            return 1;
+        }
+        crc = 0;
+        result = disk_get(file->copy_fd, image, fat, file_found, out_fd, verify ? &crc : NULL);
+        if (to_stdout || get_settled(file, fat, index)) { // Standard output cannot be taken back, so it is never a snapshot
+            break;
+        }
+        close(out_fd); // Written over on the next try
+    }
+    if (result != DISK_OK) {
+        fprintf(stderr, "Error: failed to copy %s\n", search_file);
+    } else if (verify && verify_file(name, to_stdout ? -1 : out_fd, dir_entry_size(image, file_found), crc,
+                                     expected, to_stdout ? stderr : stdout) != 0) {
+        result = DISK_IO_ERROR;
+    }
+    if (!to_stdout) {
+        close(out_fd);
+    }
+    return result != DISK_OK;
+}
+
+int get_remote(char *image_path, char *name, int to_stdout) {
+    // Ask the image server for one file; the output is only created once the file is known to exist
+    char search_file[DIR_NAME_MAX];
+    disk_stats_phase(STATS_COPY); // The server does all of it
+    int result = disk_client_request(DISKD_GET, 0, image_path, name, NULL, -1);
+
+    if (result == DISK_NOT_FOUND) {
+        printf("File not found\n");
+        return 1;
+    }
+    if (result != DISK_OK) {
+        printf("%s\n", disk_message(result));
+        return 1;
+    }
+    output_name(name, search_file);
+    int out_fd = to_stdout ? STDOUT_FILENO : open(search_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    result = disk_client_finish(out_fd); // Sent even if the open failed, so the server is not left waiting
+    if (out_fd < 0) {
+        perror("Error creating output file");
+        return 1;
+    }
+    if (result != DISK_OK) {
+        fprintf(stderr, "Error: failed to copy %s\n", search_file);
+    }
+    if (!to_stdout) {
+        close(out_fd);
+    }
+    return result != DISK_OK;
+}
+
+static void export_times(struct timespec times[2], time_t modified) {
+    // Access and modification time for futimens and utimensat; left alone if the entry has none
+    for (int i = 0; i < 2; i++) {
+        times[i].tv_sec = modified;
+        times[i].tv_nsec = modified == -1 ? UTIME_OMIT : 0;
+    }
+}
+
+static void *export_writer(void *argument) {
+    // Write queued files out of the shared read-only image until the walk is over and the queue is empty
+    export_state *state = argument;
+
+    for (;;) {
+        export_file file;
+        uint32_t crc = 0;
+        struct timespec times[2];
+        int failed = 0;
+
+        pthread_mutex_lock(&state->lock);
+        while (state->used == 0 && !state->done) {
+            pthread_cond_wait(&state->ready, &state->lock);
+        }
+        if (state->used == 0) {
+            pthread_mutex_unlock(&state->lock);
+            return NULL;
+        }
+        file = state->queue[state->head];
+        state->head = (state->head + 1) % EXPORT_QUEUE;
+        state->used--;
+        pthread_cond_signal(&state->space);
+        pthread_mutex_unlock(&state->lock);
+
+        int out_fd = open(file.path, (state->verify ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC, 0644);
+        if (out_fd < 0) {
+            perror(file.path);
+            failed = 1;
+        } else if (disk_copy_extents(state->image_fd, state->fat, out_fd, file.size, file.extents, file.extent_count,
+                                     state->verify ? &crc : NULL) < 0) {
+            fprintf(stderr, "Error: failed to copy %s\n", file.path);
+            failed = 1;
+        } else if (state->verify && verify_file(file.path, out_fd, file.size, crc, NULL, stdout) != 0) {
+            failed = 1;
+        }
+        if (out_fd >= 0) {
+            export_times(times, file.modified);
+            futimens(out_fd, times); // After the last write, which would move the time again
+            close(out_fd);
         }
-        root_dir += 32;    
+
+        pthread_mutex_lock(&state->lock);
+        state->files += !failed;
+        state->failures += failed;
+        state->bytes += failed ? 0 : file.size;
+        pthread_mutex_unlock(&state->lock);
+        free(file.path);
+        free(file.extents);
+    }
+}
+
+static int export_queue(export_state *state, char *path, const char *entry) {
+    // Resolve a file's chain here and hand it to the writers, waiting while the queue is full; takes over path
+    export_file file;
+
+    file.path = path;
+    file.size = dir_entry_size(state->image, entry - state->image);
+    file.modified = disk_entry_time(state->image, entry - state->image);
+    file.extents = fat_chain(state->fat, dir_entry_cluster(state->fat, state->image, entry - state->image), &file.extent_count);
+    if (file.extents == NULL) {
+        free(path);
+        return -1;
+    }
+    pthread_mutex_lock(&state->lock);
+    while (state->used == EXPORT_QUEUE) {
+        pthread_cond_wait(&state->space, &state->lock);
     }
+    state->queue[(state->head + state->used) % EXPORT_QUEUE] = file;
+    state->used++;
+    pthread_cond_signal(&state->ready);
+    pthread_mutex_unlock(&state->lock);
     return 0;
 }
 
-int fat_convert(char *image, int fat_index) {
-    // Convert FAT12 entry to actual value
-    int low_bits;
-    int high_bits;
-    int full_value;
+static int export_safe_name(const char *name, int length) {
+    // True if a name read from the image stays inside the host directory: no '/' or NUL, and not "." or ".."
+    return length > 0 && (int)strlen(name) == length && strchr(name, '/') == NULL && strcmp(name, ".") != 0 &&
+           strcmp(name, "..") != 0;
+}
 
-    if (fat_index % 2 == 0) {
-        low_bits = image[512 + 1 + 3 * fat_index / 2] & 0x0F; // Low 4 bits
-        full_value = (low_bits << 8) + (image[512 + 3 * fat_index / 2] & 0xFF);
-    } else {
-        high_bits = image[512 + 3 * fat_index / 2] & 0xF0; // High 4 bits
-        full_value = (high_bits >> 4) + ((image[512 + 1 + 3 * fat_index / 2] & 0xFF) << 4);
+static int export_directory(export_state *state, int dir, const char *host_path, int depth) {
+    // Recreate one image directory under host_path, queueing its files and descending into its subdirectories
+    int range_count;
+    dir_range *ranges;
+    dir_long_name long_name;
+    char name[DIR_NAME_MAX];
+    int result = 0;
+
+    if (depth > DISK_MAX_DEPTH) {
+        fprintf(stderr, "Error: directories nested too deeply under %s\n", host_path);
+        return -1;
+    }
+    ranges = dir_ranges(state->fat, dir, &range_count);
+    if (ranges == NULL) {
+        fprintf(stderr, "Error: cannot read the directory for %s\n", host_path);
+        return -1;
+    }
+    long_name.pieces = 0;
+    for (int r = 0; r < range_count; r++) {
+        for (long offset = ranges[r].offset; offset < ranges[r].offset + ranges[r].length; offset += DIR_ENTRY_SIZE) {
+            char *entry = state->image + offset;
+            if (entry[0] == 0x00) {
+                r = range_count;
+                break;
+            }
+            if (entry[11] == 0x0F) {
+                dir_long_feed(&long_name, (unsigned char *)entry);
+                continue;
+            }
+            int length = dir_long_take(&long_name, (unsigned char *)entry, name);
+            if ((unsigned char)entry[0] == 0xE5 || entry[0] == '.' || (entry[11] & 0x08) != 0) {
+                continue;
+            }
+            if (!export_safe_name(name, length)) { // No long name, or one that would leave the host directory
+                dir_unpack_name((unsigned char *)entry, name);
+                if (!export_safe_name(name, strlen(name))) {
+                    fprintf(stderr, "Error: skipping an entry of %s whose name is not a valid file name\n", host_path);
+                    result = -1;
+                    continue;
+                }
+            }
+            size_t path_size = strlen(host_path) + strlen(name) + 2;
+            if (path_size > 4096) {
+                fprintf(stderr, "Error: path too long: %s/%s\n", host_path, name);
+                result = -1;
+                continue;
+            }
+            char *path = malloc(path_size);
+            if (path == NULL) {
+                result = -1;
+                continue;
+            }
+            snprintf(path, path_size, "%s/%s", host_path, name);
+
+            if ((entry[11] & 0x10) == 0) {
+                if (export_queue(state, path, entry) < 0) {
+                    fprintf(stderr, "Error: out of memory\n");
+                    result = -1;
+                }
+                continue;
+            }
+            int cluster = dir_entry_cluster(state->fat, state->image, offset);
+            if (cluster < 2 || cluster >= state->fat->count || (state->visited[cluster / 64] >> (cluster % 64) & 1)) {
+                free(path); // Points outside the data area, or at a directory already exported
+                continue;
+            }
+            state->visited[cluster / 64] |= 1ULL << (cluster % 64);
+            if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+                perror(path);
+                free(path);
+                result = -1;
+                continue;
+            }
+            if (state->dir_count == state->dir_size) {
+                int size = state->dir_size > 0 ? 2 * state->dir_size : 64;
+                export_dir *grown = realloc(state->dirs, size * sizeof(export_dir));
+                if (grown == NULL) {
+                    free(path);
+                    result = -1;
+                    continue;
+                }
+                state->dirs = grown;
+                state->dir_size = size;
+            }
+            state->dirs[state->dir_count].path = path;
+            state->dirs[state->dir_count].modified = disk_entry_time(state->image, offset);
+            state->dir_count++;
+            if (export_directory(state, cluster, path, depth + 1) < 0) {
+                result = -1;
+            }
+        }
     }
-    return full_value;
+    free(ranges);
+    return result;
 }
 
-int get_size(char *image, int entry_index) {
-    // Retrieve the file size from directory entry
-    int file_size;
-    file_size = (image[entry_index + 28] & 0xFF) +
-                ((image[entry_index + 29] & 0xFF) << 8) +
-                ((image[entry_index + 30] & 0xFF) << 16) +
-                ((image[entry_index + 31] & 0xFF) << 24);
-    return file_size;
-} 
-
-void copy_file(char *image, char *file, int size, int start_cluster) {
-    // Copy the file content to a new file with the same name
-    FILE *new_file;
-    new_file = fopen(file, "wb"); // Create new file
-
-    int sector_index;
-    int physical_address;
-    int next_cluster = fat_convert(image, start_cluster); // Get FAT table value
-    int remaining_bytes;
-    
-    while (next_cluster != 0xFFF) {
-        physical_address = (start_cluster + 31) * 512; // Convert to physical address
-        for (sector_index = 0; sector_index < 512; sector_index++) {
-            fputc(image[physical_address + sector_index], new_file); // Write content
-        }
-        start_cluster = next_cluster;
-        next_cluster = fat_convert(image, start_cluster); // Traverse next sector
-    }
-
-    remaining_bytes = size - (size / 512) * 512; // Copy remaining data
-    physical_address = (start_cluster + 31) * 512;
-    for (sector_index = 0; sector_index < remaining_bytes; sector_index++) {
-        fputc(image[physical_address + sector_index], new_file);
-    }
-    fclose(new_file);
-    return;
+int get_tree(disk_image *image, fat_table *fat, dir_index *index, const char *host_path, const char *image_path, int threads, int verify) {
+    // Recreate an image directory tree on the host: this thread walks the tree and resolves chains, writers copy files
+    export_state state;
+    pthread_t *writers = malloc(threads * sizeof(pthread_t));
+    int started = 0;
+    int dir = dir_find_directory(index, image_path);
+    int result;
+
+    if (dir < 0) {
+        printf("The directory not found.\n");
+        free(writers);
+        return 1;
+    }
+    if (mkdir(host_path, 0755) < 0 && errno != EEXIST) {
+        perror(host_path);
+        free(writers);
+        return 1;
+    }
+    memset(&state, 0, sizeof(state));
+    state.image_fd = image->copy_fd;
+    state.fat = fat;
+    state.image = image->data;
+    state.verify = verify;
+    state.visited = calloc(fat->count / 64 + 1, sizeof(uint64_t));
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_cond_init(&state.ready, NULL);
+    pthread_cond_init(&state.space, NULL);
+    if (writers == NULL || state.visited == NULL) {
+        printf("Error: out of memory\n");
+        free(writers);
+        free(state.visited);
+        return 1;
+    }
+    while (started < threads && pthread_create(&writers[started], NULL, export_writer, &state) == 0) {
+        started++;
+    }
+
+    disk_stats_phase(STATS_DIRECTORY); // Writers copy alongside the walk; what is left after it counts as copying
+    result = started > 0 ? export_directory(&state, dir, host_path, 0) : -1;
+    disk_stats_phase(STATS_COPY);
+
+    pthread_mutex_lock(&state.lock);
+    state.done = 1;
+    pthread_cond_broadcast(&state.ready);
+    pthread_mutex_unlock(&state.lock);
+    if (started == 0) {
+        perror("Error starting writer");
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(writers[i], NULL);
+    }
+
+    // Directory times last, innermost first, as creating files inside a directory moves its time
+    for (int i = state.dir_count - 1; i >= 0; i--) {
+        struct timespec times[2];
+        export_times(times, state.dirs[i].modified);
+        utimensat(AT_FDCWD, state.dirs[i].path, times, 0);
+        free(state.dirs[i].path);
+    }
+    printf("%d files in %d directories, %ld bytes%s\n", state.files, state.dir_count, state.bytes,
+           state.failures > 0 ? ", some files failed" : "");
+    free(state.dirs);
+    free(state.visited);
+    free(writers);
+    return result < 0 || state.failures > 0;
 }
 
 int main(int argc, char *argv[]) {
     // Main function to handle file copying
-    int file_descriptor;
-    struct stat file_stat;
+    disk_image image;
+    int to_stdout = 0;
+    int verify = 0;
+    int batch = 0;
+    int recursive = 0;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    char *manifest_path = NULL;
+    int result = 0;
+    fat_table fat;
+    dir_index index;
 
-    int idx;
-    char search_file[12];
-    int file_found;
-    int starting_cluster;
-    int size_of_file;
-
-    file_descriptor = open(argv[1], O_RDWR); // Open disk image file
-    fstat(file_descriptor, &file_stat);
-
-    char *mapped_image = mmap(NULL, file_stat.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, file_descriptor, 0); 
-    if (mapped_image == MAP_FAILED) {
-        printf("Error: failed to map memory\n");
-        exit(1);
+    disk_stats_init(&argc, argv, "diskget");
+    while (argc > 1 && argv[1][0] == '-' && argv[1][1] != '\0') {
+        if (strcmp(argv[1], "--stdout") == 0) { // Write the file to stdout instead
+            to_stdout = 1;
+        } else if (strcmp(argv[1], "--verify") == 0) { // Checksum while copying, then read the output back
+            verify = 1;
+        } else if (strcmp(argv[1], "-b") == 0) { // Several file names after the image
+            batch = 1;
+        } else if (strcmp(argv[1], "-r") == 0) { // A whole directory tree
+            recursive = 1;
+        } else if (strcmp(argv[1], "-t") == 0 && argc > 2) { // Writer threads of -r
+            threads = atoi(argv[2]);
+            argv++;
+            argc--;
+        } else if (strcmp(argv[1], "-m") == 0 && argc > 2) { // File names listed in a manifest
+            manifest_path = argv[2];
+            argv++;
+            argc--;
+        } else {
+            break;
+        }
+        argv++;
+        argc--;
+    }
+    int bad = recursive ? batch || manifest_path != NULL || to_stdout || threads < 1 || argc < 3 || argc > 4
+                        : (manifest_path != NULL && argc != 2) || (manifest_path == NULL && (batch ? argc < 3 : argc != 3));
+    if (bad) {
+        printf("Usage: diskget [--stdout] [--verify] <disk image> <filename>   (filename may be DIR/SUB/NAME.EXT)\n");
+        printf("       (every form also takes --stats or --stats=json, or see $FATTOOLS_TRACE)\n");
+        printf("       diskget [--stdout] [--verify] -b <disk image> <filename>...\n");
+        printf("       diskget [--stdout] [--verify] -m <manifest> <disk image>   (lines of \"<filename> [<crc32c>]\")\n");
+        printf("       diskget [--verify] [-t threads] -r <disk image> <host directory> [<image directory>]\n");
+        return 1;
     }
 
-    for (idx = 0; argv[2][idx] != ' ' && idx < 12; idx++) {
-        search_file[idx] = toupper(argv[2][idx]);
+    int remote = !verify && !recursive && disk_client_connect() >= 0; // A server has the image loaded already; checksums are taken here
+    if (!remote) {
+        // Read-only; a snapshot unless the output is standard output, which could not be written again
+        if (disk_image_open(&image, argv[1], IMAGE_SEQUENTIAL | (to_stdout ? 0 : IMAGE_SNAPSHOT)) < 0) {
+            perror("Error opening disk image");
+            exit(1);
+        }
+        disk_stats_phase(STATS_FAT);
+        if (fat_load(&fat, image.data, image.size) < 0) { // Decoded once for the whole batch
+            printf("Error: failed to read FAT\n");
+            exit(1);
+        }
+        disk_image_attach(&image, &fat);
+        disk_stats_phase(STATS_DIRECTORY);
+        if (dir_index_init(&index, image.data, &fat) < 0) {
+            printf("Error: out of memory\n");
+            exit(1);
+        }
     }
-    search_file[idx] = '\0';
 
-    file_found = find_file(mapped_image, search_file);
-    if (file_found != 0) {
-        starting_cluster = (mapped_image[file_found + 26] & 0xFF) + ((mapped_image[file_found + 27] << 8) & 0xFF);
-        size_of_file = get_size(mapped_image, file_found);
-        copy_file(mapped_image, search_file, size_of_file, starting_cluster);
+    if (recursive) {
+        result = get_tree(&image, &fat, &index, argv[2], argc > 3 ? argv[3] : NULL, threads, verify);
+        if (!get_settled(&image, &fat, &index)) {
+            printf("The image changed while it was copied, copying it again\n");
+            result = get_tree(&image, &fat, &index, argv[2], argc > 3 ? argv[3] : NULL, threads, verify);
+        }
+    } else if (manifest_path != NULL) {
+        FILE *manifest = strcmp(manifest_path, "-") == 0 ? stdin : fopen(manifest_path, "r");
+        char line[MANIFEST_LINE];
+        char *fields[2];
+        int count;
+        if (manifest == NULL) {
+            perror("Error opening manifest");
+            exit(1);
+        }
+        while ((count = manifest_next(manifest, line, fields, 2)) > 0) {
+            result |= remote ? get_remote(argv[1], fields[0], to_stdout)
+                             : get_file(&image, &fat, &index, fields[0], to_stdout, verify, count > 1 ? fields[1] : NULL);
+        }
+        if (manifest != stdin) {
+            fclose(manifest);
+        }
     } else {
-        printf("File not found\n");
+        for (int i = 2; i < argc; i++) {
+            result |= remote ? get_remote(argv[1], argv[i], to_stdout)
+                             : get_file(&image, &fat, &index, argv[i], to_stdout, verify, NULL);
+        }
     }
 
-    munmap(mapped_image, file_stat.st_size);
-    close(file_descriptor);
-    return 0;
+    disk_stats_phase(STATS_FLUSH);
+    if (!remote) {
+        dir_index_release(&index);
+        fat_release(&fat);
+        disk_image_close(&image);
+    }
+    return result;
 }
@@ -0,0 +1,477 @@
+#define _GNU_SOURCE // O_DIRECT, F_OFD_SETLKW
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "diskimage.h"
+#include "diskstats.h"
+
+#define PREAD_BLOCK (256 * 1024)   // Read-ahead of the pread backend
+#define DIRECT_BLOCK (1024 * 1024) // Transfer unit of the direct backend
+#define DIRECT_ALIGN 4096          // Offset, length and buffer alignment O_DIRECT asks for
+
+#define LOCK_WRITER ((off_t)1 << 62)      // Lock bytes, far past the data so nothing else locking the file meets them
+#define LOCK_COMMIT (LOCK_WRITER + 1)
+#define GENERATION_NAME "user.fattools.generation" // Extended attribute holding the number of commits started
+
+static int image_backend(int *populate) {
+    // Backend named by $FATTOOLS_IO, mmap if unset; -1 if the name is unknown
+    const char *name = getenv("FATTOOLS_IO");
+
+    *populate = 0;
+    if (name == NULL || name[0] == '\0' || strcmp(name, "mmap") == 0) {
+        return IMAGE_MMAP;
+    }
+    if (strcmp(name, "mmap-populate") == 0) {
+        *populate = 1;
+        return IMAGE_MMAP;
+    }
+    if (strcmp(name, "pread") == 0) {
+        return IMAGE_PREAD;
+    }
+    if (strcmp(name, "direct") == 0) {
+        return IMAGE_DIRECT;
+    }
+    return -1;
+}
+
+static int image_read(disk_image *image, long offset, long length) {
+    // Read a run of whole blocks into memory; a short read at the end of the file is fine
+    int fd = image->backend == IMAGE_DIRECT ? image->direct_fd : image->fd;
+
+    while (length > 0) {
+        STATS_SYSCALL();
+        ssize_t got = pread(fd, image->data + offset, length, offset);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got < 0) {
+            return -1;
+        }
+        if (got == 0) {
+            break;
+        }
+        offset += got;
+        length -= got;
+    }
+    return 0;
+}
+
+static int image_load(void *context, long offset, long length) {
+    // Read the blocks of a byte range that are not in memory yet, each run of them in one call
+    disk_image *image = context;
+    long first, last;
+    int result = 0;
+
+    if (length <= 0 || offset >= image->size) {
+        return 0;
+    }
+    if (offset + length > image->size) {
+        length = image->size - offset;
+    }
+    first = offset / image->block;
+    last = (offset + length - 1) / image->block;
+    for (long b = first; b <= last; b++) { // Usually everything is loaded already
+        if (!(__atomic_load_n(&image->loaded[b / 64], __ATOMIC_ACQUIRE) >> (b % 64) & 1)) {
+            first = b;
+            break;
+        }
+        if (b == last) {
+            return 0;
+        }
+    }
+
+    pthread_mutex_lock(&image->lock);
+    for (long b = first; b <= last && result == 0;) {
+        long end = b;
+        if (image->loaded[b / 64] >> (b % 64) & 1) {
+            b++;
+            continue;
+        }
+        while (end + 1 <= last && !(image->loaded[(end + 1) / 64] >> ((end + 1) % 64) & 1)) {
+            end++;
+        }
+        long run = (end + 1) * image->block < image->mapped ? (end + 1 - b) * image->block : image->mapped - b * image->block;
+        result = image_read(image, b * image->block, run);
+        for (; b <= end && result == 0; b++) {
+            __atomic_or_fetch(&image->loaded[b / 64], 1ULL << (b % 64), __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&image->lock);
+    return result;
+}
+
+static int image_write(int fd, const char *data, long offset, long length) {
+    // Write a byte range of memory back to the same place in the file
+    while (length > 0) {
+        STATS_SYSCALL();
+        ssize_t put = pwrite(fd, data + offset, length, offset);
+        if (put < 0 && errno == EINTR) {
+            continue;
+        }
+        if (put <= 0) {
+            return -1;
+        }
+        offset += put;
+        length -= put;
+    }
+    return 0;
+}
+
+static int image_store_run(disk_image *image, long offset, long length) {
+    // Write changed bytes back; the direct backend widens them to aligned blocks, which are loaded already
+    long end;
+
+    if (offset + length > image->size) {
+        length = image->size - offset;
+    }
+    if (length <= 0) {
+        return 0;
+    }
+    end = offset + length;
+    if (image->backend == IMAGE_DIRECT) {
+        long aligned_start = offset / DIRECT_ALIGN * DIRECT_ALIGN;
+        long aligned_end = (end + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+        long file_end = image->size / DIRECT_ALIGN * DIRECT_ALIGN; // Writing past here would grow the file
+        if (aligned_end > file_end) {
+            aligned_end = file_end;
+        }
+        if (aligned_end > aligned_start) {
+            if (image_write(image->direct_fd, image->data, aligned_start, aligned_end - aligned_start) < 0) {
+                return -1;
+            }
+            offset = aligned_end > offset ? aligned_end : offset;
+        }
+        if (offset >= end) {
+            return 0;
+        }
+    }
+    return image_write(image->fd, image->data, offset, end - offset);
+}
+
+static int image_store(void *context, long offset, long length) {
+    // Write changed bytes back, skipping blocks never read: nothing in them changed, and memory holds no copy
+    disk_image *image = context;
+    long end = offset + length;
+
+    if (image->loaded == NULL) { // Private pages of the mmap backend hold the file wherever we did not write
+        return image_store_run(image, offset, length);
+    }
+    for (long at = offset; at < end;) {
+        long run_end = at;
+        while (run_end < end && (image->loaded[run_end / image->block / 64] >> (run_end / image->block % 64) & 1)) {
+            run_end = (run_end / image->block + 1) * image->block;
+        }
+        if (run_end == at) { // Not loaded: go on at the next block
+            at = (at / image->block + 1) * image->block;
+            continue;
+        }
+        if (image_store_run(image, at, (run_end < end ? run_end : end) - at) < 0) {
+            return -1;
+        }
+        at = run_end;
+    }
+    return 0;
+}
+
+static int image_flush(void *context) {
+    // Wait until everything written back is on disk
+    disk_image *image = context;
+    STATS_SYSCALL();
+    return fdatasync(image->fd);
+}
+
+static int image_advise(void *context, long offset, long length) {
+    // Ask the kernel to start reading a range of the mapping before it is faulted in
+    disk_image *image = context;
+    long page = sysconf(_SC_PAGESIZE);
+    long start = offset / page * page;
+
+    if (length > 0 && offset < image->size) {
+        STATS_SYSCALL();
+        madvise(image->data + start, offset + length - start, MADV_WILLNEED);
+    }
+    return 0;
+}
+
+static int image_range_lock(int fd, int type, off_t start) {
+    // Take or (with F_UNLCK) drop an OFD lock on one byte, waiting for whoever holds it
+    struct flock range;
+    int result;
+
+    memset(&range, 0, sizeof(range));
+    range.l_type = type;
+    range.l_whence = SEEK_SET;
+    range.l_start = start;
+    range.l_len = 1;
+    do {
+        STATS_SYSCALL();
+        result = fcntl(fd, F_OFD_SETLKW, &range);
+    } while (result < 0 && errno == EINTR);
+    return result;
+}
+
+static int image_generation(int fd, uint64_t *generation) {
+    // Read the generation counter, 0 if nothing has committed yet; -1 with errno set if it cannot be read
+    char text[24];
+
+    *generation = 0;
+    STATS_SYSCALL();
+    ssize_t length = fgetxattr(fd, GENERATION_NAME, text, sizeof(text) - 1);
+    if (length < 0) {
+        return errno == ENODATA ? 0 : -1;
+    }
+    text[length] = '\0';
+    *generation = strtoull(text, NULL, 10);
+    return 0;
+}
+
+static int image_commit(void *context, int done) {
+    // Around a commit's write-back: hold the commit byte so readers wait, and bump the generation before anything is written
+    disk_image *image = context;
+    char text[24];
+
+    if (done) {
+        return image_range_lock(image->fd, F_UNLCK, LOCK_COMMIT);
+    }
+    if (image_range_lock(image->fd, F_WRLCK, LOCK_COMMIT) < 0) {
+        return -1;
+    }
+    int result = image_generation(image->fd, &image->generation);
+    if (result == 0) {
+        snprintf(text, sizeof(text), "%llu", (unsigned long long)++image->generation);
+        STATS_SYSCALL();
+        result = fsetxattr(image->fd, GENERATION_NAME, text, strlen(text), 0);
+    }
+    if (result < 0 && errno != ENOTSUP) { // A snapshot would not notice this commit: do not make it
+        int saved = errno;
+        image_range_lock(image->fd, F_UNLCK, LOCK_COMMIT);
+        errno = saved;
+        return -1;
+    }
+    return 0;
+}
+
+static int image_load_head(disk_image *image) {
+    // Read the boot sector, then the FATs and the fixed root, which are needed first
+    fat_geometry geo;
+
+    if (image_load(image, 0, 512) < 0) {
+        return -1;
+    }
+    if (fat_read_geometry(&geo, image->data, image->size) == 0 && image_load(image, 0, geo.data_offset) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static int image_ready(disk_image *image) {
+    // Finish a successful open: plain readers keep their share of the commit lock, the others let go of it
+    if (image->flags & (IMAGE_WRITE | IMAGE_SNAPSHOT | IMAGE_UNLOCKED)) {
+        disk_image_unlock(image, 0);
+    }
+    return 0;
+}
+
+static int image_fail(disk_image *image) {
+    // Undo a partly done open, keeping errno
+    int saved = errno;
+    disk_image_close(image);
+    errno = saved;
+    return -1;
+}
+
+int disk_image_open(disk_image *image, const char *path, int flags) {
+    // Open an image read-only or for writing with the backend chosen by $FATTOOLS_IO; -1 with errno set on failure
+    struct stat status;
+    fat_geometry geo;
+    int populate;
+
+    memset(image, 0, sizeof(disk_image));
+    image->fd = image->copy_fd = image->direct_fd = -1;
+    pthread_mutex_init(&image->lock, NULL);
+    image->flags = flags;
+    image->backend = image_backend(&populate);
+    if (image->backend < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    image->fd = open(path, (flags & IMAGE_WRITE) ? O_RDWR : O_RDONLY);
+    if (image->fd < 0) {
+        return -1;
+    }
+    if (fstat(image->fd, &status) < 0) {
+        return image_fail(image);
+    }
+    image->size = status.st_size;
+    image->copy_fd = image->fd;
+
+    // A writer waits for the one before it; everyone reads the generation with no commit under way
+    if (!(flags & IMAGE_UNLOCKED) && (flags & IMAGE_WRITE) && disk_image_lock(image, IMAGE_WRITE) < 0) {
+        return image_fail(image);
+    }
+    if (disk_image_lock(image, 0) < 0) {
+        return image_fail(image);
+    }
+    if (image_generation(image->fd, &image->generation) < 0) {
+        image->flags &= ~IMAGE_SNAPSHOT; // Nothing to check a snapshot against: keep the lock instead
+    }
+
+    if (image->backend == IMAGE_MMAP) {
+        // Writers keep their changes in private pages until fat_commit writes them back; snapshots need no shared pages either
+        int writable = (flags & IMAGE_WRITE) != 0;
+        int sharing = writable || (flags & IMAGE_SNAPSHOT) ? MAP_PRIVATE : MAP_SHARED;
+        image->mapped = image->size;
+        STATS_SYSCALL();
+        image->data = mmap(NULL, image->size, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                           sharing | (populate && !writable ? MAP_POPULATE : 0), image->fd, 0);
+        if (image->data == MAP_FAILED) {
+            image->data = NULL;
+            return image_fail(image);
+        }
+        if (populate && writable) { // MAP_POPULATE would copy every page of a private writable mapping
+            STATS_SYSCALL();
+            madvise(image->data, image->size, MADV_POPULATE_READ);
+        }
+        if (flags & IMAGE_SEQUENTIAL) {
+            STATS_SYSCALL();
+            madvise(image->data, image->size, MADV_SEQUENTIAL);
+        }
+        if (fat_read_geometry(&geo, image->data, image->size) == 0) { // Boot sector, FATs and root are needed first
+            image_advise(image, 0, geo.data_offset);
+        }
+        return image_ready(image);
+    }
+
+    // Anonymous memory stands in for the file; pages cost nothing until a block is read into them
+    image->block = image->backend == IMAGE_DIRECT ? DIRECT_BLOCK : PREAD_BLOCK;
+    image->mapped = (image->size + image->block - 1) / image->block * image->block;
+    if (image->backend == IMAGE_DIRECT) {
+        image->direct_fd = open(path, ((flags & IMAGE_WRITE) ? O_RDWR : O_RDONLY) | O_DIRECT);
+        if (image->direct_fd < 0) {
+            return image_fail(image);
+        }
+        image->copy_fd = -1; // Kernel copies would go through the page cache
+    }
+    image->data = mmap(NULL, image->mapped > 0 ? image->mapped : 1, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    image->loaded = calloc(image->mapped / image->block / 64 + 1, sizeof(uint64_t));
+    if (image->data == MAP_FAILED || image->loaded == NULL) {
+        image->data = image->data == MAP_FAILED ? NULL : image->data;
+        errno = ENOMEM;
+        return image_fail(image);
+    }
+    if (image_load_head(image) < 0) {
+        return image_fail(image);
+    }
+    return image_ready(image);
+}
+
+void disk_image_attach(disk_image *image, fat_table *fat) {
+    // Route a FAT's loads and write-backs through the image's backend
+    fat->io.context = image;
+    if (image->flags & IMAGE_WRITE) {
+        fat->io.commit = image_commit;
+    }
+    if (image->backend == IMAGE_MMAP) {
+        fat->io.load = image_advise;
+        if (image->flags & IMAGE_WRITE) { // Private pages are written back as the pread backend's are
+            fat->io.store = image_store;
+            fat->io.flush = image_flush;
+        }
+        return;
+    }
+    fat->io.load = image_load;
+    fat->io.store = image_store;
+    fat->io.flush = image_flush;
+}
+
+int disk_image_lock(disk_image *image, int flags) {
+    // Take the writer lock (IMAGE_WRITE) or a share of the commit lock, waiting as long as it takes; -1 with errno set on failure
+    int result = 0;
+
+    if (flags & IMAGE_WRITE) {
+        return image_range_lock(image->fd, F_WRLCK, LOCK_WRITER);
+    }
+    pthread_mutex_lock(&image->lock); // One lock per open file, however many threads read through it
+    if (image->shared == 0) {
+        result = image_range_lock(image->fd, F_RDLCK, LOCK_COMMIT);
+    }
+    if (result == 0) {
+        image->shared++;
+    }
+    pthread_mutex_unlock(&image->lock);
+    return result;
+}
+
+void disk_image_unlock(disk_image *image, int flags) {
+    // Drop what disk_image_lock took
+    if (flags & IMAGE_WRITE) {
+        image_range_lock(image->fd, F_UNLCK, LOCK_WRITER);
+        return;
+    }
+    pthread_mutex_lock(&image->lock);
+    if (image->shared > 0 && --image->shared == 0) {
+        image_range_lock(image->fd, F_UNLCK, LOCK_COMMIT);
+    }
+    pthread_mutex_unlock(&image->lock);
+}
+
+int disk_image_changed(disk_image *image) {
+    // True if another opener has started a commit since the generation was read
+    uint64_t now;
+    return image_generation(image->fd, &now) == 0 && now != image->generation;
+}
+
+int disk_image_validate(disk_image *image) {
+    // Check a snapshot once it has been read: 1 if no commit came in between (or it is no snapshot), 0 if one did,
+    // in which case the shared lock is now held and the caller reloads the FAT and reads again; -1 on failure
+    if (!(image->flags & IMAGE_SNAPSHOT) || !disk_image_changed(image)) {
+        return 1;
+    }
+    if (disk_image_lock(image, 0) < 0) {
+        return -1;
+    }
+    image->flags &= ~IMAGE_SNAPSHOT;
+    if (image->loaded != NULL) { // Blocks read so far may be out of date
+        memset(image->loaded, 0, (image->mapped / image->block / 64 + 1) * sizeof(uint64_t));
+        if (image_load_head(image) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void disk_image_drop_pages(disk_image *image) {
+    // After a successful commit, drop the private copies the mmap backend made of the pages it changed: the file holds
+    // the same bytes now, so they fault back in from it and a long-lived writer does not keep every page it wrote
+    if (image->backend == IMAGE_MMAP && (image->flags & IMAGE_WRITE) && image->data != NULL) {
+        STATS_SYSCALL();
+        madvise(image->data, image->size, MADV_DONTNEED);
+    }
+}
+
+void disk_image_close(disk_image *image) {
+    // Unmap and close everything disk_image_open set up
+    if (image->data != NULL) {
+        munmap(image->data, image->mapped > 0 ? image->mapped : 1);
+    }
+    free(image->loaded);
+    pthread_mutex_destroy(&image->lock);
+    if (image->direct_fd >= 0) {
+        close(image->direct_fd);
+    }
+    if (image->fd >= 0) {
+        close(image->fd);
+    }
+    image->data = NULL;
+    image->loaded = NULL;
+    image->shared = 0; // Closing the file dropped its locks
+    image->fd = image->copy_fd = image->direct_fd = -1;
+}
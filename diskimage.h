@@ -0,0 +1,56 @@
+#ifndef DISKIMAGE_H
+#define DISKIMAGE_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "fat12.h"
+
+// Ways of getting the image into memory, picked with $FATTOOLS_IO
+#define IMAGE_MMAP 0   // "mmap": shared mapping, madvise hints ("mmap-populate" pre-faults it all)
+#define IMAGE_PREAD 1  // "pread": blocks read on first use with read-ahead, changes written back with pwrite
+#define IMAGE_DIRECT 2 // "direct": as pread, through O_DIRECT and aligned buffers, bypassing the page cache
+
+// Flags of disk_image_open
+#define IMAGE_WRITE 1      // Open for writing; read-only otherwise
+#define IMAGE_SEQUENTIAL 2 // Mostly bulk transfers: tell the kernel to read ahead and drop behind
+#define IMAGE_SNAPSHOT 4   // Read without holding any lock, checking with disk_image_validate afterwards
+#define IMAGE_UNLOCKED 8   // Hold no lock between calls; the caller locks around each operation (diskd)
+
+// Processes sharing an image coordinate with OFD locks on two bytes far past its end:
+// a writer holds the writer byte for its whole run, so writers take turns, and the
+// commit byte only while fat_commit writes back. Readers share the commit byte, so they
+// wait for at most one commit and hold up only commits, never a writer's work before it;
+// writers keep their changes in private memory until the commit, so readers never see
+// them half done. Snapshot readers hold nothing: each commit first bumps a generation
+// counter kept in an extended attribute of the image, and a snapshot whose generation
+// moved is redone under the shared lock. Where extended attributes are not supported,
+// a snapshot falls back to holding the shared lock.
+
+// Open disk image; data holds the whole image whichever backend is used, but
+// with the pread and direct backends only bytes passed to fat_need are valid
+typedef struct {
+    int fd;              // Plain descriptor of the image, -1 if not open
+    int copy_fd;         // Descriptor for kernel-side copies out, -1 if they would bypass the backend
+    int direct_fd;       // O_DIRECT descriptor, -1 unless IMAGE_DIRECT
+    int backend;
+    int flags;
+    char *data;
+    long size;
+    long mapped;         // Bytes of memory behind data
+    long block;          // Read unit of the pread and direct backends
+    uint64_t *loaded;    // One bit per block already read
+    pthread_mutex_t lock; // Readers of the same image may load blocks from several threads
+    uint64_t generation; // Commits made to the image when it was opened, or by our last commit
+    int shared;          // Holders of the shared commit lock
+} disk_image;
+
+int disk_image_open(disk_image *image, const char *path, int flags);
+void disk_image_attach(disk_image *image, fat_table *fat);
+int disk_image_lock(disk_image *image, int flags);
+void disk_image_unlock(disk_image *image, int flags);
+int disk_image_changed(disk_image *image);
+int disk_image_validate(disk_image *image);
+void disk_image_drop_pages(disk_image *image);
+void disk_image_close(disk_image *image);
+
+#endif
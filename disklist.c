@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // memfd_create
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -6,131 +7,125 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <unistd.h>
-
-#define timeOffset 14 // Offset of creation time in directory entry
-#define dateOffset 16 // Offset of creation date in directory entry
-
-static unsigned int bytes_per_sector;
-
-int get_size(char *image) {
-    // Retrieve the file size from the directory entry
-    int size = (image[28] & 0xFF) +
-               ((image[29] & 0xFF) << 8) +
-               ((image[30] & 0xFF) << 16) +
-               ((image[31] & 0xFF) << 24);
-    return size;
-}
-
-void print_date_time(char *directory_entry_start_pos) {
-    // Print the creation date and time from the directory entry
-    int creation_time, creation_date;
-    int hours, minutes, day, month, year;
-
-    creation_time = *(unsigned short *)(directory_entry_start_pos + timeOffset);
-    creation_date = *(unsigned short *)(directory_entry_start_pos + dateOffset);
-
-    year = ((creation_date & 0xFE00) >> 9) + 1980; // Year stored as value since 1980
-    month = (creation_date & 0x1E0) >> 5;          // Month stored in the middle four bits
-    day = (creation_date & 0x1F);                  // Day stored in the low five bits
-
-    printf("%d-%02d-%02d ", year, month, day);
-
-    hours = (creation_time & 0xF800) >> 11; // Hours stored in the high five bits
-    minutes = (creation_time & 0x7E0) >> 5; // Minutes stored in the middle six bits
-
-    printf("%02d:%02d\n", hours, minutes);
-}
-
-char *print_file(char *image, char *original) {
-    // Print the file or directory details and recursively explore subdirectories
-    int file_size;
-    char file_name[12];
-    char file_extension[4];
-    char file_type;
-    char *sub_directory_ptr = NULL;
-    int name_index;
-
-    do {
-        while (image[0] != 0x00) {
-            if (image[26] != 0x00 && image[26] != 0x01 && image[11] != 0x0F && (image[11] & 0x08) != 0x08) {
-                file_size = 0;
-
-                if (image[11] == 0x10) { // Check if it's a directory
-                    file_type = 'D';
-                    if (image[0] == '.' || image[1] == '.' || image[0] == 1 || image[1] == 1 || image[0] == 0 || image[1] == 0) {
-                        image += 32; // Skip empty directory entries
-                        continue;
-                    }
-                } else {
-                    file_type = 'F';
-                    file_size = get_size(image);
-                }
-
-                // Copy the file name
-                for (name_index = 0; image[name_index] != ' ' && name_index < 8; name_index++) {
-                    file_name[name_index] = image[name_index];
-                }
-                file_name[name_index] = '\0';
-
-                // Copy the file extension
-                for (name_index = 0; name_index < 3; name_index++) {
-                    file_extension[name_index] = image[8 + name_index];
-                }
-                file_extension[name_index] = '\0';
-
-                // Concatenate file name and extension
-                if (file_type == 'F') {
-                    strcat(file_name, ".");
-                }
-                strcat(file_name, file_extension);
-
-                if ((image[11] & 0x08) == 0) {
-                    printf("%c %10u %20s ", file_type, file_size, file_name);
-                    print_date_time(image);
-                }
-
-                if (image[11] == 0x10) { // Recursion for subdirectory
-                    sub_directory_ptr = image;
-                    image = print_file(image + 32, original);
-                    char sub_dir_name[9];
-                    strncpy(sub_dir_name, sub_directory_ptr, 8);
-                    sub_dir_name[8] = '\0';
-                    printf("\n");
-                    printf("%s\n", sub_dir_name); // Print subdirectory name
-                    printf("=============\n");
-                    image = print_file(original + (sub_directory_ptr[26] + 12) * 512, original);
-                }
+#include "fat12.h"
+#include "dirindex.h"
+#include "diskops.h"
+#include "diskimage.h"
+#include "diskstats.h"
+#include "diskclient.h"
+
+static int list_copy_out(int fd) {
+    // Copy a finished listing from the start of fd to standard output
+    char buffer[65536];
+    ssize_t got;
+
+    if (lseek(fd, 0, SEEK_SET) < 0) {
+        return -1;
+    }
+    while ((got = read(fd, buffer, sizeof(buffer))) != 0) {
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got < 0) {
+            return -1;
+        }
+        for (ssize_t done = 0; done < got;) {
+            ssize_t put = write(STDOUT_FILENO, buffer + done, got - done);
+            if (put < 0 && errno != EINTR) {
+                return -1;
             }
-            image += 32; // Move to next directory entry
+            done += put > 0 ? put : 0;
         }
-        sub_directory_ptr = image;
-    } while (sub_directory_ptr[0] != 0x00);
-
-    return sub_directory_ptr;
+    }
+    return 0;
 }
 
-
 int main(int argc, char *argv[]) {
     // Main function to print the root directory and its contents
-    int file_descriptor;
-    struct stat file_status;
+    disk_image image;
+    int mode = DISK_LIST_TEXT;
+
+    disk_stats_init(&argc, argv, "disklist");
+    while (argc > 1 && argv[1][0] == '-') {
+        if (strcmp(argv[1], "--json") == 0) {
+            mode = DISK_LIST_JSON;
+        } else if (strcmp(argv[1], "-0") == 0 || strcmp(argv[1], "--null") == 0) {
+            mode = DISK_LIST_NUL;
+        } else if (strcmp(argv[1], "--crc") == 0) { // Checksum every file, for diskget --verify -m
+            mode = DISK_LIST_CRC;
+        } else {
+            break;
+        }
+        argv++;
+        argc--;
+    }
+    if (argc != 2) {
+        printf("Usage: disklist [--stats[=json]] [--json | -0 | --crc] <disk image>\n");
+        return 1;
+    }
 
-    file_descriptor = open(argv[1], O_RDWR); // Open the disk image file
-    fstat(file_descriptor, &file_status);
+    if (disk_client_connect() >= 0) { // A server has the image loaded already
+        disk_stats_phase(STATS_COPY);
+        int result = disk_client_request(DISKD_LIST, mode, argv[1], NULL, NULL, STDOUT_FILENO);
+        if (result != DISK_BAD_IMAGE) { // Otherwise the server could not read it: open it here, which says why
+            if (result != DISK_OK) {
+                printf("%s\n", disk_message(result));
+            }
+            return result != DISK_OK;
+        }
+    }
 
-    char *mapped_memory = mmap(NULL, file_status.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, file_descriptor, 0);
-    if (mapped_memory == MAP_FAILED) {
-        printf("Error: failed to map memory\n");
+    if (disk_image_open(&image, argv[1], IMAGE_SNAPSHOT) < 0) { // Open the disk image file, read-only, as a snapshot
+        perror("Error opening disk image");
+        exit(1);
+    }
+    int list_fd = memfd_create("disklist", MFD_CLOEXEC); // Nothing is printed until the snapshot is known to have held
+    if (list_fd < 0) {
+        perror("Error creating listing buffer");
         exit(1);
     }
 
-    printf("Root\n");
-    printf("==============\n");
-    print_file(mapped_memory + 0x2600, mapped_memory + 0x2600);
+    fat_table fat;
+    int result;
+    int valid = 0;
+    while (valid == 0) {
+        disk_stats_phase(STATS_FAT);
+        if (fat_load(&fat, image.data, image.size) < 0) {
+            printf("Error: failed to read FAT\n");
+            exit(1);
+        }
+        disk_image_attach(&image, &fat);
+
+        disk_stats_phase(STATS_DIRECTORY); // The walk and the listing go together
+        if (ftruncate(list_fd, 0) < 0 || lseek(list_fd, 0, SEEK_SET) < 0) {
+            perror("Error creating listing buffer");
+            exit(1);
+        }
+        result = disk_list(image.data, &fat, mode, list_fd);
+        valid = disk_image_validate(&image); // 0: a writer committed meanwhile, list again under the shared lock
+        if (valid == 0) {
+            fat_release(&fat);
+        }
+    }
+    if (valid < 0) {
+        perror("Error locking disk image");
+        exit(1);
+    }
+    if (result == DISK_OK && list_copy_out(list_fd) < 0) {
+        perror("Error writing listing");
+        exit(1);
+    }
+    close(list_fd);
+    if (result != DISK_OK) {
+        printf("%s\n", disk_message(result));
+        exit(1);
+    }
 
-    munmap(mapped_memory, file_status.st_size);
-    close(file_descriptor);
+    disk_stats_phase(STATS_FLUSH);
+    fat_release(&fat);
+    disk_image_close(&image);
 
     return 0;
 }
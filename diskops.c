@@ -0,0 +1,1390 @@
+#define _GNU_SOURCE // copy_file_range, SEEK_DATA, fallocate
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "diskops.h"
+#include "crc32c.h"
+#include "diskstats.h"
+
+#define timeOffset 14 // Offset of creation time in directory entry
+#define dateOffset 16 // Offset of creation date in directory entry
+
+#define OUTPUT_BYTES (1 << 20) // Listing is collected here and written in large blocks
+#define STREAM_BYTES 65536     // Space reserved at a time while streaming
+#define SPARSE_BYTES 4096      // Shortest run of zeros worth leaving as a hole in an output file
+#define CRC_BYTES (1 << 20)    // Checksummed just before it is sent, while it is still in cache
+
+// Output collected in memory and written to a descriptor in large blocks
+typedef struct {
+    int fd;
+    char *data;
+    size_t used;
+    int failed; // A write failed; later output is dropped
+} disk_output;
+
+// Where an input file has data, found with SEEK_DATA and SEEK_HOLE as a copy moves through it
+typedef struct {
+    int fd;    // -1 once the file is taken to be all data
+    long size;
+    long data; // Start of the first data at or after the last offset asked about
+    long hole; // End of that data
+} input_map;
+
+// Directory waiting to be listed
+typedef struct {
+    int cluster;
+    unsigned char name[11]; // Packed name, for the text header
+    int long_name;          // Its path ends in a long name, which the header shows instead
+    long path;              // Offset of its path in the path buffer
+    int path_length;
+} list_item;
+
+static const char *disk_messages[] = {
+    "",
+    "File not found",
+    "The directory not found.",
+    "The directory is full.",
+    "No enough free space in the disk image.",
+    "File is too large for a FAT file system.",
+    "No empty cluster found",
+    "Error: input/output failed",
+    "Error: out of memory",
+    "Error: failed to read FAT",
+    "Error: bad request",
+    "The name cannot be stored in a FAT directory.",
+    "A file can only be truncated to a smaller size.",
+};
+
+const char *disk_message(int code) {
+    // Text the tools print for a result code
+    if (code < 0 || code >= (int)(sizeof(disk_messages) / sizeof(disk_messages[0]))) {
+        return "Error: unknown failure";
+    }
+    return disk_messages[code];
+}
+
+int disk_is_zero(const void *bytes, long length) {
+    // True if every byte is zero; 64 bytes per step with SSE2, then whole words
+    const char *data = bytes;
+    long i = 0;
+#ifdef __SSE2__
+    for (; i + 64 <= length; i += 64) {
+        const __m128i *block = (const __m128i *)(data + i);
+        __m128i any = _mm_or_si128(_mm_or_si128(_mm_loadu_si128(block), _mm_loadu_si128(block + 1)),
+                                   _mm_or_si128(_mm_loadu_si128(block + 2), _mm_loadu_si128(block + 3)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128())) != 0xFFFF) {
+            return 0;
+        }
+    }
+#endif
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        if (word != 0) {
+            return 0;
+        }
+    }
+    for (; i < length; i++) {
+        if (data[i] != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int input_is_hole(input_map *map, long offset, long length) {
+    // True if the input has no data in a range, so it reads as zeros without being read; offsets must not go back
+    if (map->fd < 0) {
+        return 0;
+    }
+    if (offset >= map->hole) {
+        map->data = lseek(map->fd, offset, SEEK_DATA);
+        if (map->data < 0 && errno != ENXIO) { // The file system cannot tell
+            map->fd = -1;
+            return 0;
+        }
+        if (map->data < 0) { // Nothing but a hole up to the end
+            map->data = map->size;
+        }
+        map->hole = map->data < map->size ? lseek(map->fd, map->data, SEEK_HOLE) : map->size;
+        if (map->hole < 0) {
+            map->fd = -1;
+            return 0;
+        }
+    }
+    return offset + length <= map->data;
+}
+
+static void output_flush(disk_output *out) {
+    // Write out everything collected so far
+    size_t done = 0;
+    while (!out->failed && done < out->used) {
+        STATS_SYSCALL();
+        ssize_t written = write(out->fd, out->data + done, out->used - done);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            out->failed = 1;
+            break;
+        }
+        done += written;
+    }
+    out->used = 0;
+}
+
+static void output_printf(disk_output *out, const char *format, ...) {
+    // Append formatted text to the output buffer, flushing it first if it is too full
+    va_list args;
+    int length;
+
+    va_start(args, format);
+    length = vsnprintf(out->data + out->used, OUTPUT_BYTES - out->used, format, args);
+    va_end(args);
+    if (length >= 0 && (size_t)length >= OUTPUT_BYTES - out->used) {
+        output_flush(out);
+        va_start(args, format);
+        vsnprintf(out->data, OUTPUT_BYTES, format, args);
+        va_end(args);
+    }
+    if (length > 0) {
+        out->used += length < OUTPUT_BYTES ? length : OUTPUT_BYTES - 1;
+    }
+}
+
+static void output_byte(disk_output *out, char c) {
+    // Append a single byte to the output buffer
+    if (out->used == OUTPUT_BYTES) {
+        output_flush(out);
+    }
+    out->data[out->used++] = c;
+}
+
+static void output_json_chars(disk_output *out, const char *text, int length) {
+    // Append text inside a JSON string literal, escaping quotes, backslashes and non-ASCII characters; long names are
+    // UTF-8, bytes of 8.3 names that are not are taken as Latin-1
+    for (int i = 0; i < length; i++) {
+        unsigned char c = text[i];
+        const unsigned char *next = (const unsigned char *)text + i + 1;
+        if (c == '"' || c == '\\') {
+            output_byte(out, '\\');
+            output_byte(out, c);
+        } else if (c >= 0xC0 && c < 0xE0 && i + 1 < length && (next[0] & 0xC0) == 0x80) {
+            output_printf(out, "\\u%04x", (c & 0x1F) << 6 | (next[0] & 0x3F));
+            i += 1;
+        } else if (c >= 0xE0 && c < 0xF0 && i + 2 < length && (next[0] & 0xC0) == 0x80 && (next[1] & 0xC0) == 0x80) {
+            output_printf(out, "\\u%04x", (c & 0x0F) << 12 | (next[0] & 0x3F) << 6 | (next[1] & 0x3F));
+            i += 2;
+        } else if (c < 0x20 || c >= 0x7F) {
+            output_printf(out, "\\u%04x", c);
+        } else {
+            output_byte(out, c);
+        }
+    }
+}
+
+static int manifest_plain(const char *text, int length) {
+    // True if text can go into a manifest without quotes
+    for (int i = 0; i < length; i++) {
+        if (text[i] == ' ' || text[i] == '\t' || text[i] == '"' || text[i] == '\\') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void output_manifest_path(disk_output *out, const char *dir, int dir_length, const char *name, int name_length) {
+    // Append dir/name as a manifest field, in double quotes when it holds blanks or starts like a comment or quote
+    const char *first = dir_length > 0 ? dir : name;
+    if (first[0] != '#' && first[0] != '"' && manifest_plain(dir, dir_length) && manifest_plain(name, name_length)) {
+        output_printf(out, "%.*s%s%.*s", dir_length, dir, dir_length > 0 ? "/" : "", name_length, name);
+        return;
+    }
+    output_byte(out, '"');
+    for (int part = 0; part < 2; part++) {
+        const char *text = part == 0 ? dir : name;
+        int length = part == 0 ? dir_length : name_length;
+        for (int i = 0; i < length; i++) {
+            if (text[i] == '"' || text[i] == '\\') {
+                output_byte(out, '\\');
+            }
+            output_byte(out, text[i]);
+        }
+        if (part == 0 && dir_length > 0) {
+            output_byte(out, '/');
+        }
+    }
+    output_byte(out, '"');
+}
+
+char *disk_label(char *image, fat_table *fat, char *label) {
+    // Retrieve disk label from boot sector or root directory
+    strncpy(label, &image[fat->geo.label_offset], 11); // Check if disk label is in boot sector
+    if (label[0] == ' ') { // Retrieve disk label from root directory
+        int range_count;
+        dir_range *ranges = dir_ranges(fat, DIR_ROOT, &range_count);
+        for (int r = 0; ranges != NULL && r < range_count; r++) {
+            long root_dir = ranges[r].offset;
+            long end = root_dir + ranges[r].length;
+            while (root_dir < end) {
+                int attribute = image[root_dir + 11]; // Attribute at byte 11
+                if (attribute == 0x08) { // If attribute is 0x08, it's a volume label
+                    strncpy(label, &image[root_dir], 11);
+                    r = range_count;
+                    break;
+                }
+                root_dir += 32; // Move to next entry
+            }
+        }
+        free(ranges);
+    }
+    label[11] = '\0'; // Null-terminate the string
+    return label;
+}
+
+int disk_count_files(char *image, fat_table *fat, int dir) {
+    // Count the total number of files under a directory, following its cluster chain
+    int file_count = 0;
+    int range_count;
+    dir_range *ranges = dir_ranges(fat, dir, &range_count);
+
+    for (int i = 0; ranges != NULL && i < range_count; i++) {
+        char *entry = image + ranges[i].offset;
+        char *end = entry + ranges[i].length;
+
+        for (; entry < end; entry += 32) { // Move to next directory entry
+            if (entry[0] == 0x00) { // No content after the end marker
+                i = range_count;
+                break;
+            }
+            if (entry[0] != '.' && (unsigned char)entry[0] != 0xE5 && entry[11] != 0x0F && (entry[11] & 0x08) != 0x08) {
+                if ((entry[11] & 0x10) == 0) { // Not a directory
+                    file_count++;
+                } else {
+                    file_count += disk_count_files(image, fat, dir_entry_cluster(fat, image, entry - image));
+                }
+            }
+        }
+    }
+    free(ranges);
+    return file_count;
+}
+
+int disk_info(char *image, long image_size, fat_table *fat, int out_fd) {
+    // Print the OS name, label, sizes, file count and FAT layout of the image
+    char os_name[9];
+    char volume_label[12];
+    char text[512];
+    int length;
+
+    strncpy(os_name, &image[3], 8); // OS info starts at byte 3, length is 8 bytes
+    os_name[8] = '\0';
+    disk_label(image, fat, volume_label);
+    length = snprintf(text, sizeof(text),
+                      "OS Name: %s\nLabel of the disk: %s\nTotal Size of the disk: %lu\nFree size of the disk: %ld\n"
+                      "==============\nThe number of files in the disk: %d\n==============\n"
+                      "Number of FAT copies: %d\nSectors per FAT: %ld\n",
+                      os_name, volume_label, (uint64_t)image_size, (long)fat_count_free(fat) * fat->geo.cluster_size,
+                      disk_count_files(image, fat, DIR_ROOT), fat->geo.fat_copies, fat->geo.sectors_per_fat);
+    STATS_SYSCALL();
+    return write(out_fd, text, length) == length ? DISK_OK : DISK_IO_ERROR;
+}
+
+static void entry_date_time(const char *entry, char *text) {
+    // Format the creation date and time from the directory entry
+    int creation_time, creation_date;
+    int hours, minutes, day, month, year;
+
+    creation_time = (entry[timeOffset] & 0xFF) | ((entry[timeOffset + 1] & 0xFF) << 8);
+    creation_date = (entry[dateOffset] & 0xFF) | ((entry[dateOffset + 1] & 0xFF) << 8);
+
+    year = ((creation_date & 0xFE00) >> 9) + 1980; // Year stored as value since 1980
+    month = (creation_date & 0x1E0) >> 5;          // Month stored in the middle four bits
+    day = (creation_date & 0x1F);                  // Day stored in the low five bits
+    hours = (creation_time & 0xF800) >> 11;        // Hours stored in the high five bits
+    minutes = (creation_time & 0x7E0) >> 5;        // Minutes stored in the middle six bits
+
+    snprintf(text, 17, "%04d-%02d-%02d %02d:%02d", year, month, day, hours, minutes);
+}
+
+static int entry_text_name(const char *entry, int is_directory, char *text) {
+    // Name as the text listing shows it: trimmed base, then the raw three-byte extension
+    int length = 0;
+    while (length < 8 && entry[length] != ' ') {
+        text[length] = entry[length];
+        length++;
+    }
+    if (!is_directory) {
+        text[length++] = '.';
+    }
+    memcpy(text + length, entry + 8, 3);
+    length += 3;
+    text[length] = '\0';
+    return length;
+}
+
+int disk_list(char *image, fat_table *fat, int mode, int out_fd) {
+    // Walk the directory tree with an explicit stack, listing each directory's entries before its subdirectories
+    list_item *stack = NULL;
+    int stack_used = 0, stack_size = 0;
+    char *paths = NULL;
+    long paths_used = 0, paths_size = 0;
+    uint64_t *visited;
+    int first = 1;
+    int result = DISK_OK;
+    disk_output out = {out_fd, malloc(OUTPUT_BYTES), 0, 0};
+    dir_long_name long_name;
+    char long_text[DIR_NAME_MAX];
+
+    visited = calloc(fat->count / 64 + 1, sizeof(uint64_t)); // Guards against directory loops
+    stack = malloc(64 * sizeof(list_item));
+    if (out.data == NULL || visited == NULL || stack == NULL) {
+        free(out.data);
+        free(visited);
+        free(stack);
+        return DISK_NO_MEMORY;
+    }
+    stack_size = 64;
+    stack[stack_used].cluster = DIR_ROOT;
+    stack[stack_used].path = 0;
+    stack[stack_used].path_length = 0;
+    stack[stack_used].long_name = 0;
+    stack_used++;
+
+    while (stack_used > 0) {
+        list_item dir = stack[--stack_used];
+        int range_count;
+        dir_range *ranges;
+
+        paths_used = dir.path + dir.path_length; // Paths of directories already listed are no longer needed
+        if (mode == DISK_LIST_TEXT) {
+            if (dir.cluster == DIR_ROOT) {
+                output_printf(&out, "Root\n==============\n");
+            } else if (dir.long_name) {
+                int start = dir.path_length;
+                while (start > 0 && paths[dir.path + start - 1] != '/') {
+                    start--;
+                }
+                output_printf(&out, "\n%.*s\n=============\n", dir.path_length - start, paths + dir.path + start);
+            } else {
+                output_printf(&out, "\n%.8s\n=============\n", (char *)dir.name);
+            }
+        }
+
+        ranges = dir_ranges(fat, dir.cluster, &range_count);
+        if (ranges == NULL) {
+            result = DISK_NO_MEMORY;
+            break;
+        }
+        long_name.pieces = 0;
+        for (int r = 0; r < range_count; r++) {
+            char *entry = image + ranges[r].offset;
+            char *end = entry + ranges[r].length;
+
+            for (; entry < end; entry += DIR_ENTRY_SIZE) {
+                char short_name[13], date[17];
+                char *name = short_name;
+                int is_directory, cluster, name_length, long_length;
+                long size;
+
+                if (entry[0] == 0x00) { // No entries after the end marker
+                    r = range_count;
+                    break;
+                }
+                if (entry[11] == 0x0F) {
+                    dir_long_feed(&long_name, (unsigned char *)entry);
+                    continue;
+                }
+                long_length = dir_long_take(&long_name, (unsigned char *)entry, long_text);
+                if ((unsigned char)entry[0] == 0xE5 || entry[0] == '.' || (entry[11] & 0x08) != 0) {
+                    continue; // Deleted, "." and "..", and the volume label
+                }
+                if (long_length > 0) { // Conversion only happens here, for entries that have a long name
+                    name = long_text;
+                    name_length = long_length;
+                } else {
+                    name_length = dir_unpack_name((unsigned char *)entry, short_name);
+                }
+                is_directory = (entry[11] & 0x10) != 0;
+                cluster = dir_entry_cluster(fat, image, entry - image);
+                size = is_directory ? 0 : dir_entry_size(image, entry - image);
+                entry_date_time(entry, date);
+
+                if (mode == DISK_LIST_TEXT) {
+                    if (long_length == 0) {
+                        entry_text_name(entry, is_directory, short_name);
+                    }
+                    output_printf(&out, "%c %10lu %20s %s\n", is_directory ? 'D' : 'F', (unsigned long)size, name, date);
+                } else if (mode == DISK_LIST_CRC) {
+                    uint32_t crc = 0;
+                    if (!is_directory) {
+                        output_manifest_path(&out, paths + dir.path, dir.path_length, name, name_length);
+                        output_byte(&out, ' ');
+                        if (disk_checksum(fat, cluster, size, &crc) < 0) {
+                            output_printf(&out, "damaged\n"); // The chain is shorter than the size
+                        } else {
+                            output_printf(&out, "%08x\n", crc);
+                        }
+                    }
+                } else {
+                    if (mode == DISK_LIST_JSON) {
+                        output_printf(&out, first ? "[\n{\"path\":\"" : ",\n{\"path\":\"");
+                        output_json_chars(&out, paths + dir.path, dir.path_length);
+                        if (dir.path_length > 0) {
+                            output_byte(&out, '/');
+                        }
+                        output_json_chars(&out, name, name_length);
+                        output_printf(&out, "\",\"type\":\"%s\",\"size\":%ld,\"cluster\":%d,\"created\":\"%s\"}",
+                                      is_directory ? "directory" : "file", size, cluster, date);
+                    } else {
+                        output_printf(&out, "%c\t%ld\t%s\t", is_directory ? 'D' : 'F', size, date);
+                        output_printf(&out, "%.*s%s%s", dir.path_length, paths + dir.path, dir.path_length > 0 ? "/" : "", name);
+                        output_byte(&out, '\0');
+                    }
+                    first = 0;
+                }
+
+                if (is_directory && cluster >= 2 && cluster < fat->count && !(visited[cluster / 64] >> (cluster % 64) & 1)) {
+                    list_item *item;
+                    visited[cluster / 64] |= 1ULL << (cluster % 64);
+                    if (stack_used == stack_size) {
+                        list_item *grown = realloc(stack, 2 * stack_size * sizeof(list_item));
+                        if (grown == NULL) {
+                            result = DISK_NO_MEMORY;
+                            r = range_count;
+                            break;
+                        }
+                        stack = grown;
+                        stack_size *= 2;
+                    }
+                    if (paths_used + dir.path_length + 1 + name_length > paths_size) { // Room for the parent path, "/" and a name
+                        long size_wanted = 2 * paths_size + dir.path_length + 4096;
+                        char *grown = realloc(paths, size_wanted);
+                        if (grown == NULL) {
+                            result = DISK_NO_MEMORY;
+                            r = range_count;
+                            break;
+                        }
+                        paths = grown;
+                        paths_size = size_wanted;
+                    }
+                    item = &stack[stack_used++];
+                    item->cluster = cluster;
+                    memcpy(item->name, entry, 11);
+                    item->long_name = long_length > 0;
+                    item->path = paths_used;
+                    memcpy(paths + paths_used, paths + dir.path, dir.path_length); // Parent path, then "/" and the name
+                    item->path_length = dir.path_length;
+                    if (dir.path_length > 0) {
+                        paths[paths_used + item->path_length++] = '/';
+                    }
+                    memcpy(paths + paths_used + item->path_length, name, name_length);
+                    item->path_length += name_length;
+                    paths_used += item->path_length;
+                }
+            }
+        }
+        free(ranges);
+        if (result != DISK_OK) {
+            break;
+        }
+    }
+
+    if (mode == DISK_LIST_JSON) {
+        output_printf(&out, first ? "[]\n" : "\n]\n");
+    }
+    output_flush(&out);
+    if (out.failed && result == DISK_OK) {
+        result = DISK_IO_ERROR;
+    }
+    free(out.data);
+    free(paths);
+    free(stack);
+    free(visited);
+    return result;
+}
+
+static int write_extent(int image_fd, fat_table *fat, int out_fd, off_t offset, size_t length, int *use_copy_range, int *use_sendfile) {
+    // Send one extent to the output, letting the kernel copy it when it can
+    ssize_t sent;
+
+    while (length > 0) {
+        sent = -1;
+        if (*use_copy_range) {
+            STATS_SYSCALL();
+            sent = copy_file_range(image_fd, &offset, out_fd, NULL, length, 0);
+            if (sent <= 0) {
+                *use_copy_range = 0; // Not supported for this pair of files
+            }
+        }
+        if (sent <= 0 && *use_sendfile) {
+            STATS_SYSCALL();
+            sent = sendfile(out_fd, image_fd, &offset, length);
+            if (sent <= 0) {
+                *use_sendfile = 0;
+            }
+        }
+        if (sent <= 0) {
+            if (fat_need(fat, offset, length) < 0) {
+                return -1;
+            }
+            STATS_SYSCALL();
+            sent = write(out_fd, fat->image + offset, length); // Straight from the image in memory
+            if (sent < 0 && errno == EINTR) {
+                continue;
+            }
+            if (sent <= 0) {
+                return -1;
+            }
+            offset += sent;
+        }
+        length -= sent;
+    }
+    return 0;
+}
+
+static int output_sparse(int out_fd, long *existing) {
+    // True if holes can be left in the output by seeking: a regular file written at its own offset
+    struct stat status;
+    int flags = fcntl(out_fd, F_GETFL);
+
+    if (flags < 0 || (flags & O_APPEND) || fstat(out_fd, &status) < 0 || !S_ISREG(status.st_mode) ||
+        lseek(out_fd, 0, SEEK_CUR) < 0) {
+        return 0;
+    }
+    *existing = status.st_size;
+    return 1;
+}
+
+static int output_skip(int out_fd, long length, long existing) {
+    // Seek over a run of zeros, punching out whatever an existing file held there
+    off_t position = lseek(out_fd, 0, SEEK_CUR);
+
+    STATS_ADD(syscalls, position < existing ? 3 : 2); // These two seeks, and the hole punched in an existing file
+    if (position < 0) {
+        return -1;
+    }
+    if (position < existing && fallocate(out_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, position, length) < 0) {
+        return -1;
+    }
+    return lseek(out_fd, length, SEEK_CUR) < 0 ? -1 : 0;
+}
+
+static int write_sparse_extent(int image_fd, fat_table *fat, int out_fd, off_t offset, long length, long existing,
+                               int *use_copy_range, int *use_sendfile) {
+    // Send one extent, leaving a hole in the output for every run of zero clusters of at least SPARSE_BYTES
+    long cluster_size = fat->geo.cluster_size;
+    long sent = 0;  // Bytes of the extent already sent or skipped
+    long zero = -1; // Start of the current run of zero clusters
+
+    if (fat_need(fat, offset, length) < 0) {
+        return -1;
+    }
+    for (long at = 0; at < length; at += cluster_size) {
+        long bytes = length - at < cluster_size ? length - at : cluster_size;
+        long end = at + bytes;
+        if (disk_is_zero(fat->image + offset + at, bytes)) {
+            zero = zero < 0 ? at : zero;
+            if (end < length) {
+                continue;
+            }
+        } else {
+            end = at; // The zero run, if any, stops before this cluster
+        }
+        if (zero >= 0 && end - zero >= SPARSE_BYTES) {
+            if (write_extent(image_fd, fat, out_fd, offset + sent, zero - sent, use_copy_range, use_sendfile) < 0) {
+                return -1;
+            }
+            sent = zero;
+            if (output_skip(out_fd, end - zero, existing) == 0) {
+                sent = end;
+            }
+        }
+        zero = -1;
+    }
+    return write_extent(image_fd, fat, out_fd, offset + sent, length - sent, use_copy_range, use_sendfile);
+}
+
+int disk_checksum(fat_table *fat, int start_cluster, long size, uint32_t *crc) {
+    // CRC32C of a file's data read through its chain; -1 if the chain ends early
+    int extent_count;
+    fat_extent *extents = fat_chain(fat, start_cluster, &extent_count);
+    long remaining = size;
+
+    if (extents == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < extent_count && remaining > 0; i++) {
+        long offset = fat_cluster_offset(fat, extents[i].start);
+        long length = (long)extents[i].length * fat->geo.cluster_size;
+        length = length < remaining ? length : remaining;
+        if (fat_need(fat, offset, length) < 0) {
+            free(extents);
+            return -1;
+        }
+        *crc = crc32c(*crc, fat->image + offset, length);
+        remaining -= length;
+    }
+    free(extents);
+    return remaining == 0 ? 0 : -1;
+}
+
+int disk_copy_extents(int image_fd, fat_table *fat, int out_fd, long size, const fat_extent *extents, int extent_count, uint32_t *crc) {
+    // Copy the file content extent by extent, one transfer per run of clusters; runs of zeros become holes in a regular file
+    // and, if crc is given, each block is checksummed from the image right before it goes out
+    long remaining = size;
+    long existing = 0;
+    int use_copy_range = 1, use_sendfile = 1;
+    int sparse = output_sparse(out_fd, &existing);
+    int result;
+
+    for (int i = 0; i < extent_count && remaining > 0; i++) {
+        off_t physical_address = fat_cluster_offset(fat, extents[i].start); // Convert to physical address
+        long length = (long)extents[i].length * fat->geo.cluster_size;
+        if (length > remaining) {
+            length = remaining;
+        }
+        for (long done = 0, part; done < length; done += part) {
+            part = crc == NULL || length - done < CRC_BYTES ? length - done : CRC_BYTES; // One part if no checksum
+            result = crc != NULL ? fat_need(fat, physical_address + done, part) : 0;
+            if (crc != NULL && result == 0) {
+                *crc = crc32c(*crc, fat->image + physical_address + done, part);
+            }
+            if (result == 0 && sparse) {
+                result = write_sparse_extent(image_fd, fat, out_fd, physical_address + done, part, existing, &use_copy_range, &use_sendfile);
+            } else if (result == 0) {
+                result = write_extent(image_fd, fat, out_fd, physical_address + done, part, &use_copy_range, &use_sendfile);
+            }
+            if (result < 0) {
+                return -1;
+            }
+        }
+        remaining -= length;
+    }
+    if (sparse && remaining == 0) { // A hole at the end only counts once the file is long enough to hold it
+        struct stat status;
+        off_t position = lseek(out_fd, 0, SEEK_CUR);
+        if (fstat(out_fd, &status) < 0 || (status.st_size < position && ftruncate(out_fd, position) < 0)) {
+            return -1;
+        }
+    }
+    if (remaining == 0) {
+        disk_stats_file(extent_count, fat_clusters_for(fat, size), size);
+    }
+    return remaining == 0 ? 0 : -1; // A short chain means the image is damaged
+}
+
+int disk_copy_out(int image_fd, char *image, fat_table *fat, int out_fd, long size, int start_cluster, uint32_t *crc) {
+    // Resolve a file's chain and copy its content out
+    int extent_count;
+    fat_extent *extents = fat_chain(fat, start_cluster, &extent_count);
+    int result;
+
+    (void)image;
+    if (extents == NULL) {
+        return -1;
+    }
+    result = disk_copy_extents(image_fd, fat, out_fd, size, extents, extent_count, crc);
+    free(extents);
+    return result;
+}
+
+int disk_get(int image_fd, char *image, fat_table *fat, long entry, int out_fd, uint32_t *crc) {
+    // Copy the file described by a directory entry to out_fd, checksumming it on the way if crc is given
+    if (disk_copy_out(image_fd, image, fat, out_fd, dir_entry_size(image, entry), dir_entry_cluster(fat, image, entry), crc) < 0) {
+        return DISK_IO_ERROR;
+    }
+    return DISK_OK;
+}
+
+static void delete_entry(char *image, fat_table *fat, dir_index *index, int dir, long entry) {
+    // Mark an entry deleted, with the long-name entries in front of it
+    long pieces[DIR_LONG_PIECES];
+    int count = dir_long_entries(index, dir, entry, pieces);
+
+    for (int i = 0; i < count; i++) {
+        image[pieces[i]] = (char)0xE5;
+        fat_touch(fat, pieces[i], 1);
+        dir_index_remove(index, dir, pieces[i]);
+    }
+    image[entry] = (char)0xE5;
+    fat_touch(fat, entry, 1);
+    dir_index_remove(index, dir, entry);
+}
+
+int disk_put(char *image, fat_table *fat, dir_index *index, int input_fd, const char *name, int dir, uint32_t *crc, long *entry_out) {
+    // Copy a regular file (mapped, one memcpy per run) or a stream of unknown length into directory dir;
+    // crc, if given, gets the checksum of the input and entry_out the offset of the new entry
+    struct stat input_status;
+    char *input_data = NULL;
+    long entry;
+    int cluster;
+    long size;
+
+    if (!dir_storable_name(name)) {
+        return DISK_BAD_NAME;
+    }
+    if (fstat(input_fd, &input_status) < 0) {
+        return DISK_IO_ERROR;
+    }
+    if (!S_ISREG(input_status.st_mode)) {
+        size = 0;
+        entry = disk_write_entry(image, index, name, 0, 0, time(NULL), dir);
+        if (entry < 0) {
+            return DISK_DIR_FULL;
+        }
+        cluster = disk_write_stream(image, fat, input_fd, &size, crc);
+        if (cluster < 0) {
+            delete_entry(image, fat, index, dir, entry); // Give the reserved entries back
+            return -cluster;
+        }
+        disk_set_location(image, fat, entry, cluster, size); // The size is only known now
+        if (entry_out != NULL) {
+            *entry_out = entry;
+        }
+        return DISK_OK;
+    }
+
+    size = input_status.st_size;
+    if (size > DISK_MAX_FILE_SIZE) {
+        return DISK_TOO_LARGE;
+    }
+    if (fat_count_free(fat) < fat_clusters_for(fat, size)) { // Compare with the bitmap's free count
+        return DISK_NO_SPACE;
+    }
+    if (size > 0) {
+        input_data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, input_fd, 0);
+        if (input_data == MAP_FAILED) {
+            return DISK_IO_ERROR;
+        }
+    }
+
+    entry = disk_write_entry(image, index, name, 0, 0, input_status.st_mtime, dir);
+    cluster = -1;
+    if (entry >= 0) {
+        cluster = disk_write_data(image, fat, input_data, size, input_fd, crc);
+    }
+    if (input_data != NULL) {
+        munmap(input_data, size);
+    }
+    if (entry < 0) {
+        return DISK_DIR_FULL;
+    }
+    if (cluster < 0) {
+        delete_entry(image, fat, index, dir, entry); // Give the reserved entries back
+        return DISK_NO_CLUSTER;
+    }
+    disk_set_location(image, fat, entry, cluster, size);
+    if (entry_out != NULL) {
+        *entry_out = entry;
+    }
+    return DISK_OK;
+}
+
+static void write_clusters(char *image, fat_table *fat, char *dest, long length, const char *data, long size, long *copied,
+                           input_map *holes, uint32_t *crc) {
+    // Copy the next part of the data into a run of clusters; zero clusters landing on zeros are not written
+    long cluster_size = fat->geo.cluster_size;
+
+    for (char *cluster = dest; cluster < dest + length; cluster += cluster_size) {
+        long bytes = size - *copied < cluster_size ? size - *copied : cluster_size;
+        int zero = input_is_hole(holes, *copied, bytes) || disk_is_zero(data + *copied, bytes);
+        if (crc != NULL) {
+            *crc = zero ? crc32c_zeros(*crc, bytes) : crc32c(*crc, data + *copied, bytes);
+        }
+        *copied += bytes;
+        if (!zero) {
+            memcpy(cluster, data + *copied - bytes, bytes);
+            memset(cluster + bytes, 0, cluster_size - bytes); // Clear the slack in the last cluster
+        } else if (!disk_is_zero(cluster, cluster_size)) {
+            memset(cluster, 0, cluster_size);
+        } else {
+            continue; // Already zero, so a sparse image stays sparse
+        }
+        fat_touch(fat, cluster - image, cluster_size);
+    }
+}
+
+static void free_chain(fat_table *fat, int cluster) {
+    // Mark every cluster of a chain free, stopping at anything that is not a data cluster
+    for (int steps = 0; cluster >= 2 && cluster < fat->count && steps < fat->count; steps++) {
+        int next = fat_get(fat, cluster);
+        if (next == FAT_FREE || next == FAT_BAD) {
+            break;
+        }
+        fat_set(fat, cluster, FAT_FREE);
+        cluster = next;
+    }
+}
+
+int disk_write_extents(char *image, fat_table *fat, const fat_extent *extents, int extent_count, const char *data, long size,
+                       int input_fd, uint32_t *crc) {
+    // Copy the data into clusters already reserved, exactly as many as it needs, and link them into a chain
+    long cluster_size = fat->geo.cluster_size;
+    long copied = 0;
+    input_map holes = {input_fd, size, 0, 0};
+
+    for (int i = 0; i < extent_count; i++) {
+        char *dest = image + fat_cluster_offset(fat, extents[i].start);
+        long length = (long)extents[i].length * cluster_size;
+        if (fat_need(fat, dest - image, length) < 0) {
+            return -1;
+        }
+        write_clusters(image, fat, dest, length, data, size, &copied, &holes, crc);
+    }
+    fat_link(fat, extents, extent_count);
+    disk_stats_file(extent_count, fat_clusters_for(fat, size), size);
+    return 0;
+}
+
+void disk_release_extents(fat_table *fat, const fat_extent *extents, int extent_count) {
+    // Give reserved clusters back
+    for (int i = 0; i < extent_count; i++) {
+        for (int c = extents[i].start; c < extents[i].start + extents[i].length; c++) {
+            fat_set(fat, c, FAT_FREE);
+        }
+    }
+}
+
+int disk_write_data(char *image, fat_table *fat, const char *data, long size, int input_fd, uint32_t *crc) {
+    // Allocate contiguous runs, copy the data into them and link the chain
+    int clusters = fat_clusters_for(fat, size);
+    int extent_count;
+    fat_extent *extents;
+
+    if (clusters == 0) {
+        return 0; // Empty files have no start cluster
+    }
+    extents = fat_alloc(fat, clusters, &extent_count);
+    if (extents == NULL) {
+        return -1;
+    }
+    if (disk_write_extents(image, fat, extents, extent_count, data, size, input_fd, crc) < 0) {
+        disk_release_extents(fat, extents, extent_count);
+        free(extents);
+        return -1;
+    }
+    int first = extents[0].start;
+    free(extents);
+    return first;
+}
+
+int disk_write_stream(char *image, fat_table *fat, int input_fd, long *size, uint32_t *crc) {
+    // Read the stream straight into reserved runs, growing the chain as data arrives; returns -code on failure
+    long cluster_size = fat->geo.cluster_size;
+    int run_clusters = STREAM_BYTES / cluster_size > 0 ? STREAM_BYTES / cluster_size : 1;
+    fat_extent *runs = NULL;
+    int run_count = 0, run_capacity = 0;
+    int first = 0, last = 0;
+    long filled = 0; // Bytes used in the newest run
+    long total = 0;
+    int error = DISK_OK;
+
+    for (;;) {
+        if (run_count == 0 || filled == runs[run_count - 1].length * cluster_size) {
+            if (run_count == run_capacity) {
+                run_capacity = run_capacity ? 2 * run_capacity : 8;
+                fat_extent *grown = realloc(runs, run_capacity * sizeof(fat_extent));
+                if (grown == NULL) {
+                    error = DISK_NO_MEMORY;
+                    break;
+                }
+                runs = grown;
+            }
+            int length;
+            int start = fat_alloc_run(fat, run_clusters, &length);
+            if (start < 0) {
+                // Disk is full; fine if the stream happens to end right here
+                char probe;
+                if (read(input_fd, &probe, 1) != 0) {
+                    error = DISK_NO_SPACE;
+                }
+                break;
+            }
+            runs[run_count].start = start;
+            runs[run_count].length = length;
+            run_count++;
+            filled = 0;
+            if (fat_need(fat, fat_cluster_offset(fat, start), length * cluster_size) < 0) {
+                error = DISK_IO_ERROR;
+                break;
+            }
+        }
+
+        fat_extent *run = &runs[run_count - 1];
+        char *dest = image + fat_cluster_offset(fat, run->start);
+        STATS_SYSCALL();
+        ssize_t bytes = read(input_fd, dest + filled, run->length * cluster_size - filled);
+        if (bytes < 0) {
+            error = DISK_IO_ERROR;
+            break;
+        }
+        if (bytes == 0) {
+            break; // End of stream
+        }
+        if (total + bytes > DISK_MAX_FILE_SIZE) {
+            error = DISK_TOO_LARGE;
+            break;
+        }
+        if (crc != NULL) {
+            *crc = crc32c(*crc, dest + filled, bytes);
+        }
+
+        // Link every cluster that received its first byte
+        int from = run->start + (filled + cluster_size - 1) / cluster_size;
+        filled += bytes;
+        total += bytes;
+        int to = run->start + (filled + cluster_size - 1) / cluster_size;
+        for (int c = from; c < to; c++) {
+            if (last != 0) {
+                fat_set(fat, last, c);
+            } else {
+                first = c;
+            }
+            last = c;
+        }
+    }
+
+    // Hand back reserved clusters that never received data, or everything on failure
+    for (int i = 0; i < run_count; i++) {
+        int used = runs[i].length;
+        if (error != DISK_OK) {
+            used = 0;
+        } else if (i == run_count - 1) {
+            used = (filled + cluster_size - 1) / cluster_size;
+        }
+        fat_touch(fat, fat_cluster_offset(fat, runs[i].start), used * cluster_size);
+        for (int c = runs[i].start + used; c < runs[i].start + runs[i].length; c++) {
+            fat_set(fat, c, FAT_FREE);
+        }
+    }
+    free(runs);
+    if (error != DISK_OK) {
+        return -error;
+    }
+    if (last != 0) {
+        fat_set(fat, last, FAT_EOC);
+        long slack = filled % cluster_size;
+        if (slack != 0) {
+            memset(image + fat_cluster_offset(fat, last) + slack, 0, cluster_size - slack);
+        }
+    }
+    disk_stats_file(run_count, fat_clusters_for(fat, total), total);
+    *size = total;
+    return first;
+}
+
+long disk_write_entry(char *image, dir_index *index, const char *file_name, int cluster, long size, time_t modified, int dir) {
+    // Write a directory entry for the new file, after long-name entries if the name does not fit 8.3, and return
+    // its offset, or -1 if the directory is full or no FAT name can hold the name
+    unsigned char name[11];
+    long entry = dir_new_entry(index, dir, file_name, name);
+    if (entry < 0) {
+        return -1;
+    }
+
+    memset(image + entry, 0, DIR_ENTRY_SIZE);
+    memcpy(image + entry, name, 11);
+    fat_touch(index->fat, entry, DIR_ENTRY_SIZE);
+    if (cluster != 0 || size != 0) {
+        disk_set_location(image, index->fat, entry, cluster, size);
+    }
+    disk_set_time(image, index->fat, entry, modified); // Creation date and time hold the last modification time
+
+    dir_index_add(index, dir, entry);
+    return entry;
+}
+
+uint32_t disk_time_fields(time_t modified) {
+    // Creation date (high half) and time (low half) as a directory entry stores them, to the minute
+    struct tm *tm = localtime(&modified);
+
+    int year = tm->tm_year + 1900;
+    int month = tm->tm_mon + 1;
+    int day = tm->tm_mday;
+    int hours = tm->tm_hour;
+    int minutes = tm->tm_min;
+
+    int creation_date = ((year - 1980) << 9) | (month << 5) | day;
+    int creation_time = (hours << 11) | (minutes << 5);
+    return (uint32_t)creation_date << 16 | creation_time;
+}
+
+time_t disk_entry_time(const char *image, long entry) {
+    // Modification time of an entry: its last-write date and time, or the creation ones diskput fills if those are
+    // empty; -1 if it has neither
+    const unsigned char *bytes = (const unsigned char *)image + entry;
+    int date = bytes[24] | bytes[25] << 8;
+    int time = bytes[22] | bytes[23] << 8;
+    struct tm tm;
+
+    if (date == 0) {
+        date = bytes[16] | bytes[17] << 8;
+        time = bytes[14] | bytes[15] << 8;
+    }
+    if (date == 0) {
+        return -1;
+    }
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year = (date >> 9) + 80;
+    tm.tm_mon = ((date >> 5) & 0xF) - 1;
+    tm.tm_mday = date & 0x1F;
+    tm.tm_hour = time >> 11;
+    tm.tm_min = (time >> 5) & 0x3F;
+    tm.tm_sec = (time & 0x1F) * 2;
+    tm.tm_isdst = -1; // Stored as local time, like disk_time_fields writes it
+    return mktime(&tm);
+}
+
+void disk_set_time(char *image, fat_table *fat, long entry, time_t modified) {
+    // Store a modification time in the creation date and time fields of an entry
+    uint32_t fields = disk_time_fields(modified);
+
+    image[entry + 16] = (fields >> 16) & 0xFF;
+    image[entry + 17] = (fields >> 24) & 0xFF;
+    image[entry + 14] = fields & 0xFF;
+    image[entry + 15] = (fields >> 8) & 0xFF;
+    fat_touch(fat, entry + 14, 4);
+}
+
+void disk_set_location(char *image, fat_table *fat, long entry, int cluster, long size) {
+    // Set cluster and size once the commit has written the chain, so the entry never points at a half-written one
+    unsigned char fields[12]; // Bytes 20-31 of the entry
+    memcpy(fields, image + entry + 20, sizeof(fields));
+    fields[0] = (cluster >> 16) & 0xFF; // High half, used on FAT32
+    fields[1] = (cluster >> 24) & 0x0F;
+    fields[6] = cluster & 0xFF;
+    fields[7] = (cluster >> 8) & 0xFF;
+    fields[8] = size & 0xFF;
+    fields[9] = (size >> 8) & 0xFF;
+    fields[10] = (size >> 16) & 0xFF;
+    fields[11] = (size >> 24) & 0xFF;
+    fat_defer(fat, entry + 20, fields, sizeof(fields));
+}
+
+int disk_rewrite_data(char *image, fat_table *fat, int start_cluster, const char *data, long size, int input_fd) {
+    // Write data over an existing chain and free the clusters it no longer needs; returns -code, leaving the chain
+    // alone, if it is too short
+    int needed = fat_clusters_for(fat, size);
+    int extent_count, have = 0;
+    long copied = 0;
+    input_map holes = {input_fd, size, 0, 0};
+    fat_extent *extents = start_cluster >= 2 ? fat_chain(fat, start_cluster, &extent_count) : NULL;
+
+    if (start_cluster >= 2 && extents == NULL) {
+        return -DISK_NO_MEMORY;
+    }
+    for (int i = 0; extents != NULL && i < extent_count; i++) {
+        have += extents[i].length;
+    }
+    if (have < needed) {
+        free(extents);
+        return -DISK_NO_SPACE;
+    }
+    if (needed == 0) {
+        free(extents);
+        free_chain(fat, start_cluster);
+        return 0;
+    }
+
+    int last = 0;
+    for (int i = 0; i < extent_count && needed > 0; i++) {
+        int length = extents[i].length < needed ? extents[i].length : needed;
+        long offset = fat_cluster_offset(fat, extents[i].start);
+        if (fat_need(fat, offset, (long)length * fat->geo.cluster_size) < 0) {
+            free(extents);
+            return -DISK_IO_ERROR;
+        }
+        write_clusters(image, fat, image + offset, (long)length * fat->geo.cluster_size, data, size, &copied, &holes, NULL);
+        last = extents[i].start + length - 1;
+        needed -= length;
+    }
+    free(extents);
+    int rest = fat_get(fat, last);
+    fat_set(fat, last, FAT_EOC);
+    if (rest < FAT_EOC_MIN) {
+        free_chain(fat, rest);
+    }
+    return start_cluster;
+}
+
+int disk_update(char *image, fat_table *fat, long entry, int input_fd) {
+    // Replace a file's data and time with a regular file's, over its old chain if that is long enough
+    struct stat input_status;
+    char *input_data = NULL;
+    int old = dir_entry_cluster(fat, image, entry);
+    int cluster;
+    long size;
+
+    if (fstat(input_fd, &input_status) < 0 || !S_ISREG(input_status.st_mode)) {
+        return DISK_IO_ERROR;
+    }
+    size = input_status.st_size;
+    if (size > DISK_MAX_FILE_SIZE) {
+        return DISK_TOO_LARGE;
+    }
+    if (size > 0) {
+        input_data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, input_fd, 0);
+        if (input_data == MAP_FAILED) {
+            return DISK_IO_ERROR;
+        }
+    }
+
+    cluster = disk_rewrite_data(image, fat, old, input_data, size, input_fd);
+    if (cluster == -DISK_NO_SPACE) { // Chain too short: write a new one, then let the old one go
+        cluster = disk_write_data(image, fat, input_data, size, input_fd, NULL);
+        if (cluster < 0 && old >= 2) { // Only fits once the old chain is free
+            free_chain(fat, old);
+            old = 0;
+            cluster = disk_write_data(image, fat, input_data, size, input_fd, NULL);
+        }
+        if (cluster >= 0) {
+            free_chain(fat, old);
+        } else {
+            cluster = -DISK_NO_SPACE;
+        }
+    }
+    if (input_data != NULL) {
+        munmap(input_data, size);
+    }
+    if (cluster < 0) {
+        if (old == 0) { // The old data is gone; leave an empty file rather than a dangling chain
+            disk_set_location(image, fat, entry, 0, 0);
+        }
+        return -cluster;
+    }
+    disk_set_location(image, fat, entry, cluster, size);
+    disk_set_time(image, fat, entry, input_status.st_mtime);
+    return DISK_OK;
+}
+
+int disk_format_directory(char *image, fat_table *fat, const fat_extent *extents, int extent_count, int parent) {
+    // Clear reserved clusters, link them and start them with "." and ".." so they hold an empty directory
+    long offset = fat_cluster_offset(fat, extents[0].start);
+    int cluster = extents[0].start;
+
+    for (int i = 0; i < extent_count; i++) {
+        long start = fat_cluster_offset(fat, extents[i].start);
+        long length = (long)extents[i].length * fat->geo.cluster_size;
+        if (fat_need(fat, start, length) < 0) {
+            return -1;
+        }
+        memset(image + start, 0, length);
+        fat_touch(fat, start, length);
+    }
+    fat_link(fat, extents, extent_count);
+    memcpy(image + offset, ".          ", 11);
+    memcpy(image + offset + DIR_ENTRY_SIZE, "..         ", 11);
+    for (int i = 0; i < 2; i++) {
+        int target = i == 0 ? cluster : parent; // ".." of a directory in the root holds 0
+        char *dot = image + offset + i * DIR_ENTRY_SIZE;
+        dot[11] = 0x10;
+        dot[20] = (target >> 16) & 0xFF;
+        dot[21] = (target >> 24) & 0x0F;
+        dot[26] = target & 0xFF;
+        dot[27] = (target >> 8) & 0xFF;
+    }
+    return 0;
+}
+
+int disk_make_directory(char *image, fat_table *fat, dir_index *index, const char *name, int parent, time_t modified) {
+    // Create an empty subdirectory with "." and ".." and return its cluster, or -code
+    fat_extent extent;
+    long entry;
+
+    if (!dir_storable_name(name)) {
+        return -DISK_BAD_NAME;
+    }
+    extent.start = fat_alloc_run(fat, 1, &extent.length);
+    if (extent.start < 0) {
+        return -DISK_NO_SPACE;
+    }
+    if (disk_format_directory(image, fat, &extent, 1, parent) < 0) {
+        fat_set(fat, extent.start, FAT_FREE);
+        return -DISK_IO_ERROR;
+    }
+    int cluster = extent.start;
+
+    entry = disk_write_entry(image, index, name, 0, 0, modified, parent);
+    if (entry < 0) {
+        fat_set(fat, cluster, FAT_FREE);
+        return -DISK_DIR_FULL;
+    }
+    image[entry + 11] = 0x10;
+    disk_set_location(image, fat, entry, cluster, 0); // Set at the commit, once the new cluster is on disk
+    return cluster;
+}
+
+static void release_chain(fat_table *fat, int cluster, disk_batch *batch) {
+    // Free a chain now, or mark it to be freed with the rest of the batch
+    if (batch != NULL) {
+        fat_mark_chain(fat, cluster, batch->clusters);
+    } else {
+        free_chain(fat, cluster);
+    }
+}
+
+int disk_batch_init(disk_batch *batch, const fat_table *fat, int zero) {
+    // Start an empty batch of clusters to free
+    batch->clusters = calloc((fat->count + 63) / 64, sizeof(uint64_t));
+    batch->zero = zero;
+    return batch->clusters != NULL ? 0 : -1;
+}
+
+int disk_batch_free(char *image, fat_table *fat, disk_batch *batch) {
+    // Free every cluster of the batch in one pass over the FAT, zeroing them first if asked; returns how many were
+    // freed, or -1 if some could not be read to be zeroed (they are freed all the same)
+    long cluster_size = fat->geo.cluster_size;
+    int unread = 0;
+    int freed;
+
+    for (int c = 2; batch->zero && c < fat->count;) {
+        if (batch->clusters[c / 64] == 0) { // Skip 64 clusters at a time
+            c = (c / 64 + 1) * 64;
+            continue;
+        }
+        if ((batch->clusters[c / 64] >> (c % 64) & 1) == 0) {
+            c++;
+            continue;
+        }
+        int end = c + 1;
+        while (end < fat->count && (batch->clusters[end / 64] >> (end % 64) & 1) != 0) {
+            end++;
+        }
+        long offset = fat_cluster_offset(fat, c);
+        long length = (end - c) * cluster_size;
+        if (fat_need(fat, offset, length) < 0) {
+            unread = 1;
+        } else if (!disk_is_zero(image + offset, length)) { // Zeros already there stay a hole
+            memset(image + offset, 0, length);
+            fat_touch(fat, offset, length);
+        }
+        c = end;
+    }
+    freed = fat_free_marked(fat, batch->clusters);
+    free(batch->clusters);
+    batch->clusters = NULL;
+    return unread ? -1 : freed;
+}
+
+static int remove_tree(char *image, fat_table *fat, dir_index *index, int dir, int depth, disk_batch *batch, int *files,
+                       int *directories) {
+    // Delete every entry of a directory, and of the directories below it, adding up the files and directories deleted
+    int range_count;
+    int result = 0;
+    dir_range *ranges;
+
+    if (depth > DISK_MAX_DEPTH) { // A directory loop in a damaged image
+        return -1;
+    }
+    ranges = dir_ranges(fat, dir, &range_count);
+    if (ranges == NULL) {
+        return -1;
+    }
+    for (int r = 0; r < range_count && result == 0; r++) {
+        for (long entry = ranges[r].offset; entry < ranges[r].offset + ranges[r].length; entry += DIR_ENTRY_SIZE) {
+            unsigned char first = image[entry];
+            if (first == 0x00) {
+                r = range_count;
+                break;
+            }
+            if (first == 0xE5 || first == '.' || image[entry + 11] == 0x0F || (image[entry + 11] & 0x08) != 0) {
+                continue;
+            }
+            if ((image[entry + 11] & 0x10) != 0) {
+                result = remove_tree(image, fat, index, dir_entry_cluster(fat, image, entry), depth + 1, batch, files, directories);
+                if (result < 0) {
+                    break;
+                }
+                (*directories)++;
+            } else {
+                (*files)++;
+            }
+            release_chain(fat, dir_entry_cluster(fat, image, entry), batch);
+            delete_entry(image, fat, index, dir, entry);
+        }
+    }
+    free(ranges);
+    return result;
+}
+
+int disk_remove(char *image, fat_table *fat, dir_index *index, int dir, long entry, disk_batch *batch, int *files,
+                int *directories) {
+    // Delete a file, or a directory with everything in it; the entries go out with the data, before the FAT frees
+    // anything. With a batch the clusters are only marked, and disk_batch_free frees them. files and directories,
+    // unless NULL, are increased by how many of each were deleted, this entry included
+    int file_count = 0, directory_count = 0;
+
+    if ((image[entry + 11] & 0x10) != 0) {
+        int cluster = dir_entry_cluster(fat, image, entry);
+        if (cluster >= 2 && remove_tree(image, fat, index, cluster, 0, batch, &file_count, &directory_count) < 0) {
+            return DISK_BAD_IMAGE;
+        }
+        directory_count++;
+    } else {
+        file_count++;
+    }
+    release_chain(fat, dir_entry_cluster(fat, image, entry), batch);
+    delete_entry(image, fat, index, dir, entry);
+    if (files != NULL) {
+        *files += file_count;
+    }
+    if (directories != NULL) {
+        *directories += directory_count;
+    }
+    return DISK_OK;
+}
+
+int disk_truncate(char *image, fat_table *fat, long entry, long size, disk_batch *batch) {
+    // Shorten a file to size bytes, cutting its chain after the clusters that still hold data
+    int start = dir_entry_cluster(fat, image, entry);
+    int keep = fat_clusters_for(fat, size);
+    int last = start;
+
+    if (size > dir_entry_size(image, entry)) {
+        return DISK_CANNOT_GROW;
+    }
+    if (keep > 0 && (start < 2 || start >= fat->count)) { // Data but no chain: nothing to cut, and the reserved entries are not ours
+        return DISK_BAD_IMAGE;
+    }
+    for (int i = 1; i < keep; i++) {
+        last = fat_get(fat, last);
+        if (last < 2 || last >= fat->count) { // The chain is shorter than the size says
+            return DISK_BAD_IMAGE;
+        }
+    }
+    if (keep == 0) {
+        release_chain(fat, start, batch);
+        start = 0;
+    } else {
+        int rest = fat_get(fat, last);
+        if (rest < 2 || (rest >= fat->count && rest < FAT_EOC_MIN)) { // Free, bad or out of range: a damaged chain
+            return DISK_BAD_IMAGE;
+        }
+        if (rest < FAT_EOC_MIN) {
+            release_chain(fat, rest, batch);
+        }
+        fat_set(fat, last, FAT_EOC);
+        long slack = size % fat->geo.cluster_size;
+        long offset = fat_cluster_offset(fat, last) + slack;
+        if (batch != NULL && batch->zero && slack != 0 && fat_need(fat, offset, fat->geo.cluster_size - slack) == 0) {
+            memset(image + offset, 0, fat->geo.cluster_size - slack); // The cut-off bytes of the last cluster
+            fat_touch(fat, offset, fat->geo.cluster_size - slack);
+        }
+    }
+    disk_set_location(image, fat, entry, start, size);
+    disk_set_time(image, fat, entry, time(NULL));
+    return DISK_OK;
+}
@@ -0,0 +1,76 @@
+#ifndef DISKOPS_H
+#define DISKOPS_H
+
+#include <stdint.h>
+#include <time.h>
+#include "fat12.h"
+#include "dirindex.h"
+
+// Result codes shared by the tools and the image server; disk_message gives the text
+#define DISK_OK 0
+#define DISK_NOT_FOUND 1
+#define DISK_DIR_NOT_FOUND 2
+#define DISK_DIR_FULL 3
+#define DISK_NO_SPACE 4
+#define DISK_TOO_LARGE 5
+#define DISK_NO_CLUSTER 6
+#define DISK_IO_ERROR 7
+#define DISK_NO_MEMORY 8
+#define DISK_BAD_IMAGE 9
+#define DISK_BAD_REQUEST 10
+#define DISK_BAD_NAME 11
+#define DISK_CANNOT_GROW 12
+
+// Listing formats of disk_list
+#define DISK_LIST_TEXT 0 // Human-readable listing, one block per directory
+#define DISK_LIST_JSON 1 // JSON array with one object per entry
+#define DISK_LIST_NUL 2  // Tab-separated records, each terminated by a NUL byte
+#define DISK_LIST_CRC 3  // Checksum manifest: "<path> <crc32c>" for every file, one per line
+
+#define DISK_MAX_FILE_SIZE 0xFFFFFFFFL // Largest size a directory entry can hold
+#define DISK_MAX_DEPTH 256             // Deepest directory nesting walked recursively
+
+// Clusters of deleted or truncated files, freed together by disk_batch_free
+typedef struct {
+    uint64_t *clusters; // One bit per cluster to free
+    int zero;           // Overwrite freed clusters, and the cut-off end of truncated files, with zeros
+} disk_batch;
+
+const char *disk_message(int code);
+
+// Whole operations, writing their output to a file descriptor
+int disk_info(char *image, long image_size, fat_table *fat, int out_fd);
+int disk_list(char *image, fat_table *fat, int mode, int out_fd);
+int disk_get(int image_fd, char *image, fat_table *fat, long entry, int out_fd, uint32_t *crc);
+int disk_put(char *image, fat_table *fat, dir_index *index, int input_fd, const char *name, int dir, uint32_t *crc, long *entry);
+
+// Building blocks of the operations above
+int disk_is_zero(const void *bytes, long length);
+char *disk_label(char *image, fat_table *fat, char *label);
+int disk_count_files(char *image, fat_table *fat, int dir);
+int disk_checksum(fat_table *fat, int start_cluster, long size, uint32_t *crc);
+int disk_copy_extents(int image_fd, fat_table *fat, int out_fd, long size, const fat_extent *extents, int extent_count, uint32_t *crc);
+int disk_copy_out(int image_fd, char *image, fat_table *fat, int out_fd, long size, int start_cluster, uint32_t *crc);
+int disk_write_extents(char *image, fat_table *fat, const fat_extent *extents, int extent_count, const char *data, long size,
+                       int input_fd, uint32_t *crc);
+void disk_release_extents(fat_table *fat, const fat_extent *extents, int extent_count);
+int disk_write_data(char *image, fat_table *fat, const char *data, long size, int input_fd, uint32_t *crc);
+int disk_write_stream(char *image, fat_table *fat, int input_fd, long *size, uint32_t *crc);
+long disk_write_entry(char *image, dir_index *index, const char *file_name, int cluster, long size, time_t modified, int dir);
+void disk_set_location(char *image, fat_table *fat, long entry, int cluster, long size);
+uint32_t disk_time_fields(time_t modified);
+time_t disk_entry_time(const char *image, long entry);
+void disk_set_time(char *image, fat_table *fat, long entry, time_t modified);
+
+// Changing files already in the image
+int disk_rewrite_data(char *image, fat_table *fat, int start_cluster, const char *data, long size, int input_fd);
+int disk_update(char *image, fat_table *fat, long entry, int input_fd);
+int disk_format_directory(char *image, fat_table *fat, const fat_extent *extents, int extent_count, int parent);
+int disk_make_directory(char *image, fat_table *fat, dir_index *index, const char *name, int parent, time_t modified);
+int disk_remove(char *image, fat_table *fat, dir_index *index, int dir, long entry, disk_batch *batch, int *files,
+                int *directories);
+int disk_truncate(char *image, fat_table *fat, long entry, long size, disk_batch *batch);
+int disk_batch_init(disk_batch *batch, const fat_table *fat, int zero);
+int disk_batch_free(char *image, fat_table *fat, disk_batch *batch);
+
+#endif
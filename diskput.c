@@ -2,6 +2,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <dirent.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -9,240 +10,601 @@
 #include <unistd.h>
 #include <ctype.h>
 #include <time.h>
+#include "fat12.h"
+#include "dirindex.h"
+#include "manifest.h"
+#include "diskops.h"
+#include "diskimage.h"
+#include "diskclient.h"
+#include "diskstats.h"
 
-#define ROOT_DIR_OFFSET 0x2600
-#define ROOT_DIR_SIZE 0x2000 // Size of the root directory (0x4200 - 0x2600)
-#define SECTOR_SIZE 512
-#define FAT_OFFSET 0x200
-#define DATA_OFFSET 0x4200
+// File written with --verify, read back through its entry once the batch is committed
+typedef struct {
+    char *name;
+    long entry;
+    uint32_t crc; // Checksum of the input, taken while it was copied
+} put_check;
+
+// Files of the batch waiting to be verified
+typedef struct {
+    put_check *items;
+    int count, size;
+} put_checks;
+
+// File or directory of a host tree found by put_tree's scan, in breadth-first order
+typedef struct {
+    char *path;
+    char *name;      // Last component of path
+    int parent;      // Node of the directory it goes into, -1 for the target directory
+    int is_directory;
+    int depth;
+    long size;
+    time_t modified;
+    int clusters;    // Data clusters, or for a directory enough clusters for all its entries
+    int cluster;     // First cluster once written; -1 if it was skipped or failed
+} put_node;
+
+// Clusters reserved for a whole tree, handed out in order
+typedef struct {
+    fat_extent *runs;
+    int count;
+    int at;          // Run being handed out
+    int used;        // Clusters of that run already handed out
+} put_region;
 
 // 函数原型声明
-int fat_convert(char *image, int fat_index);
-int find_empty_cluster(char *image);
-void write_fat_entry(char *image, int cluster, int value);
-void write_directory_entry(char *image, char *file_name, int cluster, int size, int dir_offset);
-int find_directory(char *image, char *path, int dir_offset);
-int check_free_space(char *image, int file_size);
+int put_file(char *image, fat_table *fat, dir_index *index, char *host_path, int dir, put_checks *checks);
+int put_stream(char *image, fat_table *fat, dir_index *index, int input_fd, char *name, int dir, put_checks *checks);
+int put_remote(char *image_path, char *host_path, char *name, char *dir_path);
+void put_remember(put_checks *checks, const char *name, long entry, uint32_t crc);
+int put_tree(char *image, fat_table *fat, dir_index *index, const char *host_path, int dir, put_checks *checks);
+int put_verify(char *image, fat_table *fat, put_checks *checks);
 
 int main(int argc, char *argv[]) {
     // Main function to write a file into the disk image
-    int file_descriptor, input_file_descriptor;
-    struct stat file_status;
+    disk_image image;
+    int batch = 0;
+    int recursive = 0;
+    char *manifest_path = NULL;
+    put_checks checks = {NULL, 0, 0};
+    put_checks *verify = NULL;
 
-    if (argc != 3 && argc != 4) {
-        printf("Usage: %s <disk image> <filename> [<path>]\n", argv[0]);
+    disk_stats_init(&argc, argv, "diskput");
+    if (argc > 1 && strcmp(argv[1], "--verify") == 0) { // Checksum while copying, then read each file back
+        verify = &checks;
+        argv++;
+        argc--;
+    }
+    if (argc > 1 && strcmp(argv[1], "-b") == 0) { // Several host files after the image
+        batch = 1;
+        argv++;
+        argc--;
+    } else if (argc > 1 && strcmp(argv[1], "-r") == 0) { // A whole host directory tree
+        recursive = 1;
+        argv++;
+        argc--;
+    } else if (argc > 2 && strcmp(argv[1], "-m") == 0) { // Files and paths listed in a manifest
+        manifest_path = argv[2];
+        argv += 2;
+        argc -= 2;
+    }
+
+    int streaming = !batch && !recursive && manifest_path == NULL && argc > 2 && strcmp(argv[2], "-") == 0;
+    int path_arg = streaming ? 4 : 3;
+    int usage_ok;
+    if (batch) {
+        usage_ok = argc >= 3;
+    } else if (recursive) {
+        usage_ok = argc == 3 || argc == 4;
+    } else if (manifest_path != NULL) {
+        usage_ok = argc == 2;
+    } else {
+        usage_ok = argc == path_arg || argc == path_arg + 1;
+    }
+    if (!usage_ok) {
+        printf("Usage: diskput [--verify] <disk image> <filename> [<path>]\n");
+        printf("       (every form also takes --stats or --stats=json, or see $FATTOOLS_TRACE)\n");
+        printf("       diskput [--verify] <disk image> - <name> [<path>]   (read the file from stdin)\n");
+        printf("       diskput [--verify] -b <disk image> <filename>...\n");
+        printf("       diskput [--verify] -m <manifest> <disk image>       (lines of \"<filename> [<path>]\")\n");
+        printf("       diskput [--verify] -r <disk image> <host directory> [<path>]\n");
         return 1;
     }
 
-    file_descriptor = open(argv[1], O_RDWR); // Open the disk image
-    if (file_descriptor < 0) {
+    if (verify == NULL && !recursive && disk_client_connect() >= 0) { // A server has the image loaded already; it resolves each path itself
+        int result = 0;
+        if (manifest_path != NULL) {
+            FILE *manifest = strcmp(manifest_path, "-") == 0 ? stdin : fopen(manifest_path, "r");
+            char line[MANIFEST_LINE];
+            char *fields[2];
+            int count;
+            if (manifest == NULL) {
+                perror("Error opening manifest");
+                return 1;
+            }
+            while ((count = manifest_next(manifest, line, fields, 2)) > 0) {
+                result |= put_remote(argv[1], fields[0], NULL, count > 1 ? fields[1] : NULL);
+            }
+            if (manifest != stdin) {
+                fclose(manifest);
+            }
+        } else if (batch) {
+            for (int i = 2; i < argc; i++) {
+                result |= put_remote(argv[1], argv[i], NULL, NULL);
+            }
+        } else {
+            result = put_remote(argv[1], streaming ? NULL : argv[2], streaming ? argv[3] : NULL,
+                                argc == path_arg + 1 ? argv[path_arg] : NULL);
+        }
+        return result;
+    }
+
+    if (disk_image_open(&image, argv[1], IMAGE_WRITE | IMAGE_SEQUENTIAL) < 0) { // Open the disk image
         perror("Error opening disk image");
         return 1;
     }
+    char *mapped_image = image.data;
 
-    if (fstat(file_descriptor, &file_status) < 0) {
-        perror("Error getting file status");
-        close(file_descriptor);
+    fat_table fat;
+    disk_stats_phase(STATS_FAT);
+    if (fat_load(&fat, mapped_image, image.size) < 0) {
+        printf("Error: failed to read FAT\n");
+        disk_image_close(&image);
         return 1;
     }
+    disk_image_attach(&image, &fat);
 
-    char *mapped_image = mmap(NULL, file_status.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, file_descriptor, 0);
-    if (mapped_image == MAP_FAILED) {
-        perror("Error mapping memory");
-        close(file_descriptor);
+    dir_index index; // Shared by every file of a batch
+    disk_stats_phase(STATS_DIRECTORY);
+    if (dir_index_init(&index, mapped_image, &fat) < 0) {
+        printf("Error: out of memory\n");
+        fat_release(&fat);
+        disk_image_close(&image);
         return 1;
     }
 
-    input_file_descriptor = open(argv[2], O_RDONLY);
+    int result = 0;
+    if (manifest_path != NULL) {
+        FILE *manifest = strcmp(manifest_path, "-") == 0 ? stdin : fopen(manifest_path, "r");
+        char line[MANIFEST_LINE];
+        char *fields[2];
+        int count;
+        if (manifest == NULL) {
+            perror("Error opening manifest");
+            result = 1;
+        }
+        while (manifest != NULL && (count = manifest_next(manifest, line, fields, 2)) > 0) {
+            disk_stats_phase(STATS_DIRECTORY);
+            int dir = dir_find_directory(&index, count > 1 ? fields[1] : NULL);
+            if (dir < 0) {
+                printf("The directory not found.\n");
+                result = 1;
+                continue;
+            }
+            result |= put_file(mapped_image, &fat, &index, fields[0], dir, verify);
+        }
+        if (manifest != NULL && manifest != stdin) {
+            fclose(manifest);
+        }
+    } else if (batch) {
+        for (int i = 2; i < argc; i++) {
+            result |= put_file(mapped_image, &fat, &index, argv[i], DIR_ROOT, verify);
+        }
+    } else if (recursive) {
+        int dir = dir_find_directory(&index, argc == 4 ? argv[3] : NULL);
+        if (dir < 0) {
+            printf("The directory not found.\n");
+            result = 1;
+        } else {
+            result = put_tree(mapped_image, &fat, &index, argv[2], dir, verify);
+        }
+    } else {
+        // Determine the target directory
+        int dir = dir_find_directory(&index, argc == path_arg + 1 ? argv[path_arg] : NULL);
+        if (dir < 0) {
+            printf("The directory not found.\n");
+            result = 1;
+        } else if (streaming) {
+            result = put_stream(mapped_image, &fat, &index, STDIN_FILENO, argv[3], dir, verify);
+        } else {
+            result = put_file(mapped_image, &fat, &index, argv[2], dir, verify);
+        }
+    }
+
+    // Failed files have already given their clusters back, so one commit covers the batch
+    disk_stats_phase(STATS_FLUSH);
+    if (fat_commit(&fat) < 0) {
+        perror("Error syncing disk image");
+        result = 1;
+    } else if (verify != NULL) {
+        result |= put_verify(mapped_image, &fat, verify);
+    }
+    for (int i = 0; i < checks.count; i++) {
+        free(checks.items[i].name);
+    }
+    free(checks.items);
+    dir_index_release(&index);
+    fat_release(&fat);
+    disk_image_close(&image);
+    return result;
+}
+
+void put_remember(put_checks *checks, const char *name, long entry, uint32_t crc) {
+    // Note a written file for put_verify; a file that cannot be noted is simply not checked
+    if (checks->count == checks->size) {
+        int size = checks->size > 0 ? 2 * checks->size : 16;
+        put_check *grown = realloc(checks->items, size * sizeof(put_check));
+        if (grown == NULL) {
+            return;
+        }
+        checks->items = grown;
+        checks->size = size;
+    }
+    checks->items[checks->count].name = strdup(name);
+    if (checks->items[checks->count].name != NULL) {
+        checks->items[checks->count].entry = entry;
+        checks->items[checks->count].crc = crc;
+        checks->count++;
+    }
+}
+
+int put_verify(char *image, fat_table *fat, put_checks *checks) {
+    // Read every committed file back through its entry and chain and compare it with the input's checksum
+    int result = 0;
+    for (int i = 0; i < checks->count; i++) {
+        put_check *check = &checks->items[i];
+        uint32_t crc = 0;
+        if (disk_checksum(fat, dir_entry_cluster(fat, image, check->entry), dir_entry_size(image, check->entry), &crc) < 0 ||
+            crc != check->crc) {
+            printf("Error: %s does not match the input after writing\n", check->name);
+            result = 1;
+        } else {
+            printf("%s %08x\n", check->name, crc);
+        }
+    }
+    return result;
+}
+
+int put_file(char *image, fat_table *fat, dir_index *index, char *host_path, int dir, put_checks *checks) {
+    // Copy one host file into the directory starting at cluster dir
+    int input_file_descriptor = open(host_path, O_RDONLY);
     if (input_file_descriptor < 0) {
         perror("Error opening input file");
-        munmap(mapped_image, file_status.st_size);
-        close(file_descriptor);
         printf("File not found.\n");
         return 1;
     }
 
-    struct stat input_file_status;
-    if (fstat(input_file_descriptor, &input_file_status) < 0) {
-        perror("Error getting input file status");
-        close(input_file_descriptor);
-        munmap(mapped_image, file_status.st_size);
-        close(file_descriptor);
+    char *base_name = strrchr(host_path, '/') != NULL ? strrchr(host_path, '/') + 1 : host_path;
+    disk_stats_phase(STATS_COPY); // Adding the entry is part of it
+    uint32_t crc = 0;
+    long entry;
+    int result = disk_put(image, fat, index, input_file_descriptor, base_name, dir, checks != NULL ? &crc : NULL, &entry);
+    close(input_file_descriptor);
+    if (result != DISK_OK) {
+        printf("%s\n", disk_message(result));
         return 1;
     }
+    if (checks != NULL) {
+        put_remember(checks, host_path, entry, crc);
+    }
+    return 0;
+}
 
-    // Check if there is enough free space
-    if (!check_free_space(mapped_image, input_file_status.st_size)) {
-        printf("No enough free space in the disk image.\n");
-        close(input_file_descriptor);
-        munmap(mapped_image, file_status.st_size);
-        close(file_descriptor);
+int put_stream(char *image, fat_table *fat, dir_index *index, int input_fd, char *name, int dir, put_checks *checks) {
+    // Copy data of unknown length from a pipe or stdin into the directory starting at cluster dir
+    uint32_t crc = 0;
+    disk_stats_phase(STATS_COPY);
+    long entry;
+    int result = disk_put(image, fat, index, input_fd, name, dir, checks != NULL ? &crc : NULL, &entry);
+    if (result != DISK_OK) {
+        printf("%s\n", disk_message(result));
         return 1;
     }
+    if (checks != NULL) {
+        put_remember(checks, name, entry, crc);
+    }
+    return 0;
+}
 
-    // Determine the target directory
-    int dir_offset = ROOT_DIR_OFFSET;
-    if (argc == 4) {
-        dir_offset = find_directory(mapped_image, argv[3], ROOT_DIR_OFFSET);
-        if (dir_offset < 0) {
-            printf("The directory not found.\n");
-            close(input_file_descriptor);
-            munmap(mapped_image, file_status.st_size);
-            close(file_descriptor);
+int put_remote(char *image_path, char *host_path, char *name, char *dir_path) {
+    // Send one host file (or stdin when host_path is NULL) to the image server
+    int input_file_descriptor = STDIN_FILENO;
+    disk_stats_phase(STATS_COPY); // The server does all of it
+    if (host_path != NULL) {
+        input_file_descriptor = open(host_path, O_RDONLY);
+        if (input_file_descriptor < 0) {
+            perror("Error opening input file");
+            printf("File not found.\n");
             return 1;
         }
+        name = strrchr(host_path, '/') != NULL ? strrchr(host_path, '/') + 1 : host_path;
     }
 
-    int cluster = find_empty_cluster(mapped_image);
-    if (cluster < 0) {
-        printf("No empty cluster found\n");
+    int result = disk_client_request(DISKD_PUT, 0, image_path, name, dir_path, input_file_descriptor);
+    if (host_path != NULL) {
         close(input_file_descriptor);
-        munmap(mapped_image, file_status.st_size);
-        close(file_descriptor);
-        return 1;
     }
-
-    // Write file data to the data area
-    char buffer[SECTOR_SIZE];
-    int bytes_read, sector = 0;
-    while ((bytes_read = read(input_file_descriptor, buffer, SECTOR_SIZE)) > 0) {
-        memcpy(mapped_image + DATA_OFFSET + (cluster - 2) * SECTOR_SIZE + sector * SECTOR_SIZE, buffer, bytes_read);
-        sector++;
+    if (result != DISK_OK) {
+        printf("%s\n", disk_message(result));
+        return 1;
     }
-
-    // Update FAT table
-    write_fat_entry(mapped_image, cluster, 0xFFF); // Mark as end of file
-
-    // Update directory entry
-    write_directory_entry(mapped_image, argv[2], cluster, input_file_status.st_size, dir_offset);
-
-    close(input_file_descriptor);
-    munmap(mapped_image, file_status.st_size);
-    close(file_descriptor);
     return 0;
 }
 
-int fat_convert(char *image, int fat_index) {
-    // Convert FAT12 entry to actual cluster value
-    int lower_bits, upper_bits, entry_value;
+static int put_compare(const void *a, const void *b) {
+    // Order the entries of one host directory by name, ignoring case as image lookups do
+    return dir_name_compare(((const put_node *)a)->name, ((const put_node *)b)->name);
+}
 
-    if (fat_index % 2 == 0) {
-        lower_bits = image[512 + 1 + 3 * fat_index / 2] & 0x0F; // Lower 4 bits
-        entry_value = (lower_bits << 8) + (image[512 + 3 * fat_index / 2] & 0xFF);
-    } else {
-        upper_bits = image[512 + 3 * fat_index / 2] & 0xF0; // Upper 4 bits
-        entry_value = (upper_bits >> 4) + ((image[512 + 1 + 3 * fat_index / 2] & 0xFF) << 4);
+static int put_scan(put_node **nodes, int *count, int *size, int parent, const char *path, int depth, dir_index *index, int dir) {
+    // Add the storable files and directories of one host directory to the node list, sorted by name; returns the
+    // directory entries they take, or -1 if out of memory
+    DIR *host = opendir(path);
+    struct dirent *item;
+    int first = *count;
+    int slots = 0;
+
+    if (host == NULL) {
+        perror(path);
+        return 0;
     }
-    return entry_value;
-}
+    while ((item = readdir(host)) != NULL) {
+        put_node node;
+        struct stat status;
+        if (strcmp(item->d_name, ".") == 0 || strcmp(item->d_name, "..") == 0) {
+            continue;
+        }
+        if (!dir_storable_name(item->d_name)) {
+            printf("Skipping %s/%s: %s\n", path, item->d_name, disk_message(DISK_BAD_NAME));
+            continue;
+        }
+        if (parent < 0 && dir_lookup_name(index, dir, item->d_name) >= 0) { // New directories start out empty
+            printf("Skipping %s/%s: already in the image\n", path, item->d_name);
+            continue;
+        }
+        node.path = malloc(strlen(path) + strlen(item->d_name) + 2);
+        if (node.path == NULL) {
+            closedir(host);
+            return -1;
+        }
+        sprintf(node.path, "%s/%s", path, item->d_name);
+        if (stat(node.path, &status) < 0 || (!S_ISREG(status.st_mode) && !S_ISDIR(status.st_mode))) {
+            printf("Skipping %s: not a regular file or directory\n", node.path);
+            free(node.path);
+            continue;
+        }
+        if (S_ISREG(status.st_mode) && status.st_size > DISK_MAX_FILE_SIZE) {
+            printf("Skipping %s: %s\n", node.path, disk_message(DISK_TOO_LARGE));
+            free(node.path);
+            continue;
+        }
+        node.name = node.path + strlen(path) + 1;
+        node.parent = parent;
+        node.is_directory = S_ISDIR(status.st_mode);
+        node.depth = depth;
+        node.size = node.is_directory ? 0 : status.st_size;
+        node.modified = status.st_mtime;
+        node.clusters = fat_clusters_for(index->fat, node.size); // Directories get theirs once they are scanned
+        node.cluster = -1;
+        if (*count == *size) {
+            put_node *grown = realloc(*nodes, 2 * *size * sizeof(put_node));
+            if (grown == NULL) {
+                free(node.path);
+                closedir(host);
+                return -1;
+            }
+            *nodes = grown;
+            *size *= 2;
+        }
+        (*nodes)[(*count)++] = node;
+    }
+    closedir(host);
 
-int find_empty_cluster(char *image) {
-    // Find an empty cluster in the FAT table
-    for (int i = 2; i < 2849; i++) { // FAT12 has 2849 clusters
-        int entry = fat_convert(image, i);
-        if (entry == 0x000) {
-            return i;
+    qsort(*nodes + first, *count - first, sizeof(put_node), put_compare);
+    for (int i = first; i < *count; i++) {
+        put_node *node = &(*nodes)[i];
+        if (i > first && put_compare(node, node - 1) == 0) { // Two host names that differ only in case: keep the first
+            printf("Skipping %s: same name as %s apart from case\n", node->path, (node - 1)->name);
+            free(node->path);
+            memmove(node, node + 1, (*count - i - 1) * sizeof(put_node));
+            (*count)--;
+            i--;
+            continue;
         }
+        slots += dir_name_slots(node->name);
     }
-    return -1; // No empty cluster found
+    return slots;
 }
 
-void write_fat_entry(char *image, int cluster, int value) {
-    // Write a value into the FAT table for the given cluster
-    if (cluster % 2 == 0) {
-        image[FAT_OFFSET + 1 + 3 * cluster / 2] = (value >> 8) & 0x0F;
-        image[FAT_OFFSET + 3 * cluster / 2] = value & 0xFF;
-    } else {
-        image[FAT_OFFSET + 3 * cluster / 2] = (value << 4) & 0xF0;
-        image[FAT_OFFSET + 1 + 3 * cluster / 2] = (value >> 4) & 0xFF;
+static fat_extent *put_take(put_region *region, int clusters, int *extent_count) {
+    // Hand out the next clusters of the reserved region, as one extent unless the region itself is split
+    fat_extent *extents = malloc((region->count - region->at) * sizeof(fat_extent));
+    int n = 0;
+
+    *extent_count = 0;
+    if (extents == NULL) {
+        return NULL;
     }
+    while (clusters > 0) {
+        int left = region->runs[region->at].length - region->used;
+        int length = clusters < left ? clusters : left;
+        extents[n].start = region->runs[region->at].start + region->used;
+        extents[n].length = length;
+        n++;
+        clusters -= length;
+        region->used += length;
+        if (region->used == region->runs[region->at].length) {
+            region->at++;
+            region->used = 0;
+        }
+    }
+    *extent_count = n;
+    return extents;
 }
 
-void write_directory_entry(char *image, char *file_name, int cluster, int size, int dir_offset) {
-    // Write a directory entry for the new file
-    for (int i = 0; i < ROOT_DIR_SIZE; i += 32) {
-        if (image[dir_offset + i] == 0x00 || image[dir_offset + i] == 0xE5) {
-            // Process file name and extension
-            char name[8] = "        ";
-            char ext[3] = "   ";
-            char *dot = strrchr(file_name, '.');
-            if (dot != NULL) {
-                strncpy(name, file_name, dot - file_name);
-                strncpy(ext, dot + 1, 3);
-            } else {
-                strncpy(name, file_name, 8);
-            }
-            for (int j = 0; j < 8; j++) name[j] = toupper(name[j]);
-            for (int j = 0; j < 3; j++) ext[j] = toupper(ext[j]);
-
-            memcpy(image + dir_offset + i, name, 8);
-            memcpy(image + dir_offset + i + 8, ext, 3);
+static int put_tree_file(char *image, fat_table *fat, dir_index *index, put_node *node, int dir, fat_extent *extents,
+                         int extent_count, put_checks *checks) {
+    // Write one file of the tree into its reserved clusters and add its entry; returns 0 or a DISK_ code
+    struct stat status;
+    char *data = NULL;
+    uint32_t crc = 0;
+    long entry;
+    int fd = open(node->path, O_RDONLY);
 
-            // Set cluster and size
-            image[dir_offset + i + 26] = cluster & 0xFF;
-            image[dir_offset + i + 27] = (cluster >> 8) & 0xFF;
-            image[dir_offset + i + 28] = size & 0xFF;
-            image[dir_offset + i + 29] = (size >> 8) & 0xFF;
-            image[dir_offset + i + 30] = (size >> 16) & 0xFF;
-            image[dir_offset + i + 31] = (size >> 24) & 0xFF;
+    if (fd < 0) {
+        return DISK_NOT_FOUND;
+    }
+    if (fstat(fd, &status) < 0 || status.st_size != node->size) { // Changed since the scan sized its clusters
+        close(fd);
+        return DISK_IO_ERROR;
+    }
+    if (node->size > 0) {
+        data = mmap(NULL, node->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            return DISK_IO_ERROR;
+        }
+        madvise(data, node->size, MADV_SEQUENTIAL);
+    }
+    int failed = extent_count > 0 &&
+                 disk_write_extents(image, fat, extents, extent_count, data, node->size, fd, checks != NULL ? &crc : NULL) < 0;
+    if (data != NULL) {
+        munmap(data, node->size);
+    }
+    close(fd);
+    if (failed) {
+        return DISK_IO_ERROR;
+    }
+    entry = disk_write_entry(image, index, node->name, 0, 0, node->modified, dir);
+    if (entry < 0) {
+        return DISK_DIR_FULL;
+    }
+    node->cluster = extent_count > 0 ? extents[0].start : 0;
+    disk_set_location(image, fat, entry, node->cluster, node->size);
+    if (checks != NULL) {
+        put_remember(checks, node->path, entry, crc);
+    }
+    return DISK_OK;
+}
 
-            // Set creation date and time to last modification time
-            struct stat st;
-            stat(file_name, &st);
-            struct tm *tm = localtime(&st.st_mtime);
+static int put_tree_directory(char *image, fat_table *fat, dir_index *index, put_node *node, int dir, fat_extent *extents,
+                              int extent_count) {
+    // Turn a directory's reserved clusters into an empty directory and add its entry; returns 0 or a DISK_ code
+    long entry;
 
-            int year = tm->tm_year + 1900;
-            int month = tm->tm_mon + 1;
-            int day = tm->tm_mday;
-            int hours = tm->tm_hour;
-            int minutes = tm->tm_min;
+    if (disk_format_directory(image, fat, extents, extent_count, dir) < 0) {
+        return DISK_IO_ERROR;
+    }
+    entry = disk_write_entry(image, index, node->name, 0, 0, node->modified, dir);
+    if (entry < 0) {
+        return DISK_DIR_FULL;
+    }
+    image[entry + 11] = 0x10;
+    node->cluster = extents[0].start;
+    disk_set_location(image, fat, entry, node->cluster, 0);
+    return DISK_OK;
+}
 
-            int creation_date = ((year - 1980) << 9) | (month << 5) | day;
-            int creation_time = (hours << 11) | (minutes << 5);
+int put_tree(char *image, fat_table *fat, dir_index *index, const char *host_path, int dir, put_checks *checks) {
+    // Copy a host directory tree into directory dir: scan it breadth-first, reserve every cluster it needs as one
+    // region, then lay directories and files out in scan order so the tree reads back front to back
+    put_node *nodes = malloc(64 * sizeof(put_node));
+    int count = 0, size = 64;
+    int total = 0;
+    int files = 0, directories = 0, failures = 0;
+    long bytes = 0;
+    put_region region = {NULL, 0, 0, 0};
+    long entry_bytes = DIR_ENTRY_SIZE;
 
-            image[dir_offset + i + 16] = creation_date & 0xFF;
-            image[dir_offset + i + 17] = (creation_date >> 8) & 0xFF;
-            image[dir_offset + i + 14] = creation_time & 0xFF;
-            image[dir_offset + i + 15] = (creation_time >> 8) & 0xFF;
+    if (nodes == NULL || put_scan(&nodes, &count, &size, -1, host_path, 0, index, dir) < 0) {
+        printf("Error: out of memory\n");
+        free(nodes);
+        return 1;
+    }
+    for (int i = 0; i < count; i++) { // count grows as directories are scanned, which makes this breadth-first
+        if (nodes[i].is_directory) {
+            if (nodes[i].depth >= DISK_MAX_DEPTH) {
+                printf("Skipping %s: directories nested too deeply\n", nodes[i].path);
+                nodes[i].clusters = 0;
+                continue;
+            }
+            int slots = put_scan(&nodes, &count, &size, i, nodes[i].path, nodes[i].depth + 1, index, dir);
+            if (slots < 0) {
+                printf("Error: out of memory\n");
+                failures = 1;
+                break;
+            }
+            nodes[i].clusters = fat_clusters_for(fat, (slots + 2) * entry_bytes); // Room for "." and ".." too
+        }
+        total += nodes[i].clusters;
+    }
 
-            break;
+    if (failures == 0 && total > fat_count_free(fat)) {
+        printf("%s\n", disk_message(DISK_NO_SPACE));
+        failures = 1;
+    } else if (failures == 0 && total > 0) {
+        region.runs = fat_alloc(fat, total, &region.count); // One run if any free run is long enough
+        disk_stats_phase(STATS_COPY);
+        if (region.runs == NULL) {
+            printf("%s\n", disk_message(DISK_NO_CLUSTER));
+            failures = 1;
         }
     }
-}
+    if (failures > 0) { // Nothing has been written
+        for (int i = 0; i < count; i++) {
+            free(nodes[i].path);
+        }
+        free(nodes);
+        return 1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        put_node *node = &nodes[i];
+        int extent_count = 0;
+        fat_extent *extents = NULL;
+        int parent = node->parent < 0 ? dir : nodes[node->parent].cluster;
+        int result;
 
-int find_directory(char *image, char *path, int dir_offset) {
-    // Split the path and traverse directories
-    char *token = strtok(path, "/");
-    while (token != NULL) {
-        int found = 0;
-        for (int i = 0; i < ROOT_DIR_SIZE; i += 32) {
-            if (image[dir_offset + i] != 0x00 && image[dir_offset + i] != 0xE5) {
-                char name[9] = "        ";
-                memcpy(name, image + dir_offset + i, 8);
-                for (int j = 0; j < 8; j++) name[j] = toupper(name[j]);
-                if (strncmp(name, token, 8) == 0 && (image[dir_offset + i + 11] & 0x10)) {
-                    // Found directory
-                    int cluster = (image[dir_offset + i + 27] << 8) | image[dir_offset + i + 26];
-                    dir_offset = DATA_OFFSET + (cluster - 2) * SECTOR_SIZE;
-                    found = 1;
-                    break;
-                }
+        if (node->clusters > 0) {
+            extents = put_take(&region, node->clusters, &extent_count);
+            if (extents == NULL) {
+                printf("Error: out of memory\n");
+                failures++;
+                break;
             }
         }
-        if (!found) return -1; // Directory not found
-        token = strtok(NULL, "/");
+        if (parent < 0 || (node->is_directory && node->clusters == 0)) { // Its directory was not created
+            disk_release_extents(fat, extents, extent_count);
+            free(extents);
+            continue;
+        }
+        result = node->is_directory ? put_tree_directory(image, fat, index, node, parent, extents, extent_count)
+                                    : put_tree_file(image, fat, index, node, parent, extents, extent_count, checks);
+        if (result != DISK_OK) {
+            printf("Error: %s: %s\n", node->path, disk_message(result));
+            node->cluster = -1;
+            disk_release_extents(fat, extents, extent_count);
+            failures++;
+        } else if (node->is_directory) {
+            directories++;
+        } else {
+            files++;
+            bytes += node->size;
+        }
+        free(extents);
     }
-    return dir_offset;
-}
+    if (region.at < region.count) { // Left over after a failure
+        region.runs[region.at].start += region.used;
+        region.runs[region.at].length -= region.used;
+        disk_release_extents(fat, region.runs + region.at, region.count - region.at);
+    }
+    printf("%d files in %d directories, %ld bytes, %d cluster run%s\n", files, directories, bytes, region.count,
+           region.count == 1 ? "" : "s");
 
-int check_free_space(char *image, int file_size) {
-    int clusters_needed = (file_size + SECTOR_SIZE - 1) / SECTOR_SIZE;
-    int free_clusters = 0;
-    for (int i = 2; i < 2849; i++) {
-        if (fat_convert(image, i) == 0x000) {
-            free_clusters++;
-            if (free_clusters >= clusters_needed) return 1;
-        }
+    for (int i = 0; i < count; i++) {
+        free(nodes[i].path);
     }
-    return 0;
+    free(nodes);
+    free(region.runs);
+    return failures > 0;
 }
@@ -0,0 +1,262 @@
+#define _GNU_SOURCE // FNM_CASEFOLD
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fnmatch.h>
+#include <unistd.h>
+#include "fat12.h"
+#include "dirindex.h"
+#include "diskops.h"
+#include "diskimage.h"
+
+#define RM_MAX_COMPONENTS 64 // Path components of one argument
+
+// Entry matched by an argument
+typedef struct {
+    char *path;
+    int dir;    // Directory holding the entry
+    long entry;
+} rm_target;
+
+// Image, options and matches shared by the whole run
+typedef struct {
+    char *image;
+    fat_table *fat;
+    dir_index *index;
+    rm_target *targets;
+    int count, size;
+} rm_state;
+
+static int rm_add(rm_state *state, const char *path, int dir, long entry) {
+    // Remember a matched entry
+    if (state->count == state->size) {
+        int size = state->size > 0 ? 2 * state->size : 64;
+        rm_target *grown = realloc(state->targets, size * sizeof(rm_target));
+        if (grown == NULL) {
+            return -1;
+        }
+        state->targets = grown;
+        state->size = size;
+    }
+    state->targets[state->count].path = strdup(path);
+    if (state->targets[state->count].path == NULL) {
+        return -1;
+    }
+    state->targets[state->count].dir = dir;
+    state->targets[state->count].entry = entry;
+    state->count++;
+    return 0;
+}
+
+static int rm_match(rm_state *state, int dir, char **components, int count, const char *prefix, int depth);
+
+static int rm_matched(rm_state *state, int dir, long entry, const char *name, char **components, int count,
+                      const char *prefix, int depth) {
+    // Take an entry that matches the first component: a target if it was the last, else a directory to look in
+    char path[4096];
+
+    snprintf(path, sizeof(path), "%s%s%s", prefix, prefix[0] != '\0' ? "/" : "", name);
+    if (count == 1) {
+        return rm_add(state, path, dir, entry);
+    }
+    if ((state->image[entry + 11] & 0x10) == 0) {
+        return 0;
+    }
+    return rm_match(state, dir_entry_cluster(state->fat, state->image, entry), components + 1, count - 1, path, depth + 1);
+}
+
+static int rm_match(rm_state *state, int dir, char **components, int count, const char *prefix, int depth) {
+    // Find the entries of directory dir matching the remaining path components; a component with *, ? or [ is
+    // matched against every name in the directory, ignoring case, the others are looked up
+    int range_count;
+    dir_range *ranges;
+    dir_long_name long_name;
+    char name[DIR_NAME_MAX], short_name[13];
+    int result = 0;
+
+    if (depth > DISK_MAX_DEPTH) {
+        return 0;
+    }
+    if (strpbrk(components[0], "*?[") == NULL) {
+        long entry = dir_lookup_name(state->index, dir, components[0]);
+        if (entry < 0) {
+            return 0;
+        }
+        dir_entry_name(state->index, dir, entry, name); // As stored, whatever case was typed
+        return rm_matched(state, dir, entry, name, components, count, prefix, depth);
+    }
+
+    ranges = dir_ranges(state->fat, dir, &range_count);
+    if (ranges == NULL) {
+        return -1;
+    }
+    long_name.pieces = 0;
+    for (int r = 0; r < range_count && result == 0; r++) {
+        for (long entry = ranges[r].offset; entry < ranges[r].offset + ranges[r].length; entry += DIR_ENTRY_SIZE) {
+            unsigned char *bytes = (unsigned char *)state->image + entry;
+            if (bytes[0] == 0x00) {
+                r = range_count;
+                break;
+            }
+            if (bytes[11] == 0x0F) {
+                dir_long_feed(&long_name, bytes);
+                continue;
+            }
+            int has_long = dir_long_take(&long_name, bytes, name) > 0;
+            if (bytes[0] == 0xE5 || bytes[0] == '.' || (bytes[11] & 0x08) != 0) {
+                continue;
+            }
+            dir_unpack_name(bytes, short_name);
+            if (fnmatch(components[0], has_long ? name : short_name, FNM_CASEFOLD) != 0 &&
+                (!has_long || fnmatch(components[0], short_name, FNM_CASEFOLD) != 0)) {
+                continue;
+            }
+            result = rm_matched(state, dir, entry, has_long ? name : short_name, components, count, prefix, depth);
+            if (result < 0) {
+                break;
+            }
+        }
+    }
+    free(ranges);
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    // Main function to delete or truncate files and directories matching paths or patterns
+    disk_image image;
+    fat_table fat;
+    dir_index index;
+    disk_batch batch;
+    rm_state state;
+    int recursive = 0, zero = 0, dry_run = 0;
+    long truncate_size = -1;
+    int files = 0, directories = 0, failed = 0;
+    int opt;
+
+    memset(&state, 0, sizeof(state));
+    while ((opt = getopt(argc, argv, "rznt:")) != -1) {
+        char *end;
+        if (opt == 'r') {
+            recursive = 1;
+        } else if (opt == 'z') {
+            zero = 1;
+        } else if (opt == 'n') {
+            dry_run = 1;
+        } else if (opt == 't' && (truncate_size = strtol(optarg, &end, 10)) >= 0 && *end == '\0') {
+            continue;
+        } else {
+            optind = argc + 1;
+        }
+    }
+    if (optind > argc - 2 || (recursive && truncate_size >= 0)) {
+        printf("Usage: diskrm [-r] [-z] [-n] <disk image> <path or pattern>...\n");
+        printf("       diskrm -t <size> [-z] [-n] <disk image> <path or pattern>...\n");
+        printf("  -r  also delete directories and everything in them\n");
+        printf("  -t  truncate files to size bytes instead of deleting them\n");
+        printf("  -z  overwrite the freed clusters with zeros\n");
+        printf("  -n  only print what would be deleted or truncated\n");
+        printf("Patterns use *, ? and [...] in any path component and ignore case.\n");
+        return 1;
+    }
+
+    if (disk_image_open(&image, argv[optind], dry_run ? 0 : IMAGE_WRITE) < 0) { // Open the disk image
+        perror("Error opening disk image");
+        return 1;
+    }
+    if (fat_load(&fat, image.data, image.size) < 0) {
+        printf("Error: failed to read FAT\n");
+        disk_image_close(&image);
+        return 1;
+    }
+    disk_image_attach(&image, &fat);
+    if (dir_index_init(&index, image.data, &fat) < 0 || disk_batch_init(&batch, &fat, zero) < 0) {
+        printf("Error: out of memory\n");
+        fat_release(&fat);
+        disk_image_close(&image);
+        return 1;
+    }
+    state.image = image.data;
+    state.fat = &fat;
+    state.index = &index;
+
+    // Match every argument first, so a pattern sees the directories as they were
+    for (int i = optind + 1; i < argc; i++) {
+        char copy[4096];
+        char *components[RM_MAX_COMPONENTS];
+        int count = 0;
+        int before = state.count;
+
+        snprintf(copy, sizeof(copy), "%s", argv[i]);
+        for (char *token = strtok(copy, "/"); token != NULL && count < RM_MAX_COMPONENTS; token = strtok(NULL, "/")) {
+            components[count++] = token;
+        }
+        if (count == 0 || rm_match(&state, DIR_ROOT, components, count, "", 0) < 0) {
+            printf("Error: %s: %s\n", argv[i], disk_message(count == 0 ? DISK_BAD_REQUEST : DISK_NO_MEMORY));
+            failed++;
+        } else if (state.count == before) {
+            printf("Error: %s: %s\n", argv[i], disk_message(DISK_NOT_FOUND));
+            failed++;
+        }
+    }
+
+    for (int i = 0; i < state.count; i++) {
+        rm_target *target = &state.targets[i];
+        int is_directory = (image.data[target->entry + 11] & 0x10) != 0;
+        int result;
+
+        if ((unsigned char)image.data[target->entry] == 0xE5) {
+            continue; // Matched twice, or inside a directory already deleted
+        }
+        if (is_directory && (!recursive || truncate_size >= 0)) {
+            printf("Error: %s is a directory%s\n", target->path, truncate_size >= 0 ? "" : " (use -r)");
+            failed++;
+            continue;
+        }
+        if (truncate_size >= 0) {
+            result = dry_run ? (truncate_size > dir_entry_size(image.data, target->entry) ? DISK_CANNOT_GROW : DISK_OK)
+                             : disk_truncate(image.data, &fat, target->entry, truncate_size, &batch);
+        } else {
+            result = dry_run ? DISK_OK : disk_remove(image.data, &fat, &index, target->dir, target->entry, &batch, &files, &directories);
+        }
+        if (result != DISK_OK) {
+            printf("Error: %s: %s\n", target->path, disk_message(result));
+            failed++;
+            continue;
+        }
+        printf("%s%s %s\n", dry_run ? "would be " : "", truncate_size >= 0 ? "truncated" : "removed", target->path);
+        if (truncate_size >= 0) { // Removals were counted by disk_remove, everything inside directories included
+            files++;
+        }
+    }
+
+    // Every chain marked above is freed in one pass over the FAT, and everything goes to disk in one commit
+    int freed = dry_run ? 0 : disk_batch_free(image.data, &fat, &batch);
+    if (freed < 0) {
+        printf("Error: some freed clusters could not be zeroed\n");
+        failed++;
+    }
+    if (!dry_run && fat_commit(&fat) < 0) {
+        perror("Error syncing disk image");
+        failed++;
+    }
+    if (freed < 0) {
+        freed = 0;
+    }
+    if (!dry_run && truncate_size >= 0) {
+        printf("%d files truncated, %d clusters (%ld bytes) freed\n", files, freed, (long)freed * fat.geo.cluster_size);
+    } else if (!dry_run) {
+        printf("%d files and %d directories removed, %d clusters (%ld bytes) freed\n", files, directories, freed,
+               (long)freed * fat.geo.cluster_size);
+    }
+
+    for (int i = 0; i < state.count; i++) {
+        free(state.targets[i].path);
+    }
+    free(state.targets);
+    free(batch.clusters);
+    dir_index_release(&index);
+    fat_release(&fat);
+    disk_image_close(&image);
+    return failed > 0;
+}
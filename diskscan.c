@@ -0,0 +1,555 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "fat12.h"
+#include "dirindex.h"
+#include "manifest.h"
+#include "diskops.h"
+#include "diskimage.h"
+
+#define SCAN_DEQUE 64                 // Images each worker may have waiting; the reader blocks once every deque is full
+#define SCAN_FLUSH_BYTES (256 * 1024) // CSV listing rows of one image are written out in pieces of about this size
+
+// Images waiting for one worker: the owner takes the newest, idle workers steal the oldest
+typedef struct {
+    char *paths[SCAN_DEQUE];
+    long top, bottom;         // Ever-growing; the waiting paths are paths[top..bottom) modulo SCAN_DEQUE
+    pthread_mutex_t lock;
+} scan_deque;
+
+// Output of one image, built up by its worker and written out in one piece
+typedef struct {
+    char *data;
+    long used, size;
+    int failed;               // Out of memory: the rest of the image's output is dropped
+} scan_buffer;
+
+// Shared by the reader and the workers
+typedef struct {
+    scan_deque *deques;
+    int threads;
+    int json;
+    int list;                 // One row per file and directory as well
+    int queued;               // Paths in all deques, may lag a push or a take by a moment
+    int done;                 // No more paths are coming
+    long images, failures;
+    int rows;                 // Image rows or objects written so far, for the JSON separators
+    int header;               // The CSV header is out
+    pthread_mutex_t wait_lock;
+    pthread_cond_t work_ready, space_ready;
+    pthread_mutex_t output_lock;
+} scan_state;
+
+// One image being scanned
+typedef struct {
+    scan_state *state;
+    scan_buffer *out;
+    const char *path;
+    char *image;
+    fat_table *fat;
+    uint64_t *visited;        // Directory clusters already walked, against loops
+    char name_path[4096];     // Path of the directory being walked, for listing rows
+    int files, directories;
+    long file_bytes;
+} scan_job;
+
+static long scan_now(void) {
+    // Monotonic clock in nanoseconds
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+static void scan_printf(scan_buffer *out, const char *format, ...) {
+    // Append formatted text, growing the buffer as needed
+    va_list args;
+    int length;
+
+    if (out->failed) {
+        return;
+    }
+    va_start(args, format);
+    length = vsnprintf(out->data + out->used, out->size - out->used, format, args);
+    va_end(args);
+    if (out->used + length >= out->size) {
+        long size = 2 * out->size + length + 1;
+        char *grown = realloc(out->data, size);
+        if (grown == NULL) {
+            out->failed = 1;
+            return;
+        }
+        out->data = grown;
+        out->size = size;
+        va_start(args, format);
+        vsnprintf(out->data + out->used, out->size - out->used, format, args);
+        va_end(args);
+    }
+    out->used += length;
+}
+
+static void scan_string(scan_buffer *out, int json, const char *text) {
+    // Append a JSON string literal, or a CSV field quoted when it holds a comma, quote or line break
+    if (!json && strpbrk(text, ",\"\r\n") == NULL) {
+        scan_printf(out, "%s", text);
+        return;
+    }
+    scan_printf(out, "\"");
+    for (const unsigned char *p = (const unsigned char *)text; *p != '\0'; p++) {
+        if (*p == '"') {
+            scan_printf(out, json ? "\\\"" : "\"\"");
+        } else if (json && *p == '\\') {
+            scan_printf(out, "\\\\");
+        } else if (json && *p < 0x20) {
+            scan_printf(out, "\\u%04x", *p);
+        } else {
+            scan_printf(out, "%c", *p);
+        }
+    }
+    scan_printf(out, "\"");
+}
+
+static void scan_write(scan_state *state, scan_buffer *out, int image_rows) {
+    // Write what a worker has built up to stdout; image_rows of it are complete rows or objects
+    pthread_mutex_lock(&state->output_lock);
+    if (!state->header && !state->json) {
+        state->header = 1;
+        printf(state->list ? "image,path,type,size,cluster,created\n"
+                           : "image,status,fat,size,free,files,directories,file_bytes,label,os_name,fat_copies,"
+                             "sectors_per_fat,elapsed_us\n");
+    }
+    if (state->json && image_rows > 0) {
+        fputs(state->rows == 0 ? "[\n" : ",\n", stdout);
+    }
+    fwrite(out->data, 1, out->used, stdout);
+    fflush(stdout);
+    state->rows += image_rows;
+    pthread_mutex_unlock(&state->output_lock);
+    out->used = 0;
+}
+
+static void scan_entry_row(scan_job *job, const char *name, const char *entry, int is_directory) {
+    // Add one listing row (or JSON object inside the image's "entries") for a file or directory
+    scan_buffer *out = job->out;
+    int cluster = dir_entry_cluster(job->fat, job->image, entry - job->image);
+    long size = is_directory ? 0 : dir_entry_size(job->image, entry - job->image);
+    int date = (entry[16] & 0xFF) | (entry[17] & 0xFF) << 8;
+    int time = (entry[14] & 0xFF) | (entry[15] & 0xFF) << 8;
+    char created[17];
+    char path[sizeof(job->name_path) + DIR_NAME_MAX];
+
+    snprintf(path, sizeof(path), "%s%s%s", job->name_path, job->name_path[0] != '\0' ? "/" : "", name);
+    snprintf(created, sizeof(created), "%04d-%02d-%02d %02d:%02d", (date >> 9) + 1980, (date >> 5) & 0xF, date & 0x1F,
+             time >> 11, (time >> 5) & 0x3F);
+    if (job->state->json) {
+        scan_printf(out, "%s{\"path\":", job->files + job->directories > 1 ? ",\n  " : "\n  ");
+        scan_string(out, 1, path);
+        scan_printf(out, ",\"type\":\"%s\",\"size\":%ld,\"cluster\":%d,\"created\":\"%s\"}",
+                    is_directory ? "directory" : "file", size, cluster, created);
+        return;
+    }
+    scan_string(out, 0, job->path);
+    scan_printf(out, ",");
+    scan_string(out, 0, path);
+    scan_printf(out, ",%s,%ld,%d,%s\n", is_directory ? "D" : "F", size, cluster, created);
+    if (out->used > SCAN_FLUSH_BYTES) {
+        scan_write(job->state, out, 0);
+    }
+}
+
+static int scan_directory(scan_job *job, int dir, int depth) {
+    // Count (and with -l list) everything below a directory; -1 if the tree is damaged
+    int range_count;
+    dir_range *ranges;
+    dir_long_name long_name;
+    char name[DIR_NAME_MAX];
+    int result = 0;
+
+    if (depth > DISK_MAX_DEPTH) {
+        return -1;
+    }
+    ranges = dir_ranges(job->fat, dir, &range_count);
+    if (ranges == NULL) {
+        return -1;
+    }
+    long_name.pieces = 0;
+    for (int r = 0; r < range_count; r++) {
+        for (long offset = ranges[r].offset; offset < ranges[r].offset + ranges[r].length; offset += DIR_ENTRY_SIZE) {
+            char *entry = job->image + offset;
+            if (entry[0] == 0x00) {
+                r = range_count;
+                break;
+            }
+            if (entry[11] == 0x0F) {
+                dir_long_feed(&long_name, (unsigned char *)entry);
+                continue;
+            }
+            int has_long = dir_long_take(&long_name, (unsigned char *)entry, name) > 0;
+            if ((unsigned char)entry[0] == 0xE5 || entry[0] == '.' || (entry[11] & 0x08) != 0) {
+                continue;
+            }
+            int is_directory = (entry[11] & 0x10) != 0;
+            if (is_directory) {
+                job->directories++;
+            } else {
+                job->files++;
+                job->file_bytes += dir_entry_size(job->image, offset);
+            }
+            if (!job->state->list && !is_directory) {
+                continue; // Names are only needed for listing rows and subdirectory paths
+            }
+            if (!has_long) {
+                dir_unpack_name((unsigned char *)entry, name);
+            }
+            if (job->state->list) {
+                scan_entry_row(job, name, entry, is_directory);
+            }
+
+            int cluster = dir_entry_cluster(job->fat, job->image, offset);
+            if (!is_directory || cluster < 2 || cluster >= job->fat->count || (job->visited[cluster / 64] >> (cluster % 64) & 1)) {
+                continue;
+            }
+            job->visited[cluster / 64] |= 1ULL << (cluster % 64);
+            size_t parent_length = strlen(job->name_path);
+            if (parent_length + 1 + strlen(name) >= sizeof(job->name_path)) {
+                result = -1;
+                continue;
+            }
+            snprintf(job->name_path + parent_length, sizeof(job->name_path) - parent_length, "%s%s",
+                     parent_length > 0 ? "/" : "", name);
+            if (scan_directory(job, cluster, depth + 1) < 0) {
+                result = -1;
+            }
+            job->name_path[parent_length] = '\0';
+        }
+    }
+    free(ranges);
+    return result;
+}
+
+static void scan_image(scan_state *state, scan_buffer *out, const char *path) {
+    // Open one image read-only, collect what diskinfo and disklist would show, and write its row
+    long start = scan_now();
+    disk_image file;
+    fat_table fat;
+    scan_job job;
+    int status = DISK_OK;
+    char os_name[9] = "", label[12] = "";
+
+    memset(&job, 0, sizeof(job));
+    job.state = state;
+    job.out = out;
+    job.path = path;
+    if (state->json) {
+        scan_printf(out, "{\"image\":");
+        scan_string(out, 1, path);
+        if (state->list) {
+            scan_printf(out, ",\"entries\":[");
+        }
+    }
+
+    if (disk_image_open(&file, path, 0) < 0) {
+        status = DISK_IO_ERROR;
+    } else if (fat_load(&fat, file.data, file.size) < 0) {
+        status = DISK_BAD_IMAGE;
+        disk_image_close(&file);
+    } else {
+        disk_image_attach(&file, &fat);
+        job.image = file.data;
+        job.fat = &fat;
+        job.visited = calloc(fat.count / 64 + 1, sizeof(uint64_t));
+        if (job.visited == NULL) {
+            status = DISK_NO_MEMORY;
+        } else if (scan_directory(&job, DIR_ROOT, 0) < 0) {
+            status = DISK_BAD_IMAGE; // Counts cover what could be read
+        }
+        memcpy(os_name, file.data + 3, 8);
+        for (int i = 0; i < 8; i++) {
+            os_name[i] = os_name[i] >= 0x20 && os_name[i] < 0x7F ? os_name[i] : '?';
+        }
+        disk_label(file.data, &fat, label);
+        for (int i = 0; label[i] != '\0'; i++) {
+            label[i] = label[i] >= 0x20 && label[i] < 0x7F ? label[i] : '?';
+        }
+        free(job.visited);
+    }
+    long elapsed_us = (scan_now() - start) / 1000;
+
+    if (state->json) {
+        scan_printf(out, "%s,\"status\":\"%s\"", state->list ? "]" : "", status == DISK_OK ? "ok" : disk_message(status));
+        if (job.fat != NULL) {
+            scan_printf(out, ",\"fat\":%d,\"size\":%ld,\"free\":%ld,\"files\":%d,\"directories\":%d,\"file_bytes\":%ld,\"label\":",
+                        fat.geo.width, file.size, (long)fat_count_free(&fat) * fat.geo.cluster_size, job.files,
+                        job.directories, job.file_bytes);
+            scan_string(out, 1, label);
+            scan_printf(out, ",\"os_name\":");
+            scan_string(out, 1, os_name);
+            scan_printf(out, ",\"fat_copies\":%d,\"sectors_per_fat\":%ld", fat.geo.fat_copies, fat.geo.sectors_per_fat);
+        }
+        scan_printf(out, ",\"elapsed_us\":%ld}", elapsed_us);
+    } else if (!state->list) {
+        scan_string(out, 0, path);
+        scan_printf(out, ",%s", status == DISK_OK ? "ok" : disk_message(status));
+        if (job.fat != NULL) {
+            scan_printf(out, ",%d,%ld,%ld,%d,%d,%ld,", fat.geo.width, file.size, (long)fat_count_free(&fat) * fat.geo.cluster_size,
+                        job.files, job.directories, job.file_bytes);
+            scan_string(out, 0, label);
+            scan_printf(out, ",");
+            scan_string(out, 0, os_name);
+            scan_printf(out, ",%d,%ld,%ld\n", fat.geo.fat_copies, fat.geo.sectors_per_fat, elapsed_us);
+        } else {
+            scan_printf(out, ",,,,,,,,,,,%ld\n", elapsed_us);
+        }
+    } else if (status != DISK_OK) { // Listing rows cannot say this, so it goes to stderr
+        fprintf(stderr, "%s: %s\n", path, disk_message(status));
+    }
+    if (job.fat != NULL) {
+        fat_release(&fat);
+        disk_image_close(&file);
+    }
+
+    scan_write(state, out, state->json || !state->list ? 1 : 0);
+    pthread_mutex_lock(&state->wait_lock);
+    state->images++;
+    state->failures += status != DISK_OK || out->failed;
+    pthread_mutex_unlock(&state->wait_lock);
+    out->failed = 0;
+}
+
+static char *scan_take(scan_state *state, int self) {
+    // Take the newest path from our own deque, or else steal the oldest from another worker's; NULL if all are empty
+    for (int i = 0; i < state->threads; i++) {
+        scan_deque *deque = &state->deques[(self + i) % state->threads];
+        char *path = NULL;
+        pthread_mutex_lock(&deque->lock);
+        if (deque->bottom > deque->top) {
+            path = i == 0 ? deque->paths[--deque->bottom % SCAN_DEQUE] : deque->paths[deque->top++ % SCAN_DEQUE];
+        }
+        pthread_mutex_unlock(&deque->lock);
+        if (path != NULL) {
+            pthread_mutex_lock(&state->wait_lock);
+            state->queued--;
+            pthread_cond_signal(&state->space_ready);
+            pthread_mutex_unlock(&state->wait_lock);
+            return path;
+        }
+    }
+    return NULL;
+}
+
+// Worker thread argument
+typedef struct {
+    scan_state *state;
+    int self;
+} scan_worker;
+
+static void *scan_work(void *argument) {
+    // Scan images until the reader is done and every deque is empty
+    scan_worker *worker = argument;
+    scan_state *state = worker->state;
+    scan_buffer out = {NULL, 0, 0, 0};
+
+    for (;;) {
+        char *path = scan_take(state, worker->self);
+        if (path != NULL) {
+            scan_image(state, &out, path);
+            free(path);
+            continue;
+        }
+        pthread_mutex_lock(&state->wait_lock);
+        while (state->queued <= 0 && !state->done) {
+            pthread_cond_wait(&state->work_ready, &state->wait_lock);
+        }
+        int finished = state->queued <= 0 && state->done;
+        pthread_mutex_unlock(&state->wait_lock);
+        if (finished) {
+            break;
+        }
+    }
+    free(out.data);
+    return NULL;
+}
+
+static int scan_add(scan_state *state, const char *path) {
+    // Hand one image path to the workers, spreading paths over their deques; waits while every deque is full
+    static int next;
+    char *copy = strdup(path);
+
+    if (copy == NULL) {
+        return -1;
+    }
+    for (;;) {
+        for (int i = 0; i < state->threads; i++) {
+            scan_deque *deque = &state->deques[next];
+            int pushed = 0;
+            next = (next + 1) % state->threads;
+            pthread_mutex_lock(&deque->lock);
+            if (deque->bottom - deque->top < SCAN_DEQUE) {
+                deque->paths[deque->bottom++ % SCAN_DEQUE] = copy;
+                pushed = 1;
+            }
+            pthread_mutex_unlock(&deque->lock);
+            if (pushed) {
+                pthread_mutex_lock(&state->wait_lock);
+                state->queued++;
+                pthread_cond_signal(&state->work_ready);
+                pthread_mutex_unlock(&state->wait_lock);
+                return 0;
+            }
+        }
+        pthread_mutex_lock(&state->wait_lock);
+        while (state->queued >= state->threads * SCAN_DEQUE) {
+            pthread_cond_wait(&state->space_ready, &state->wait_lock);
+        }
+        pthread_mutex_unlock(&state->wait_lock);
+    }
+}
+
+static void scan_fail(scan_state *state) {
+    // Count a path that could not be scanned, so the run exits non-zero
+    pthread_mutex_lock(&state->wait_lock);
+    state->failures++;
+    pthread_mutex_unlock(&state->wait_lock);
+}
+
+static void scan_tree(scan_state *state, const char *path, int depth) {
+    // Queue every regular file under a directory (or the file itself), without building a list first
+    struct stat status;
+    DIR *directory;
+    struct dirent *entry;
+    char child[4096];
+
+    if (stat(path, &status) < 0) {
+        perror(path);
+        scan_fail(state);
+        return;
+    }
+    if (S_ISREG(status.st_mode)) {
+        if (scan_add(state, path) < 0) {
+            printf("Error: out of memory\n");
+            scan_fail(state);
+        }
+        return;
+    }
+    if (!S_ISDIR(status.st_mode) || depth > DISK_MAX_DEPTH) {
+        return;
+    }
+    directory = opendir(path);
+    if (directory == NULL) {
+        perror(path);
+        scan_fail(state);
+        return;
+    }
+    while ((entry = readdir(directory)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+        scan_tree(state, child, depth + 1);
+    }
+    closedir(directory);
+}
+
+int main(int argc, char *argv[]) {
+    // Main function to inventory many images at once on a pool of threads, streaming one row per image
+    scan_state state;
+    scan_worker *workers;
+    pthread_t *threads;
+    const char *manifest_path = NULL;
+    int opt, started = 0;
+    long start = scan_now();
+
+    memset(&state, 0, sizeof(state));
+    state.threads = sysconf(_SC_NPROCESSORS_ONLN);
+    while ((opt = getopt(argc, argv, "jlm:t:")) != -1) {
+        if (opt == 'j') {
+            state.json = 1;
+        } else if (opt == 'l') {
+            state.list = 1;
+        } else if (opt == 'm') {
+            manifest_path = optarg;
+        } else if (opt == 't') {
+            state.threads = atoi(optarg);
+        } else {
+            state.threads = 0;
+        }
+    }
+    if ((optind == argc && manifest_path == NULL) || state.threads < 1) {
+        printf("Usage: diskscan [-j] [-l] [-t threads] [-m list] [<image or directory>...]\n");
+        printf("Prints CSV (JSON with -j): what diskinfo shows for every image, with -l every file and directory too\n");
+        return 1;
+    }
+
+    state.deques = calloc(state.threads, sizeof(scan_deque));
+    workers = malloc(state.threads * sizeof(scan_worker));
+    threads = malloc(state.threads * sizeof(pthread_t));
+    if (state.deques == NULL || workers == NULL || threads == NULL) {
+        printf("Error: out of memory\n");
+        return 1;
+    }
+    pthread_mutex_init(&state.wait_lock, NULL);
+    pthread_mutex_init(&state.output_lock, NULL);
+    pthread_cond_init(&state.work_ready, NULL);
+    pthread_cond_init(&state.space_ready, NULL);
+    for (int i = 0; i < state.threads; i++) {
+        pthread_mutex_init(&state.deques[i].lock, NULL);
+    }
+    for (int i = 0; i < state.threads; i++) {
+        workers[i].state = &state;
+        workers[i].self = i;
+        if (pthread_create(&threads[i], NULL, scan_work, &workers[i]) != 0) {
+            break;
+        }
+        started++;
+    }
+    if (started == 0) {
+        perror("Error starting worker");
+        return 1;
+    }
+    state.threads = started; // Paths only go to deques someone takes from
+
+    // Paths are read while the workers run, so the first rows appear before the whole list is known
+    if (manifest_path != NULL) {
+        FILE *manifest = strcmp(manifest_path, "-") == 0 ? stdin : fopen(manifest_path, "r");
+        char line[MANIFEST_LINE];
+        char *fields[1];
+        if (manifest == NULL) {
+            perror(manifest_path);
+            scan_fail(&state);
+        }
+        while (manifest != NULL && manifest_next(manifest, line, fields, 1) > 0) {
+            scan_tree(&state, fields[0], 0);
+        }
+        if (manifest != NULL && manifest != stdin) {
+            fclose(manifest);
+        }
+    }
+    for (int i = optind; i < argc; i++) {
+        scan_tree(&state, argv[i], 0);
+    }
+
+    pthread_mutex_lock(&state.wait_lock);
+    state.done = 1;
+    pthread_cond_broadcast(&state.work_ready);
+    pthread_mutex_unlock(&state.wait_lock);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    if (state.json) {
+        printf(state.rows > 0 ? "\n]\n" : "[]\n");
+    }
+    fprintf(stderr, "%ld images, %ld failed, %d threads, %.3f s\n", state.images, state.failures, started,
+            (scan_now() - start) / 1e9);
+    free(state.deques);
+    free(workers);
+    free(threads);
+    return state.failures > 0;
+}
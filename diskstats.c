@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "diskstats.h"
+
+disk_stats_state disk_stats;
+
+static const char *stats_names[STATS_PHASES] = {"open", "fat", "directory", "copy", "flush"};
+
+static double stats_elapsed(const struct timespec *from, const struct timespec *to) {
+    // Seconds between two clock readings
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static void stats_report(void) {
+    // Close the last phase and print the report to stderr, so it never mixes with data on stdout
+    struct timespec now;
+    struct rusage usage;
+
+    disk_stats_phase(disk_stats.phase);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    getrusage(RUSAGE_SELF, &usage);
+    double total = stats_elapsed(&disk_stats.start, &now);
+    long minor = usage.ru_minflt - disk_stats.usage.ru_minflt;
+    long major = usage.ru_majflt - disk_stats.usage.ru_majflt;
+
+    if (disk_stats.json) {
+        fprintf(stderr, "{\"tool\":\"%s\"", disk_stats.tool);
+        for (int i = 0; i < STATS_PHASES; i++) {
+            fprintf(stderr, ",\"%s_ms\":%.3f", stats_names[i], disk_stats.seconds[i] * 1e3);
+        }
+        fprintf(stderr, ",\"total_ms\":%.3f,\"fat_entries\":%ld,\"clusters\":%ld,\"bytes\":%ld,\"syscalls\":%ld,"
+                        "\"minor_faults\":%ld,\"major_faults\":%ld,\"files\":%ld,\"extents\":%ld,\"fragmented_files\":%ld}\n",
+                total * 1e3, disk_stats.fat_entries, disk_stats.clusters, disk_stats.bytes, disk_stats.syscalls, minor, major,
+                disk_stats.files, disk_stats.extents, disk_stats.fragmented);
+        return;
+    }
+    fprintf(stderr, "%s stats:\n", disk_stats.tool);
+    for (int i = 0; i < STATS_PHASES; i++) {
+        fprintf(stderr, "  %-10s %10.3f ms\n", stats_names[i], disk_stats.seconds[i] * 1e3);
+    }
+    fprintf(stderr, "  %-10s %10.3f ms\n", "total", total * 1e3);
+    fprintf(stderr, "  FAT entries decoded %ld, clusters touched %ld, bytes moved %ld\n", disk_stats.fat_entries,
+            disk_stats.clusters, disk_stats.bytes);
+    fprintf(stderr, "  I/O system calls %ld, page faults %ld minor, %ld major\n", disk_stats.syscalls, minor, major);
+    fprintf(stderr, "  files %ld in %ld extents, %ld fragmented\n", disk_stats.files, disk_stats.extents, disk_stats.fragmented);
+}
+
+void disk_stats_init(int *argc, char *argv[], const char *tool) {
+    // Turn stats on for --stats or --stats=json (taken out of argv) or $FATTOOLS_TRACE ("json" for JSON), and print
+    // them when the tool exits
+    const char *trace = getenv("FATTOOLS_TRACE");
+    int kept = 1;
+
+    if (trace != NULL && trace[0] != '\0' && strcmp(trace, "0") != 0) {
+        disk_stats.enabled = 1;
+        disk_stats.json = strcmp(trace, "json") == 0;
+    }
+    for (int i = 1; i < *argc; i++) {
+        if (strcmp(argv[i], "--stats") == 0 || strcmp(argv[i], "--stats=json") == 0) {
+            disk_stats.enabled = 1;
+            disk_stats.json = argv[i][7] == '=';
+        } else {
+            argv[kept++] = argv[i];
+        }
+    }
+    *argc = kept;
+    argv[kept] = NULL;
+    if (!disk_stats.enabled) {
+        return;
+    }
+    disk_stats.tool = tool;
+    disk_stats.phase = STATS_OPEN;
+    clock_gettime(CLOCK_MONOTONIC, &disk_stats.start);
+    disk_stats.phase_start = disk_stats.start;
+    getrusage(RUSAGE_SELF, &disk_stats.usage);
+    atexit(stats_report);
+}
+
+void disk_stats_phase(int phase) {
+    // Charge the time since the last switch to the current phase and move on to another
+    struct timespec now;
+
+    if (!disk_stats.enabled) {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    disk_stats.seconds[disk_stats.phase] += stats_elapsed(&disk_stats.phase_start, &now);
+    disk_stats.phase_start = now;
+    disk_stats.phase = phase;
+}
+
+void disk_stats_file(int extent_count, long clusters, long bytes) {
+    // Count a file read or written, with the runs its clusters are in
+    STATS_ADD(files, 1);
+    STATS_ADD(extents, extent_count);
+    STATS_ADD(fragmented, extent_count > 1);
+    STATS_ADD(clusters, clusters);
+    STATS_ADD(bytes, bytes);
+}
@@ -0,0 +1,48 @@
+#ifndef DISKSTATS_H
+#define DISKSTATS_H
+
+#include <time.h>
+#include <sys/resource.h>
+
+// Phases of a run that --stats and $FATTOOLS_TRACE time
+#define STATS_OPEN 0      // Opening and mapping the image
+#define STATS_FAT 1       // Decoding the FAT
+#define STATS_DIRECTORY 2 // Indexing directories and resolving paths
+#define STATS_COPY 3      // Moving file data (or a whole request, when diskd does the work)
+#define STATS_FLUSH 4     // Committing changes and closing
+#define STATS_PHASES 5
+
+// Timings and counters of one run; nothing is counted or timed unless enabled
+typedef struct {
+    int enabled;
+    int json;                      // One JSON line instead of the text report
+    const char *tool;
+    int phase;                     // Phase the time since phase_start goes to
+    struct timespec start, phase_start;
+    double seconds[STATS_PHASES];
+    struct rusage usage;           // At the start of the run
+    long fat_entries;              // FAT entries decoded
+    long clusters;                 // Data clusters of the files read or written
+    long bytes;                    // File bytes moved
+    long syscalls;                 // I/O system calls made by the library
+    long files;                    // Files read or written
+    long extents;                  // Runs of adjacent clusters those files were in
+    long fragmented;               // Files in more than one run
+} disk_stats_state;
+
+extern disk_stats_state disk_stats;
+
+// Counters are updated with relaxed atomics, as diskget -r copies from several threads
+#define STATS_ADD(field, n)                                                           \
+    do {                                                                              \
+        if (disk_stats.enabled) {                                                     \
+            __atomic_add_fetch(&disk_stats.field, (n), __ATOMIC_RELAXED);             \
+        }                                                                             \
+    } while (0)
+#define STATS_SYSCALL() STATS_ADD(syscalls, 1)
+
+void disk_stats_init(int *argc, char *argv[], const char *tool);
+void disk_stats_phase(int phase);
+void disk_stats_file(int extent_count, long clusters, long bytes);
+
+#endif
@@ -0,0 +1,330 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "fat12.h"
+#include "dirindex.h"
+#include "diskops.h"
+#include "diskimage.h"
+#include "crc32c.h"
+
+#define SYNC_DELETE 0 // First pass: drop what the host no longer has, freeing its space
+#define SYNC_COPY 1   // Second pass: create, add and update
+
+// Entry of a host directory
+typedef struct {
+    char *name;
+    struct stat status;
+} sync_item;
+
+// What the walk changed (or with -n would change)
+typedef struct {
+    int added;
+    int updated;
+    int deleted;
+    int created;
+    int unchanged;
+    int failed;
+} sync_totals;
+
+// Image and options shared by the whole walk
+typedef struct {
+    char *image;
+    fat_table *fat;
+    dir_index *index;
+    int checksum; // Compare contents of files whose size and time agree
+    int dry_run;
+    sync_totals totals;
+} sync_state;
+
+static int sync_compare(const void *a, const void *b) {
+    // Order host entries by name, ignoring case as image lookups do, for bsearch
+    return dir_name_compare(((const sync_item *)a)->name, ((const sync_item *)b)->name);
+}
+
+static void sync_free(sync_item *items, int count) {
+    // Free a host listing
+    for (int i = 0; i < count; i++) {
+        free(items[i].name);
+    }
+    free(items);
+}
+
+static sync_item *sync_read_host(const char *path, int *count) {
+    // List the files and directories of a host directory that can be stored in the image, sorted by name
+    DIR *host = opendir(path);
+    sync_item *items = NULL;
+    int used = 0, size = 0;
+    struct dirent *entry;
+    char full[4096];
+
+    if (host == NULL) {
+        return NULL;
+    }
+    while ((entry = readdir(host)) != NULL) {
+        sync_item item;
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        if (!dir_storable_name(entry->d_name)) {
+            printf("Skipping %s/%s: %s\n", path, entry->d_name, disk_message(DISK_BAD_NAME));
+            continue;
+        }
+        snprintf(full, sizeof(full), "%s/%s", path, entry->d_name);
+        if (stat(full, &item.status) < 0 || (!S_ISREG(item.status.st_mode) && !S_ISDIR(item.status.st_mode))) {
+            printf("Skipping %s: not a regular file or directory\n", full);
+            continue;
+        }
+        if (used == size) {
+            size = size > 0 ? 2 * size : 64;
+            sync_item *grown = realloc(items, size * sizeof(sync_item));
+            if (grown == NULL) {
+                sync_free(items, used);
+                closedir(host);
+                return NULL;
+            }
+            items = grown;
+        }
+        item.name = strdup(entry->d_name);
+        if (item.name == NULL) {
+            sync_free(items, used);
+            closedir(host);
+            return NULL;
+        }
+        items[used++] = item;
+    }
+    closedir(host);
+
+    qsort(items, used, sizeof(sync_item), sync_compare);
+    for (int i = 1; i < used; i++) { // Two host names that differ only in case: keep the first
+        if (sync_compare(&items[i], &items[i - 1]) == 0) {
+            printf("Skipping %s/%s: same name as %s apart from case\n", path, items[i].name, items[i - 1].name);
+            free(items[i].name);
+            memmove(&items[i], &items[i + 1], (used - i - 1) * sizeof(sync_item));
+            used--;
+            i--;
+        }
+    }
+    *count = used;
+    return items != NULL ? items : malloc(sizeof(sync_item)); // Empty but not a failure
+}
+
+static int sync_host_crc(const char *path, long size, uint32_t *crc) {
+    // Checksum a host file
+    int fd = open(path, O_RDONLY);
+    char *data;
+
+    *crc = 0;
+    if (fd < 0) {
+        return -1;
+    }
+    if (size > 0) {
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+        *crc = crc32c(0, data, size);
+        munmap(data, size);
+    }
+    close(fd);
+    return 0;
+}
+
+static int sync_unchanged(sync_state *state, const char *host_path, sync_item *item, long entry) {
+    // True if the image's file has the host file's size and time to the minute (and contents, with -c)
+    unsigned char *fields = (unsigned char *)state->image + entry + 14;
+    uint32_t stored = fields[0] | fields[1] << 8 | (uint32_t)fields[2] << 16 | (uint32_t)fields[3] << 24;
+    uint32_t host_crc, image_crc = 0;
+
+    if (dir_entry_size(state->image, entry) != item->status.st_size || stored != disk_time_fields(item->status.st_mtime)) {
+        return 0;
+    }
+    if (!state->checksum) {
+        return 1;
+    }
+    return sync_host_crc(host_path, item->status.st_size, &host_crc) == 0 &&
+           disk_checksum(state->fat, dir_entry_cluster(state->fat, state->image, entry), item->status.st_size, &image_crc) == 0 &&
+           host_crc == image_crc;
+}
+
+static void sync_report(sync_state *state, const char *action, const char *image_path, int result) {
+    // Print one change, or why it failed
+    if (result == DISK_OK) {
+        printf("%s %s\n", action, image_path);
+    } else {
+        printf("Error: %s: %s\n", image_path, disk_message(result));
+        state->totals.failed++;
+    }
+}
+
+static void sync_directory(sync_state *state, const char *host_path, const char *image_path, int dir, int pass) {
+    // Bring one image directory (and everything below it) in line with a host directory; dir is -1 if it does not exist yet
+    int count;
+    sync_item *items = sync_read_host(host_path, &count);
+    char host_child[4096], image_child[4096];
+
+    if (items == NULL) {
+        printf("Error: cannot read %s\n", host_path);
+        state->totals.failed++;
+        return;
+    }
+
+    if (pass == SYNC_DELETE && dir >= 0) {
+        int range_count;
+        dir_range *ranges = dir_ranges(state->fat, dir, &range_count);
+        for (int r = 0; ranges != NULL && r < range_count; r++) {
+            for (long entry = ranges[r].offset; entry < ranges[r].offset + ranges[r].length; entry += DIR_ENTRY_SIZE) {
+                unsigned char *bytes = (unsigned char *)state->image + entry;
+                char name[DIR_NAME_MAX];
+                sync_item key, *item;
+
+                if (bytes[0] == 0x00) {
+                    r = range_count;
+                    break;
+                }
+                if (bytes[0] == 0xE5 || bytes[0] == '.' || bytes[11] == 0x0F || (bytes[11] & 0x08) != 0) {
+                    continue;
+                }
+                dir_entry_name(state->index, dir, entry, name); // Its long name if it has one
+                key.name = name;
+                item = bsearch(&key, items, count, sizeof(sync_item), sync_compare);
+                snprintf(image_child, sizeof(image_child), "%s%s%s", image_path, image_path[0] != '\0' ? "/" : "", name);
+                if (item == NULL || S_ISDIR(item->status.st_mode) != ((bytes[11] & 0x10) != 0)) {
+                    sync_report(state, "deleted", image_child, state->dry_run ? DISK_OK : disk_remove(state->image, state->fat, state->index, dir, entry, NULL, NULL, NULL));
+                    state->totals.deleted++;
+                } else if (S_ISDIR(item->status.st_mode)) {
+                    snprintf(host_child, sizeof(host_child), "%s/%s", host_path, item->name);
+                    sync_directory(state, host_child, image_child, dir_entry_cluster(state->fat, state->image, entry), pass);
+                }
+            }
+        }
+        free(ranges);
+    }
+
+    for (int i = 0; pass == SYNC_COPY && i < count; i++) {
+        sync_item *item = &items[i];
+        int is_directory = S_ISDIR(item->status.st_mode);
+        long entry = dir >= 0 ? dir_lookup_name(state->index, dir, item->name) : -1;
+
+        if (entry >= 0 && ((state->image[entry + 11] & 0x10) != 0) != is_directory) {
+            entry = -1; // Only with -n, where the other kind was not really deleted
+        }
+        snprintf(host_child, sizeof(host_child), "%s/%s", host_path, item->name);
+        snprintf(image_child, sizeof(image_child), "%s%s%s", image_path, image_path[0] != '\0' ? "/" : "", item->name);
+
+        if (is_directory) {
+            int child = entry >= 0 ? dir_entry_cluster(state->fat, state->image, entry) : -1;
+            if (entry < 0) {
+                int result = DISK_OK;
+                if (!state->dry_run && dir >= 0) {
+                    child = disk_make_directory(state->image, state->fat, state->index, item->name, dir, item->status.st_mtime);
+                    result = child < 0 ? -child : DISK_OK;
+                }
+                sync_report(state, "created", image_child, result);
+                if (result != DISK_OK) {
+                    continue;
+                }
+                state->totals.created++;
+            }
+            sync_directory(state, host_child, image_child, child, pass);
+        } else if (entry >= 0 && sync_unchanged(state, host_child, item, entry)) {
+            state->totals.unchanged++;
+        } else {
+            int result = DISK_OK;
+            int fd = -1;
+            if (!state->dry_run) {
+                fd = open(host_child, O_RDONLY);
+                if (fd < 0) {
+                    perror(host_child);
+                    state->totals.failed++;
+                    continue;
+                }
+                result = entry >= 0 ? disk_update(state->image, state->fat, entry, fd)
+                                    : disk_put(state->image, state->fat, state->index, fd, item->name, dir, NULL, NULL);
+                close(fd);
+            }
+            sync_report(state, entry >= 0 ? "updated" : "added", image_child, result);
+            if (result == DISK_OK && entry >= 0) {
+                state->totals.updated++;
+            } else if (result == DISK_OK) {
+                state->totals.added++;
+            }
+        }
+    }
+    sync_free(items, count);
+}
+
+int main(int argc, char *argv[]) {
+    // Main function to mirror a host directory tree into the image, changing only what differs
+    disk_image image;
+    fat_table fat;
+    dir_index index;
+    sync_state state;
+    struct stat host_status;
+    int opt;
+    int result = 0;
+
+    memset(&state, 0, sizeof(state));
+    while ((opt = getopt(argc, argv, "cn")) != -1) {
+        if (opt == 'c') {
+            state.checksum = 1;
+        } else if (opt == 'n') {
+            state.dry_run = 1;
+        } else {
+            optind = argc + 1;
+        }
+    }
+    if (optind != argc - 2) {
+        printf("Usage: disksync [-c] [-n] <disk image> <host directory>\n");
+        printf("  -c  also compare contents of files whose size and time agree\n");
+        printf("  -n  only print what would change\n");
+        return 1;
+    }
+    if (stat(argv[optind + 1], &host_status) < 0 || !S_ISDIR(host_status.st_mode)) {
+        printf("Error: %s is not a directory\n", argv[optind + 1]);
+        return 1;
+    }
+
+    if (disk_image_open(&image, argv[optind], state.dry_run ? 0 : IMAGE_WRITE) < 0) { // Open the disk image
+        perror("Error opening disk image");
+        return 1;
+    }
+    if (fat_load(&fat, image.data, image.size) < 0) {
+        printf("Error: failed to read FAT\n");
+        disk_image_close(&image);
+        return 1;
+    }
+    disk_image_attach(&image, &fat);
+    if (dir_index_init(&index, image.data, &fat) < 0) {
+        printf("Error: out of memory\n");
+        fat_release(&fat);
+        disk_image_close(&image);
+        return 1;
+    }
+    state.image = image.data;
+    state.fat = &fat;
+    state.index = &index;
+
+    sync_directory(&state, argv[optind + 1], "", DIR_ROOT, SYNC_DELETE);
+    sync_directory(&state, argv[optind + 1], "", DIR_ROOT, SYNC_COPY);
+
+    // Everything above goes to disk in one commit: data and entries, then the FAT, then the new locations
+    if (!state.dry_run && fat_commit(&fat) < 0) {
+        perror("Error syncing disk image");
+        result = 1;
+    }
+    printf("%s%d added, %d updated, %d deleted, %d directories created, %d unchanged\n", state.dry_run ? "Would be: " : "",
+           state.totals.added, state.totals.updated, state.totals.deleted, state.totals.created, state.totals.unchanged);
+
+    dir_index_release(&index);
+    fat_release(&fat);
+    disk_image_close(&image);
+    return result || state.totals.failed > 0;
+}
@@ -0,0 +1,763 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "fat12.h"
+#include "diskstats.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FAT_HAVE_SSSE3 1
+#endif
+
+static uint16_t fat_le16(const unsigned char *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t fat_le32(const unsigned char *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+int fat_read_geometry(fat_geometry *geo, const char *image, long image_size) {
+    // Derive the volume layout from the BIOS parameter block
+    const unsigned char *boot = (const unsigned char *)image;
+    long root_sectors, data_sectors, clusters;
+
+    if (image_size < 512) {
+        return -1;
+    }
+    geo->bytes_per_sector = fat_le16(boot + 11);
+    geo->sectors_per_cluster = boot[13];
+    geo->reserved_sectors = fat_le16(boot + 14);
+    geo->fat_copies = boot[16];
+    geo->root_entries = fat_le16(boot + 17);
+    geo->total_sectors = fat_le16(boot + 19) != 0 ? fat_le16(boot + 19) : fat_le32(boot + 32);
+    geo->sectors_per_fat = fat_le16(boot + 22) != 0 ? fat_le16(boot + 22) : fat_le32(boot + 36);
+
+    if ((geo->bytes_per_sector & (geo->bytes_per_sector - 1)) != 0 || geo->bytes_per_sector < 512 ||
+        geo->bytes_per_sector > 4096 || geo->sectors_per_cluster == 0 ||
+        (geo->sectors_per_cluster & (geo->sectors_per_cluster - 1)) != 0 ||
+        geo->reserved_sectors == 0 || geo->fat_copies == 0 || geo->sectors_per_fat == 0) {
+        return -1;
+    }
+
+    geo->cluster_size = geo->bytes_per_sector * geo->sectors_per_cluster;
+    root_sectors = ((long)geo->root_entries * 32 + geo->bytes_per_sector - 1) / geo->bytes_per_sector;
+    geo->fat_offset = (long)geo->reserved_sectors * geo->bytes_per_sector;
+    geo->root_offset = geo->fat_offset + (long)geo->fat_copies * geo->sectors_per_fat * geo->bytes_per_sector;
+    geo->data_offset = geo->root_offset + root_sectors * geo->bytes_per_sector;
+    data_sectors = geo->total_sectors - geo->data_offset / geo->bytes_per_sector;
+    if (data_sectors <= 0 || geo->data_offset > image_size) {
+        return -1;
+    }
+
+    // The FAT type follows from the cluster count alone
+    clusters = data_sectors / geo->sectors_per_cluster;
+    if (clusters < 4085) {
+        geo->width = 12;
+    } else if (clusters < 65525) {
+        geo->width = 16;
+    } else {
+        geo->width = 32;
+    }
+    geo->root_cluster = geo->width == 32 ? (int)fat_le32(boot + 44) : 0;
+    geo->label_offset = geo->width == 32 ? 71 : 43;
+    geo->fsinfo_offset = 0;
+    if (geo->width == 32) {
+        long sector = fat_le16(boot + 48);
+        long offset = sector * geo->bytes_per_sector;
+        if (sector != 0 && sector < geo->reserved_sectors && offset + 512 <= image_size &&
+            fat_le32(boot + offset) == 0x41615252 && fat_le32(boot + offset + 484) == 0x61417272) {
+            geo->fsinfo_offset = offset;
+        }
+    }
+    return 0;
+}
+
+static void fat_unpack12_scalar(const unsigned char *src, uint32_t *dst, int start, int count) {
+    // Unpack two 12-bit entries from every 3 bytes
+    for (int i = start; i < count; i += 2) {
+        const unsigned char *p = src + 3 * i / 2;
+        uint32_t pair = p[0] | (p[1] << 8) | (p[2] << 16);
+        dst[i] = pair & 0xFFF;
+        if (i + 1 < count) {
+            dst[i + 1] = pair >> 12;
+        }
+    }
+}
+
+#ifdef FAT_HAVE_SSSE3
+__attribute__((target("ssse3")))
+static int fat_unpack12_ssse3(const unsigned char *src, uint32_t *dst, int count, long avail) {
+    // Unpack 8 entries (12 bytes) per step with a single byte shuffle
+    const __m128i spread = _mm_setr_epi8(0, 1, 1, 2, 3, 4, 4, 5, 6, 7, 7, 8, 9, 10, 10, 11);
+    const __m128i even_mask = _mm_setr_epi16(0x0FFF, 0, 0x0FFF, 0, 0x0FFF, 0, 0x0FFF, 0);
+    const __m128i odd_mask = _mm_setr_epi16(0, 0x0FFF, 0, 0x0FFF, 0, 0x0FFF, 0, 0x0FFF);
+    const __m128i zero = _mm_setzero_si128();
+    int i = 0;
+
+    // Each step loads 16 bytes, so stay clear of the end of the FAT region
+    while (i + 8 <= count && 3L * i / 2 + 16 <= avail) {
+        __m128i raw = _mm_loadu_si128((const __m128i *)(src + 3 * i / 2));
+        __m128i lanes = _mm_shuffle_epi8(raw, spread);
+        __m128i even = _mm_and_si128(lanes, even_mask);
+        __m128i odd = _mm_and_si128(_mm_srli_epi16(lanes, 4), odd_mask);
+        __m128i entries = _mm_or_si128(even, odd);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_unpacklo_epi16(entries, zero));
+        _mm_storeu_si128((__m128i *)(dst + i + 4), _mm_unpackhi_epi16(entries, zero));
+        i += 8;
+    }
+    return i;
+}
+#endif
+
+static void fat_unpack12(fat_table *table, long fat_bytes) {
+    // 12-bit entries, then widen the reserved range 0xFF7-0xFFF to the shared markers
+    int done = 0;
+#ifdef FAT_HAVE_SSSE3
+    if (__builtin_cpu_supports("ssse3")) {
+        done = fat_unpack12_ssse3(table->fat, table->entry, table->count, fat_bytes);
+    }
+#endif
+    fat_unpack12_scalar(table->fat, table->entry, done, table->count);
+    for (int i = 0; i < table->count; i++) {
+        uint32_t v = table->entry[i];
+        table->entry[i] = v | (-(uint32_t)(v >= 0xFF7) & 0x0FFFF000);
+    }
+}
+
+static void fat_unpack16(fat_table *table) {
+    // 16-bit entries, with 0xFFF7-0xFFFF widened to the shared markers
+    for (int i = 0; i < table->count; i++) {
+        uint32_t v = fat_le16(table->fat + 2 * i);
+        table->entry[i] = v | (-(uint32_t)(v >= 0xFFF7) & 0x0FFF0000);
+    }
+}
+
+static void fat_unpack32(fat_table *table) {
+    // 32-bit entries, of which only the low 28 bits are used
+    for (int i = 0; i < table->count; i++) {
+        table->entry[i] = fat_le32(table->fat + 4 * i) & 0x0FFFFFFF;
+    }
+}
+
+static void fat_pack12(unsigned char *fat, const uint32_t *entry, int count, int cluster) {
+    // Re-pack the 3-byte group holding cluster and its neighbour
+    int even = cluster & ~1;
+    unsigned char *p = fat + 3 * even / 2;
+    int low = entry[even] & 0xFFF;
+
+    if (even + 1 < count) {
+        int high = entry[even + 1] & 0xFFF;
+        p[0] = low & 0xFF;
+        p[1] = ((low >> 8) & 0x0F) | ((high << 4) & 0xF0);
+        p[2] = (high >> 4) & 0xFF;
+    } else {
+        p[0] = low & 0xFF;
+        p[1] = (p[1] & 0xF0) | ((low >> 8) & 0x0F);
+    }
+}
+
+static void fat_pack16(unsigned char *fat, const uint32_t *entry, int count, int cluster) {
+    // Re-pack one 2-byte entry
+    unsigned char *p = fat + 2 * cluster;
+
+    if (cluster >= count) {
+        return;
+    }
+    p[0] = entry[cluster] & 0xFF;
+    p[1] = (entry[cluster] >> 8) & 0xFF;
+}
+
+static void fat_store32(unsigned char *p, uint32_t v) {
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+    p[2] = (v >> 16) & 0xFF;
+    p[3] = (v >> 24) & 0xFF;
+}
+
+static void fat_pack32(unsigned char *fat, const uint32_t *entry, int count, int cluster) {
+    // The top four bits are reserved and keep whatever the disk had
+    unsigned char *p = fat + 4 * cluster;
+
+    if (cluster >= count) {
+        return;
+    }
+    fat_store32(p, (fat_le32(p) & 0xF0000000) | (entry[cluster] & 0x0FFFFFFF));
+}
+
+static int fat_popcount(const uint64_t *map, int words);
+
+static void fat_build_free_map(fat_table *table) {
+    // Set one bit for every free cluster in a single pass over the table
+    int words = (table->count + 63) / 64;
+
+    for (int w = 0; w < words; w++) {
+        uint64_t bits = 0;
+        int base = w * 64;
+        int n = table->count - base < 64 ? table->count - base : 64;
+        for (int b = 0; b < n; b++) {
+            bits |= (uint64_t)(table->entry[base + b] == FAT_FREE) << b;
+        }
+        table->free_map[w] = bits;
+    }
+    table->free_map[0] &= ~(uint64_t)3; // Entries 0 and 1 are reserved
+    table->free_count = fat_popcount(table->free_map, words);
+}
+
+int fat_load(fat_table *table, char *image, long image_size) {
+    // Decode the first FAT copy into a flat table
+    fat_geometry *geo = &table->geo;
+    long fat_bytes, clusters;
+    int words;
+
+    table->entry = NULL;
+    table->dirty = NULL;
+    table->free_map = NULL;
+    table->touched = NULL;
+    table->touched_count = table->touched_size = 0;
+    table->touched_all = 0;
+    table->deferred = NULL;
+    table->deferred_count = table->deferred_size = 0;
+    memset(&table->io, 0, sizeof(fat_io));
+    if (fat_read_geometry(geo, image, image_size) < 0) {
+        return -1;
+    }
+    fat_bytes = geo->sectors_per_fat * geo->bytes_per_sector;
+    table->image = (unsigned char *)image;
+    table->fat = table->image + geo->fat_offset;
+
+    // Clusters that exist on the volume, that the FAT can describe, and that fit in the file
+    clusters = (geo->total_sectors - geo->data_offset / geo->bytes_per_sector) / geo->sectors_per_cluster;
+    if (clusters > fat_bytes * 8 / geo->width - 2) {
+        clusters = fat_bytes * 8 / geo->width - 2;
+    }
+    if (clusters > (image_size - geo->data_offset) / geo->cluster_size) {
+        clusters = (image_size - geo->data_offset) / geo->cluster_size;
+    }
+    if (clusters < 1 || clusters > 0x0FFFFFF5) {
+        return -1;
+    }
+    table->count = clusters + 2;
+
+    words = (table->count + 63) / 64;
+    table->entry = malloc(table->count * sizeof(uint32_t));
+    table->dirty = calloc(words, sizeof(uint64_t));
+    table->free_map = calloc(words, sizeof(uint64_t));
+    if (table->entry == NULL || table->dirty == NULL || table->free_map == NULL) {
+        fat_release(table);
+        return -1;
+    }
+
+    if (geo->width == 12) {
+        fat_unpack12(table, fat_bytes);
+    } else if (geo->width == 16) {
+        fat_unpack16(table);
+    } else {
+        fat_unpack32(table);
+    }
+    fat_build_free_map(table);
+    STATS_ADD(fat_entries, table->count);
+    table->cursor = 2;
+    if (geo->fsinfo_offset != 0) { // FAT32 keeps the allocation cursor on disk
+        uint32_t next = fat_le32(table->image + geo->fsinfo_offset + 492);
+        if (next >= 2 && next < (uint32_t)table->count) {
+            table->cursor = next;
+        }
+    }
+    return 0;
+}
+
+void fat_set(fat_table *table, int cluster, int value) {
+    // Change an entry in the decoded table and remember to write it back
+    uint64_t bit = (uint64_t)1 << (cluster % 64);
+
+    int was_free = (table->free_map[cluster / 64] & bit) != 0;
+
+    table->entry[cluster] = value & 0x0FFFFFFF;
+    table->dirty[cluster / 64] |= bit;
+    if (table->entry[cluster] == FAT_FREE) {
+        table->free_map[cluster / 64] |= bit;
+        table->free_count += !was_free;
+    } else {
+        table->free_map[cluster / 64] &= ~bit;
+        table->free_count -= was_free;
+    }
+}
+
+static void fat_mirror(fat_table *table, long start, long end) {
+    // Copy a changed byte range of the first FAT to every other copy and remember it for the commit
+    long fat_bytes = table->geo.sectors_per_fat * table->geo.bytes_per_sector;
+
+    for (int copy = 0; copy < table->geo.fat_copies; copy++) {
+        if (copy > 0) {
+            memcpy(table->fat + copy * fat_bytes + start, table->fat + start, end - start);
+        }
+        fat_touch(table, table->geo.fat_offset + copy * fat_bytes + start, end - start);
+    }
+}
+
+void fat_flush(fat_table *table) {
+    // Re-pack only the dirty entries, using the encoder for this FAT width, into every FAT copy
+    void (*pack)(unsigned char *, const uint32_t *, int, int) =
+        table->geo.width == 12 ? fat_pack12 : table->geo.width == 16 ? fat_pack16 : fat_pack32;
+    int words = (table->count + 63) / 64;
+    long run_start = -1, run_end = -1; // Bytes changed so far, mirrored as one range
+
+    for (int w = 0; w < words; w++) {
+        uint64_t bits = table->dirty[w];
+        while (bits != 0) {
+            int cluster = w * 64 + __builtin_ctzll(bits);
+            long start = table->geo.width == 12 ? 3 * (long)(cluster & ~1) / 2 : (long)cluster * table->geo.width / 8;
+            long end = start + (table->geo.width == 12 ? 3 : table->geo.width / 8);
+            pack(table->fat, table->entry, table->count, cluster);
+            if (run_start >= 0 && start > run_end + 64) { // Far from the last change: close that range
+                fat_mirror(table, run_start, run_end);
+                run_start = -1;
+            }
+            if (run_start < 0) {
+                run_start = start;
+            }
+            if (end > run_end || run_end < run_start) {
+                run_end = end;
+            }
+            bits &= bits - 1;
+        }
+        table->dirty[w] = 0;
+    }
+    if (run_start >= 0) {
+        fat_mirror(table, run_start, run_end);
+    }
+    if (table->geo.fsinfo_offset != 0) { // Free count and next-free hint
+        fat_store32(table->image + table->geo.fsinfo_offset + 488, fat_count_free(table));
+        fat_store32(table->image + table->geo.fsinfo_offset + 492, table->cursor);
+        fat_touch(table, table->geo.fsinfo_offset + 488, 8);
+    }
+}
+
+void fat_touch(fat_table *table, long offset, long length) {
+    // Record image bytes written through the mapping, to be synced by the next commit
+    if (length <= 0) {
+        return;
+    }
+    if (table->touched_count > 0) { // Appending to the previous range is the common case
+        fat_range *last = &table->touched[table->touched_count - 1];
+        if (offset >= last->offset && offset <= last->offset + last->length) {
+            if (offset + length > last->offset + last->length) {
+                last->length = offset + length - last->offset;
+            }
+            return;
+        }
+    }
+    if (table->touched_count == table->touched_size) {
+        int size = table->touched_size > 0 ? 2 * table->touched_size : 64;
+        fat_range *grown = realloc(table->touched, size * sizeof(fat_range));
+        if (grown == NULL) { // Fall back to syncing everything, as this range cannot be recorded
+            table->touched_all = 1;
+            return;
+        }
+        table->touched = grown;
+        table->touched_size = size;
+    }
+    table->touched[table->touched_count].offset = offset;
+    table->touched[table->touched_count].length = length;
+    table->touched_count++;
+}
+
+void fat_defer(fat_table *table, long offset, const void *bytes, int length) {
+    // Hold back a directory field until the commit has put the FAT on disk; written at once if memory runs out
+    if (table->deferred_count == table->deferred_size) {
+        int size = table->deferred_size > 0 ? 2 * table->deferred_size : 16;
+        fat_patch *grown = realloc(table->deferred, size * sizeof(fat_patch));
+        if (grown == NULL) {
+            memcpy(table->image + offset, bytes, length);
+            fat_touch(table, offset, length);
+            return;
+        }
+        table->deferred = grown;
+        table->deferred_size = size;
+    }
+    table->deferred[table->deferred_count].offset = offset;
+    table->deferred[table->deferred_count].length = length;
+    memcpy(table->deferred[table->deferred_count].bytes, bytes, length);
+    table->deferred_count++;
+}
+
+static int fat_by_offset(const void *a, const void *b) {
+    // Order ranges by where they start
+    long x = ((const fat_range *)a)->offset, y = ((const fat_range *)b)->offset;
+    return x < y ? -1 : x > y;
+}
+
+static int fat_sync_touched(fat_table *table) {
+    // Sync the recorded ranges, one msync (or store) per run of overlapping or adjacent pages
+    long page = sysconf(_SC_PAGESIZE);
+    long start = -1, end = -1;
+    int result = 0;
+    fat_range whole = {0, fat_cluster_offset(table, table->count)};
+    fat_range *ranges = table->touched;
+    int count = table->touched_count;
+
+    if (table->touched_all) { // Some range went unrecorded: the whole volume covers it
+        ranges = &whole;
+        count = 1;
+    }
+    qsort(ranges, count, sizeof(fat_range), fat_by_offset);
+    for (int i = 0; i <= count; i++) {
+        long from = 0, to = 0;
+        if (i < count) {
+            from = ranges[i].offset / page * page;
+            to = (ranges[i].offset + ranges[i].length + page - 1) / page * page;
+            if (start >= 0 && from <= end) {
+                end = to > end ? to : end;
+                continue;
+            }
+        }
+        if (start >= 0 && table->io.store != NULL) {
+            if (table->io.store(table->io.context, start, end - start) < 0) {
+                result = -1;
+            }
+        } else if (start >= 0) {
+            STATS_SYSCALL();
+            if (msync(table->image + start, end - start, MS_SYNC) < 0) {
+                result = -1;
+            }
+        }
+        start = from;
+        end = to;
+    }
+    if (count > 0 && table->io.flush != NULL && table->io.flush(table->io.context) < 0) {
+        result = -1;
+    }
+    table->touched_count = 0;
+    table->touched_all = 0;
+    return result;
+}
+
+int fat_commit(fat_table *table) {
+    // Make an operation durable: data first, then every FAT copy, then the directory fields that point at the chains
+    int result;
+
+    if (table->io.commit != NULL && table->io.commit(table->io.context, 0) < 0) {
+        return -1;
+    }
+    result = fat_sync_touched(table);
+    if (result == 0) { // The FAT must not point at data that may not be on disk
+        fat_flush(table);
+        result = fat_sync_touched(table);
+    }
+    if (result == 0) { // Nor the entries at chains the FAT may not have
+        for (int i = 0; i < table->deferred_count; i++) {
+            memcpy(table->image + table->deferred[i].offset, table->deferred[i].bytes, table->deferred[i].length);
+            fat_touch(table, table->deferred[i].offset, table->deferred[i].length);
+        }
+        table->deferred_count = 0;
+        result = fat_sync_touched(table);
+    }
+    if (table->io.commit != NULL && table->io.commit(table->io.context, 1) < 0) {
+        result = -1;
+    }
+    return result;
+}
+
+void fat_release(fat_table *table) {
+    // Free the decoded table
+    free(table->entry);
+    free(table->dirty);
+    free(table->free_map);
+    free(table->touched);
+    free(table->deferred);
+    table->entry = NULL;
+    table->dirty = NULL;
+    table->free_map = NULL;
+    table->touched = NULL;
+    table->deferred = NULL;
+    table->touched_count = table->deferred_count = 0;
+}
+
+#ifdef FAT_HAVE_SSSE3
+__attribute__((target("popcnt")))
+static int fat_popcount_hw(const uint64_t *map, int words) {
+    // Same loop, compiled to the popcnt instruction
+    int total = 0;
+    for (int w = 0; w < words; w++) {
+        total += __builtin_popcountll(map[w]);
+    }
+    return total;
+}
+#endif
+
+static int fat_popcount(const uint64_t *map, int words) {
+    // Count the bits set in a bitmap
+    int total = 0;
+
+#ifdef FAT_HAVE_SSSE3
+    if (__builtin_cpu_supports("popcnt")) {
+        return fat_popcount_hw(map, words);
+    }
+#endif
+    for (int w = 0; w < words; w++) {
+        total += __builtin_popcountll(map[w]);
+    }
+    return total;
+}
+
+int fat_count_free(const fat_table *table) {
+    // Free clusters, counted once when the bitmap was built and kept up to date since
+    return table->free_count;
+}
+
+int fat_find_free(const fat_table *table, int from) {
+    // Return the first free cluster at or after from, or -1 if there is none
+    int words = (table->count + 63) / 64;
+    int w;
+    uint64_t bits;
+
+    if (from < 2) {
+        from = 2;
+    }
+    if (from >= table->count) {
+        return -1;
+    }
+    w = from / 64;
+    bits = table->free_map[w] & (~(uint64_t)0 << (from % 64));
+    while (bits == 0) {
+        if (++w >= words) {
+            return -1;
+        }
+        bits = table->free_map[w];
+    }
+    return w * 64 + __builtin_ctzll(bits);
+}
+
+static int fat_run_end(const fat_table *table, int start) {
+    // Return the first cluster after start that is not free
+    int words = (table->count + 63) / 64;
+    int w = start / 64;
+    uint64_t used = ~table->free_map[w] & (~(uint64_t)0 << (start % 64));
+
+    while (used == 0) {
+        if (++w >= words) {
+            return table->count;
+        }
+        used = ~table->free_map[w];
+    }
+    int end = w * 64 + __builtin_ctzll(used);
+    return end < table->count ? end : table->count;
+}
+
+static int fat_collect_runs(const fat_table *table, fat_extent **runs) {
+    // List every free run in the bitmap in cluster order
+    int capacity = 64;
+    int n = 0;
+    int start = fat_find_free(table, 2);
+
+    *runs = malloc(capacity * sizeof(fat_extent));
+    if (*runs == NULL) {
+        return -1;
+    }
+    while (start >= 0) {
+        int end = fat_run_end(table, start);
+        if (n == capacity) {
+            fat_extent *grown = realloc(*runs, 2 * capacity * sizeof(fat_extent));
+            if (grown == NULL) {
+                free(*runs);
+                return -1;
+            }
+            *runs = grown;
+            capacity *= 2;
+        }
+        (*runs)[n].start = start;
+        (*runs)[n].length = end - start;
+        n++;
+        start = fat_find_free(table, end);
+    }
+    return n;
+}
+
+static int fat_by_length(const void *a, const void *b) {
+    // Longest run first, lower cluster number breaks ties
+    const fat_extent *x = a, *y = b;
+    if (x->length != y->length) {
+        return y->length - x->length;
+    }
+    return x->start - y->start;
+}
+
+static int fat_by_start(const void *a, const void *b) {
+    return ((const fat_extent *)a)->start - ((const fat_extent *)b)->start;
+}
+
+fat_extent *fat_alloc(fat_table *table, int clusters, int *extent_count) {
+    // Reserve clusters as few contiguous runs as possible and mark them used
+    fat_extent *runs;
+    int n = fat_collect_runs(table, &runs);
+    int best = -1;
+
+    *extent_count = 0;
+    if (n < 0) {
+        return NULL;
+    }
+    if (clusters <= 0) { // Empty files own no clusters
+        free(runs);
+        return NULL;
+    }
+
+    // Best fit: the smallest single run that holds the whole file, preferring
+    // runs at or after the cursor so consecutive files land next to each other
+    for (int i = 0; i < n; i++) {
+        if (runs[i].length < clusters) {
+            continue;
+        }
+        if (best < 0 || runs[i].length < runs[best].length ||
+            (runs[i].length == runs[best].length &&
+             runs[best].start < table->cursor && runs[i].start >= table->cursor)) {
+            best = i;
+        }
+    }
+
+    if (best >= 0) {
+        runs[0].start = runs[best].start;
+        runs[0].length = clusters;
+        n = 1;
+    } else {
+        // No single run is large enough: take the longest runs until it fits
+        int taken = 0;
+        int i;
+        qsort(runs, n, sizeof(fat_extent), fat_by_length);
+        for (i = 0; i < n && taken < clusters; i++) {
+            if (runs[i].length > clusters - taken) {
+                runs[i].length = clusters - taken;
+            }
+            taken += runs[i].length;
+        }
+        if (taken < clusters) {
+            free(runs);
+            return NULL;
+        }
+        n = i;
+        qsort(runs, n, sizeof(fat_extent), fat_by_start); // Keep the chain moving forward
+    }
+
+    for (int i = 0; i < n; i++) {
+        for (int c = runs[i].start; c < runs[i].start + runs[i].length; c++) {
+            table->free_map[c / 64] &= ~((uint64_t)1 << (c % 64));
+        }
+        table->free_count -= runs[i].length;
+    }
+    table->cursor = runs[n - 1].start + runs[n - 1].length;
+    *extent_count = n;
+    return runs;
+}
+
+int fat_alloc_run(fat_table *table, int max_clusters, int *length) {
+    // Reserve the next free run after the cursor, up to max_clusters long
+    int start = fat_find_free(table, table->cursor);
+    int end;
+
+    if (start < 0) {
+        start = fat_find_free(table, 2); // Wrap around to the start of the disk
+        if (start < 0) {
+            return -1;
+        }
+    }
+    end = fat_run_end(table, start);
+    if (end - start > max_clusters) {
+        end = start + max_clusters;
+    }
+    for (int c = start; c < end; c++) {
+        table->free_map[c / 64] &= ~((uint64_t)1 << (c % 64));
+    }
+    table->free_count -= end - start;
+    table->cursor = end;
+    *length = end - start;
+    return start;
+}
+
+void fat_link(fat_table *table, const fat_extent *extents, int extent_count) {
+    // Chain the extents together in order and terminate the last one
+    for (int i = 0; i < extent_count; i++) {
+        int last = extents[i].start + extents[i].length - 1;
+        for (int c = extents[i].start; c < last; c++) {
+            fat_set(table, c, c + 1);
+        }
+        fat_set(table, last, i + 1 < extent_count ? extents[i + 1].start : FAT_EOC);
+    }
+}
+
+fat_extent *fat_chain(const fat_table *table, int start, int *extent_count) {
+    // Walk a cluster chain once, merging consecutive clusters into extents
+    int capacity = 8;
+    int n = 0;
+    int steps = 0;
+    fat_extent *extents = malloc(capacity * sizeof(fat_extent));
+
+    *extent_count = 0;
+    if (extents == NULL) {
+        return NULL;
+    }
+    // A chain can visit each cluster at most once, so stop a cyclic one there
+    while (start >= 2 && start < table->count && steps++ < table->count) {
+        if (n > 0 && extents[n - 1].start + extents[n - 1].length == start) {
+            extents[n - 1].length++;
+        } else {
+            if (n == capacity) {
+                fat_extent *grown = realloc(extents, 2 * capacity * sizeof(fat_extent));
+                if (grown == NULL) {
+                    free(extents);
+                    return NULL;
+                }
+                extents = grown;
+                capacity *= 2;
+            }
+            extents[n].start = start;
+            extents[n].length = 1;
+            n++;
+        }
+        start = table->entry[start];
+        if (start >= FAT_EOC_MIN) {
+            break;
+        }
+    }
+    *extent_count = n;
+    return extents;
+}
+
+int fat_mark_chain(const fat_table *table, int start, uint64_t *map) {
+    // Set the bit of every cluster of a chain in map, stopping at a cluster already set (a loop, or a chain
+    // crossing one marked before), a free or bad one; returns the number of clusters set
+    int marked = 0;
+
+    while (start >= 2 && start < table->count) {
+        uint64_t bit = (uint64_t)1 << (start % 64);
+        int next = table->entry[start];
+        if ((map[start / 64] & bit) != 0 || next == FAT_FREE || next == FAT_BAD) {
+            break;
+        }
+        map[start / 64] |= bit;
+        marked++;
+        start = next;
+    }
+    return marked;
+}
+
+int fat_free_marked(fat_table *table, const uint64_t *map) {
+    // Free every cluster set in map with one pass over the table, a word of entries at a time; returns how many
+    int words = (table->count + 63) / 64;
+    int freed = 0;
+
+    for (int w = 0; w < words; w++) {
+        uint64_t bits = map[w];
+        if (bits == 0) {
+            continue;
+        }
+        for (uint64_t left = bits; left != 0; left &= left - 1) {
+            table->entry[w * 64 + __builtin_ctzll(left)] = FAT_FREE;
+        }
+        freed += __builtin_popcountll(bits & ~table->free_map[w]);
+        table->free_map[w] |= bits;
+        table->dirty[w] |= bits;
+    }
+    table->free_count += freed;
+    return freed;
+}
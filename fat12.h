@@ -0,0 +1,122 @@
+#ifndef FAT12_H
+#define FAT12_H
+
+#include <stdint.h>
+
+// Decoded entries are normalised to 28 bits whatever the FAT width, so the
+// end-of-chain and bad-cluster markers are the same for FAT12, 16 and 32
+#define FAT_FREE 0x0000000
+#define FAT_BAD 0x0FFFFFF7
+#define FAT_EOC 0x0FFFFFFF    // End of cluster chain
+#define FAT_EOC_MIN 0x0FFFFFF8 // Any value from here up also ends a chain
+
+// Layout of the volume, derived from the BIOS parameter block
+typedef struct {
+    int width;                // 12, 16 or 32 bits per FAT entry
+    int bytes_per_sector;
+    int sectors_per_cluster;
+    int cluster_size;         // Bytes per cluster
+    int reserved_sectors;
+    int fat_copies;
+    long sectors_per_fat;
+    long total_sectors;
+    int root_entries;         // Fixed root directory size (0 on FAT32)
+    long fat_offset;          // Byte offset of the first FAT copy
+    long root_offset;         // Byte offset of the fixed root directory (FAT12/16)
+    long data_offset;         // Byte offset of cluster 2
+    int root_cluster;         // First cluster of the root directory (FAT32)
+    int label_offset;         // Volume label in the boot sector
+    long fsinfo_offset;       // FAT32 FSInfo sector, 0 if there is none
+} fat_geometry;
+
+// Byte range of the image
+typedef struct {
+    long offset;
+    long length;
+} fat_range;
+
+// Small metadata write held back until the FAT it depends on is on disk
+typedef struct {
+    long offset;
+    int length;
+    unsigned char bytes[32];
+} fat_patch;
+
+// How image bytes reach memory and the file when the image is not simply mapped
+// (see diskimage.h); all NULL for a shared mapping, which msync writes back
+typedef struct {
+    int (*load)(void *context, long offset, long length);  // Make bytes readable before use
+    int (*store)(void *context, long offset, long length); // Write changed bytes to the file
+    int (*flush)(void *context);                           // Wait until stored bytes are on disk
+    int (*commit)(void *context, int done);                // Called as a commit starts (0) and ends (1)
+    void *context;
+} fat_io;
+
+// Whole FAT decoded once into a flat array of entries
+typedef struct {
+    fat_geometry geo;
+    unsigned char *image; // Start of the mapped image
+    unsigned char *fat;   // First FAT copy inside the mapped image
+    int count;            // Number of entries, including the two reserved ones
+    uint32_t *entry;      // Decoded entry values
+    uint64_t *dirty;      // One bit per entry changed since the last flush
+    uint64_t *free_map;   // One bit per free cluster, kept in step with fat_set
+    int free_count;       // Bits set in free_map, kept in step with it
+    int cursor;           // Next-fit hint: cluster after the last allocation
+    fat_range *touched;   // Image bytes written through the mapping since the last commit
+    int touched_count, touched_size;
+    int touched_all;      // Memory ran out recording a range: the next sync writes back the whole volume
+    fat_patch *deferred;  // Directory fields to write once the chains they point to are on disk
+    int deferred_count, deferred_size;
+    fat_io io;
+} fat_table;
+
+// Run of consecutive clusters
+typedef struct {
+    int start;
+    int length;
+} fat_extent;
+
+int fat_read_geometry(fat_geometry *geo, const char *image, long image_size);
+int fat_load(fat_table *table, char *image, long image_size);
+void fat_set(fat_table *table, int cluster, int value);
+void fat_flush(fat_table *table);
+void fat_touch(fat_table *table, long offset, long length);
+void fat_defer(fat_table *table, long offset, const void *bytes, int length);
+int fat_commit(fat_table *table);
+void fat_release(fat_table *table);
+int fat_count_free(const fat_table *table);
+int fat_find_free(const fat_table *table, int from);
+fat_extent *fat_alloc(fat_table *table, int clusters, int *extent_count);
+int fat_alloc_run(fat_table *table, int max_clusters, int *length);
+void fat_link(fat_table *table, const fat_extent *extents, int extent_count);
+fat_extent *fat_chain(const fat_table *table, int start, int *extent_count);
+int fat_mark_chain(const fat_table *table, int start, uint64_t *map);
+int fat_free_marked(fat_table *table, const uint64_t *map);
+
+static inline int fat_get(const fat_table *table, int cluster) {
+    // Look up the decoded value of a FAT entry
+    return table->entry[cluster];
+}
+
+static inline long fat_cluster_offset(const fat_table *table, int cluster) {
+    // Byte offset of a data cluster in the image
+    return table->geo.data_offset + (long)(cluster - 2) * table->geo.cluster_size;
+}
+
+static inline int fat_offset_cluster(const fat_table *table, long offset) {
+    // Data cluster that holds a byte offset of the image
+    return (int)((offset - table->geo.data_offset) / table->geo.cluster_size) + 2;
+}
+
+static inline int fat_need(const fat_table *table, long offset, long length) {
+    // Make a byte range of the image readable (and safe to partly overwrite) before touching it
+    return table->io.load != NULL ? table->io.load(table->io.context, offset, length) : 0;
+}
+
+static inline long fat_clusters_for(const fat_table *table, long bytes) {
+    // Number of clusters needed to hold bytes
+    return (bytes + table->geo.cluster_size - 1) / table->geo.cluster_size;
+}
+
+#endif
@@ -0,0 +1,67 @@
+#include <string.h>
+#include "manifest.h"
+
+static int manifest_blank(char c) {
+    // True for the characters that separate fields
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static char *manifest_field(char **cursor) {
+    // Take the next field off the line, NUL-terminating it in place: a run of non-blank characters, or a string in
+    // double quotes in which \" and \\ stand for " and \; NULL once the line is used up
+    char *p = *cursor;
+    char *field, *out;
+
+    while (manifest_blank(*p)) {
+        p++;
+    }
+    if (*p == '\0') {
+        *cursor = p;
+        return NULL;
+    }
+    if (*p != '"') {
+        field = p;
+        while (*p != '\0' && !manifest_blank(*p)) {
+            p++;
+        }
+        if (*p != '\0') {
+            *p++ = '\0';
+        }
+        *cursor = p;
+        return field;
+    }
+    field = out = ++p;
+    while (*p != '\0' && *p != '"') {
+        if (*p == '\\' && (p[1] == '"' || p[1] == '\\')) {
+            p++;
+        }
+        *out++ = *p++;
+    }
+    if (*p == '"') {
+        p++;
+    }
+    *out = '\0'; // Never past p, so the rest of the line is intact
+    *cursor = p;
+    return field;
+}
+
+int manifest_next(FILE *manifest, char *line, char **fields, int max_fields) {
+    // Skip blank lines and "#" comments, then split the line into fields
+    while (fgets(line, MANIFEST_LINE, manifest) != NULL) {
+        char *cursor = line;
+        int count = 0;
+        char *field;
+
+        while (manifest_blank(*cursor)) {
+            cursor++;
+        }
+        if (*cursor == '\0' || *cursor == '#') {
+            continue;
+        }
+        while (count < max_fields && (field = manifest_field(&cursor)) != NULL) {
+            fields[count++] = field;
+        }
+        return count;
+    }
+    return -1;
+}
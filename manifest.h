@@ -0,0 +1,13 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stdio.h>
+
+#define MANIFEST_LINE 4096
+
+// Read the next non-empty, non-comment line of a batch manifest and split it
+// on whitespace; a field in double quotes may hold blanks, with \" and \\ for
+// " and \. Returns the number of fields, or -1 at end of file.
+int manifest_next(FILE *manifest, char *line, char **fields, int max_fields);
+
+#endif